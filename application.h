@@ -9,30 +9,96 @@
 #include "linmath.h"
 #include "camera.h"
 #include "resources.h"
+#include "world.h"
+#include "benchmark.h"
+#include "profiler.h"
+#include "clusters.h"
+#include "deferred.h"
+#include "lightgrid.h"
+#include "overdraw.h"
 
 
 class Application
 {
   private:
     ResourceManager* RM;
+    // False when init was given the resources of another
+    bool ownsResources;
     std::vector<IGameObject*> objects;
-    std::vector<ISolid*> solids;
+    PhysicsWorld world;
+    OcclusionCuller occlusion;
+    LightClusters clusters;
+    LightGrid grid;
+    ObjectLights drawLights;
     CameraObject* camera;
     Floor* ramp;
     Floor* floor;
     Floor* xramp;
     Player* player;
     float time;
+    int frame;
+    const CameraPath* path;
+    ProfilerOverlay* overlay;
+    GBuffer* gbuffer;
+    // Objects that passed occlusion culling this frame
+    std::vector<IGameObject*> visible;
+    // Wireframes left for after the depth pre-pass and shading
+    std::vector<const ISolid*> boundaries;
+    // Draws the camera boundary and the visible objects with the current pass
+    void drawVisible(bool assignLights);
   public:
-    void init();
+    // Scopes of every loop, shown on screen with F3
+    Profiler profiler;
+    bool showProfiler;
+    // Shades the G-buffer instead of every mesh, toggled with F5
+    bool deferred;
+    // Shades every bounded object with its OBJECT_LIGHTS strongest lights instead of
+    // the lights of each cluster, toggled with F6. The deferred path ignores it.
+    bool objectLights;
+    // Lays down the depth of the forward path before shading it, so every pixel is
+    // shaded once, toggled with F7. The deferred path ignores it.
+    bool prepass;
+    // Shows the fragments shaded per pixel instead of the image, toggled with F8
+    bool showOverdraw;
+    OverdrawView* overdraw;
+    Application() : RM(nullptr), ownsResources(false), camera(nullptr), overlay(nullptr), gbuffer(nullptr), overdraw(nullptr) {}
+    // Deletes the objects and GL resources of init, with the context still current
+    ~Application();
+    Application(const Application&) = delete;
+    Application& operator=(const Application&) = delete;
+    // Loads the resources, or takes shared ones that outlive it, resets their lights
+    // and leaves them to the caller
+    void init(ResourceManager* shared = nullptr);
+    // Small static lights spread over the level, the same for every run
+    void addLights(int count);
+    // Copies of the floor below it, drawn first and from the deepest up, so every one
+    // adds a layer of overdraw where the floor is seen
+    void addLayers(int count);
+    // Moves the camera along the path from its start instead of by the keyboard, null to stop
+    void setCameraPath(const CameraPath* path) { this->path = path; frame = 0; }
     void loop(int w, int h, Keyboard* keyboard);
     bool shouldClose();
 };
 
-void Application::init()
+void Application::init(ResourceManager* shared)
 {
   time=0;
-  RM = new ResourceManager();
+  frame=0;
+  path=nullptr;
+  overlay = new ProfilerOverlay();
+  showProfiler = false;
+  gbuffer = new GBuffer();
+  deferred = false;
+  objectLights = false;
+  prepass = false;
+  showOverdraw = false;
+  overdraw = new OverdrawView();
+  ownsResources = !shared;
+  if (shared) {
+    RM = shared;
+    RM->resetLights();
+  }
+  else RM = new ResourceManager();
   gameInit(RM);
 
   camera = new CameraObject(1.25f);
@@ -41,34 +107,33 @@ void Application::init()
 
   floor = new Floor();
   Floor* back = new Floor();
-  back->rotation.x = -PI / 2;
-  back->position.z = 15;
-  back->position.y = 15;
+  back->transform.setRotation(Quaternion::FromAxisRotations(-PI / 2, 0, 0));
+  back->transform.setPosition(Vector3(0, 15, 15));
 
   Floor* left = new Floor();
-  left->rotation.z = PI / 2;
-  left->position.y = 15;
-  left->position.x = 15;
-  left->rotation.x = PI /2;
+  left->transform.setRotation(Quaternion::FromAxisRotations(PI / 2, 0, PI / 2));
+  left->transform.setPosition(Vector3(15, 15, 0));
 
   Floor* right = new Floor();
-  right->rotation.z = -PI / 2;
-  right->position.x = -15;
-  right->position.y = 15;
-  right->rotation.x = PI /2;
+  right->transform.setRotation(Quaternion::FromAxisRotations(PI / 2, 0, -PI / 2));
+  right->transform.setPosition(Vector3(-15, 15, 0));
 
   ramp = new Floor();
-  ramp->position.z = -30;
-  ramp->anchor.z = -15;
-  ramp->rotation.x = PI / 6;
+  ramp->transform.setPosition(Vector3(0, 0, -30));
+  ramp->transform.setAnchor(Vector3(0, 0, -15));
+  ramp->transform.setRotation(Quaternion::FromAxisRotations(PI / 6, 0, 0));
 
   xramp = new Floor();
-  xramp->position.z = -60;
-  xramp->position.y = 0;
+  xramp->transform.setPosition(Vector3(0, 0, -60));
+
+  // Stands on the visible floor, sunk into its boundary
+  Stack* stack = new Stack();
+  stack->transform.setRotation(Quaternion::FromAxisRotations(0, PI / 8, 0));
+  stack->transform.setPosition(Vector3(-8, STACK_SCALE, 6));
 
   player = new Player();
-  player->rotation.y = PI;
-  player->position.y += 2;
+  player->transform.setRotation(Quaternion::FromAxisRotations(0, PI, 0));
+  player->transform.translate(Vector3(0, 2, 0));
 
   objects.push_back(back);
   objects.push_back(floor);
@@ -76,44 +141,155 @@ void Application::init()
   objects.push_back(right);
   objects.push_back(ramp);
   objects.push_back(xramp);
+  objects.push_back(stack);
   objects.push_back(player);
 
-  solids.push_back(back);
-  solids.push_back(floor);
-  solids.push_back(left);
-  solids.push_back(right);
-  solids.push_back(ramp);
-  solids.push_back(xramp);
-  solids.push_back(camera);
-  solids.push_back(player);
+  world.add(back);
+  world.add(floor);
+  world.add(left);
+  world.add(right);
+  world.add(ramp);
+  world.add(xramp);
+  world.add(stack);
+  world.add(camera);
+  world.add(player);
+}
+
+Application::~Application()
+{
+  // The world only references the solids, the objects own them
+  for(IGameObject* o : objects) delete o;
+  delete camera;
+  delete overlay;
+  delete gbuffer;
+  delete overdraw;
+  if (ownsResources) delete RM;
+}
+
+void Application::addLights(int count)
+{
+  unsigned int seed = 1;
+  auto random = [&seed]() {
+    seed = seed * 1664525u + 1013904223u;
+    return (seed >> 8) / 16777216.0f;
+  };
+  for(int i=0; i<count; i++) {
+    Light light;
+    // Anywhere between the walls, from the back wall to the end of the ramps
+    light.position = Vector3(-15 + 30 * random(), 30 * random(), -75 + 90 * random());
+    light.color = Vector3(random(), random(), random());
+    light.color = light.color / std::max(light.color.x, std::max(light.color.y, light.color.z));
+    // A radius of 2, they overlap about as much as the lights of the level
+    light.brightness = 4 * LIGHT_CUTOFF;
+    RM->lightset.add(light);
+  }
+  logInfo("%i lights", RM->lightset.size());
+}
+
+void Application::addLayers(int count)
+{
+  std::vector<IGameObject*> layers;
+  for(int i=count; i>0; i--) {
+    Layer* layer = new Layer();
+    layer->transform.setPosition(Vector3(0, -0.5f * i, 0));
+    layers.push_back(layer);
+  }
+  objects.insert(objects.begin(), layers.begin(), layers.end());
 }
 
 void Application::loop(int w, int h, Keyboard* keyboard)
 {
-  xramp->position.y += 0.1f;
-  if (xramp->position.y > 50)
-    xramp->position.y = 0;
-  xramp->rotation.x += 0.01f;
-  float ratio = w / (float)h;
-  camera->update(ratio, keyboard);
-  camera->drawBoundary(camera);
-
-  for(IGameObject *obj : objects)
-    obj->update(keyboard);
-
-  for(ISolid *obj : solids) {
-      Vector3 normal;
-      float dis;
-      if (obj != player && player->intersects(obj, &normal, &dis)) {
-        player->onCollision(obj, normal, dis);
-      }
-      if (obj != camera && camera->intersects(obj, &normal, &dis)) {
-        camera->onCollision(obj, normal, dis);
+  profiler.beginFrame();
+  PROFILE_SCOPE(&profiler, "frame");
+  {
+    PROFILE_SCOPE(&profiler, "update");
+    Vector3 p = xramp->transform.getPosition();
+    p.y += 0.1f;
+    if (p.y > 50)
+      p.y = 0;
+    xramp->transform.setPosition(p);
+    xramp->transform.rotate(Quaternion::FromAxisAngle(Vector3(1, 0, 0), 0.01f));
+    world.wake(xramp);
+    float ratio = w / (float)h;
+    if (path) {
+      Vector3 pos;
+      Quaternion orientation;
+      path->pose(frame, &pos, &orientation);
+      camera->setPose(pos, orientation, ratio);
+      camera->velocity = Vector3(0);
+      camera->updateBoundary();
     }
+    else camera->update(ratio, keyboard);
+    if (keyboard->isPressed(TOGGLE_PROFILER)) showProfiler = !showProfiler;
+    if (keyboard->isPressed(TOGGLE_DEFERRED)) deferred = !deferred;
+    if (keyboard->isPressed(TOGGLE_OBJECT_LIGHTS)) objectLights = !objectLights;
+    if (keyboard->isPressed(TOGGLE_PREPASS)) prepass = !prepass;
+    if (keyboard->isPressed(TOGGLE_OVERDRAW)) showOverdraw = !showOverdraw;
+
+    for(IGameObject *obj : objects)
+      if (!obj->isSleeping()) obj->update(keyboard);
   }
 
-  for(IGameObject *obj : objects)
-    obj->draw(camera);
+  {
+    PROFILE_SCOPE(&profiler, "collision");
+    world.step();
+  }
+
+  {
+    PROFILE_SCOPE(&profiler, "draw");
+    {
+      PROFILE_SCOPE(&profiler, "lights");
+      clusters.update(camera, RM->lightset, w, h);
+      clusters.bind();
+      if (objectLights && !deferred) grid.build(RM->lightset);
+    }
+    {
+      // The floors hide most of the level, objects behind them are not submitted
+      PROFILE_SCOPE(&profiler, "occlusion");
+      occlusion.begin(camera->getMatrix());
+      for(IGameObject *obj : objects) obj->addOccluders(occlusion);
+      occlusion.rasterize();
+      visible.clear();
+      for(IGameObject *obj : objects) {
+        AABB bounds;
+        if (!obj->getBounds(&bounds) || occlusion.isVisible(bounds)) visible.push_back(obj);
+      }
+    }
+    if (showOverdraw) overdraw->begin(w, h);
+    else if (deferred) gbuffer->begin(w, h);
+    bool depthFirst = prepass && !deferred;
+    if (depthFirst) {
+      PROFILE_SCOPE(&profiler, "depth");
+      RM->setPass(DEPTH_PASS);
+      boundaryQueue = &boundaries;
+      glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+      drawVisible(false);
+      boundaries.clear();
+      glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+      glDepthFunc(GL_EQUAL);
+      glDepthMask(GL_FALSE);
+    }
+    RM->setPass(showOverdraw ? OVERDRAW_PASS : deferred ? GBUFFER_PASS : FORWARD_PASS);
+    drawVisible(objectLights && !deferred && !showOverdraw);
+    if (depthFirst) {
+      glDepthFunc(GL_LESS);
+      glDepthMask(GL_TRUE);
+      boundaryQueue = nullptr;
+      for(const ISolid* solid : boundaries) drawBoundary(solid, camera);
+      boundaries.clear();
+    }
+    RM->setPass(FORWARD_PASS);
+    if (showOverdraw) overdraw->resolve();
+    else if (deferred) {
+      PROFILE_SCOPE(&profiler, "shading");
+      gbuffer->resolve(camera);
+    }
+  }
+  if (showProfiler) {
+    PROFILE_SCOPE(&profiler, "overlay");
+    overlay->draw(profiler.lastFrame(), w, h);
+  }
+  frame++;
 
 
   time+=0.03f;
@@ -123,4 +299,19 @@ void Application::loop(int w, int h, Keyboard* keyboard)
   RM->lightset[1].position.z = -11 * cos(time);
 }
 
+void Application::drawVisible(bool assignLights)
+{
+  drawBoundary(camera, camera);
+  for(IGameObject *obj : visible) {
+    AABB bounds;
+    // Objects without bounds keep the lights of the clusters
+    if (assignLights && obj->getBounds(&bounds)) {
+      grid.assign(bounds, drawLights);
+      RM->setObjectLights(&drawLights);
+    }
+    obj->draw(camera);
+    RM->setObjectLights(nullptr);
+  }
+}
+
 bool Application::shouldClose() { return false; }
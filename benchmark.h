@@ -0,0 +1,125 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <stdio.h>
+#include <math.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include "vec.h"
+#include "utils.h"
+
+// Frames rendered before any timing is recorded, while caches and drivers settle
+#define BENCHMARK_WARMUP 60
+
+// Fixed camera flight through the level of Application::init, the same for every run.
+// It circles the room at varying height while looking at the player.
+class CameraPath {
+  private:
+    int period;
+  public:
+    // Frames for one round
+    CameraPath(int period = 600) : period(period) {}
+    void pose(int frame, Vector3* pos, Quaternion* orientation) const;
+};
+
+void CameraPath::pose(int frame, Vector3* pos, Quaternion* orientation) const
+{
+  float t = 2 * PI * (frame % period) / period;
+  *pos = Vector3(11 * sin(t), 14 + 4 * sin(2 * t), -11 * cos(t));
+  Vector3 dir = (Vector3(0, 9, 0) - *pos).normalized();
+  // Camera::update yaws around the world y axis first and pitches in view space after
+  float pitch = -asinf(dir.y), yaw = atan2f(dir.x, -dir.z);
+  *orientation = Quaternion::FromAxisAngle(Vector3(1, 0, 0), pitch) * Quaternion::FromAxisAngle(Vector3(0, 1, 0), yaw);
+}
+
+// Distribution of a per frame measurement in milliseconds
+class FrameSamples {
+  private:
+    std::vector<double> samples;
+  public:
+    void add(double ms) { samples.push_back(ms); }
+    size_t size() const { return samples.size(); }
+    // Nearest rank, p from 0 to 1
+    double percentile(double p) const;
+    // Writes an object with the mean, median, 95th and 99th percentile and maximum
+    void writeJSON(FILE* f) const;
+};
+
+double FrameSamples::percentile(double p) const
+{
+  std::vector<double> sorted = samples;
+  std::sort(sorted.begin(), sorted.end());
+  return sorted[std::min(sorted.size() - 1, (size_t)std::max(1.0, ceil(p * sorted.size())) - 1)];
+}
+
+void FrameSamples::writeJSON(FILE* f) const
+{
+  if (samples.empty()) {
+    fprintf(f, "null");
+    return;
+  }
+  double sum = 0;
+  for(double s : samples) sum += s;
+  fprintf(f, "{ \"mean\": %.4f, \"median\": %.4f, \"p95\": %.4f, \"p99\": %.4f, \"max\": %.4f }",
+          sum / samples.size(), percentile(0.5), percentile(0.95), percentile(0.99), percentile(1));
+}
+
+struct BenchmarkReport {
+  // Times of one profiler scope, named by its path from the top like frame/draw
+  struct Pass {
+    std::string path;
+    FrameSamples cpu, gpu;
+  };
+  int width, height;
+  const char* renderer;
+  FrameSamples frame;
+  std::vector<Pass> passes;
+  // Takes the nodes of a frame in depth first order, as given by Profiler::onFrame
+  template <typename Node> void addProfile(const std::vector<Node> &nodes);
+  bool write(const char* filename) const;
+};
+
+template <typename Node>
+void BenchmarkReport::addProfile(const std::vector<Node> &nodes)
+{
+  std::vector<std::string> paths(nodes.size());
+  for(size_t i=0; i<nodes.size(); i++) {
+    paths[i] = nodes[i].parent < 0 ? nodes[i].name : paths[nodes[i].parent] + "/" + nodes[i].name;
+    size_t p = 0;
+    while(p < passes.size() && passes[p].path != paths[i]) p++;
+    if (p == passes.size()) passes.push_back(Pass{ paths[i] });
+    passes[p].cpu.add(nodes[i].cpuMs);
+    passes[p].gpu.add(nodes[i].gpuMs);
+  }
+}
+
+// Written to stdout without a filename
+bool BenchmarkReport::write(const char* filename) const
+{
+  FILE* f = filename ? fopen(filename, "w") : stdout;
+  if (!f) return false;
+  fprintf(f, "{\n");
+  fprintf(f, "  \"renderer\": \"%s\",\n", renderer);
+  fprintf(f, "  \"resolution\": [%i, %i],\n", width, height);
+  fprintf(f, "  \"warmup\": %i,\n", BENCHMARK_WARMUP);
+  fprintf(f, "  \"frames\": %zu,\n", frame.size());
+  fprintf(f, "  \"frame_ms\": ");
+  frame.writeJSON(f);
+  // Scopes that did not run in every frame have fewer samples
+  fprintf(f, ",\n  \"passes\": {");
+  for(size_t i=0; i<passes.size(); i++) {
+    fprintf(f, "%s\n    \"%s\": {\n      \"frames\": %zu,\n      \"cpu_ms\": ", i ? "," : "", passes[i].path.c_str(), passes[i].cpu.size());
+    passes[i].cpu.writeJSON(f);
+    fprintf(f, ",\n      \"gpu_ms\": ");
+    passes[i].gpu.writeJSON(f);
+    fprintf(f, "\n    }");
+  }
+  fprintf(f, "\n  }\n}\n");
+  bool ok = !ferror(f);
+  if (filename) fclose(f);
+  return ok;
+}
+
+#endif
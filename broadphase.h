@@ -0,0 +1,259 @@
+#ifndef BROADPHASE_H
+#define BROADPHASE_H
+
+#include <vector>
+#include "vec.h"
+
+// Margin added around every leaf so that small movements don't require a reinsert
+#define AABB_MARGIN 0.2f
+
+// Dynamic bounding volume tree. Leaves hold fattened AABBs and a user pointer,
+// inner nodes the union of their children. Siblings are picked by the surface
+// area heuristic on insertion.
+class DynamicTree {
+  private:
+    struct Node {
+      AABB box;
+      int parent, left, right;
+      void* data;
+      // Filter bits of a leaf, or the union over all leaves below an inner node
+      unsigned int bits;
+      bool isLeaf() const { return left == -1; }
+    };
+    std::vector<Node> nodes;
+    int root, freeList;
+    size_t leafCount;
+
+    int allocate();
+    void release(int node);
+    void insertLeaf(int leaf);
+    void removeLeaf(int leaf);
+    void refit(int node);
+  public:
+    DynamicTree() : root(-1), freeList(-1), leafCount(0) {}
+
+    int insert(const AABB &box, void* data, unsigned int bits = ~0u);
+    void remove(int proxy);
+    // Returns true when the leaf had to be reinserted
+    bool move(int proxy, const AABB &box);
+    void* getData(int proxy) const { return nodes[proxy].data; }
+    const AABB& getFatAABB(int proxy) const { return nodes[proxy].box; }
+    unsigned int getBits(int proxy) const { return nodes[proxy].bits; }
+    void setBits(int proxy, unsigned int bits);
+    size_t size() const { return leafCount; }
+
+    // Calls callback(data) for every leaf overlapping box, stops early if it returns false.
+    // Subtrees without any bits in common with mask are skipped as a whole, the number
+    // of overlapping subtrees skipped that way is returned.
+    template <typename F> int query(const AABB &box, F callback, unsigned int mask = ~0u) const;
+    // Calls callback(data, maxT) for every leaf hit by the ray before maxT. The callback
+    // returns the new maxT, so returning the distance of a hit clips the remaining search.
+    template <typename F> void raycast(const Ray &ray, float maxT, F callback) const;
+};
+
+int DynamicTree::allocate()
+{
+  if (freeList == -1) {
+    nodes.push_back(Node());
+    freeList = nodes.size() - 1;
+    nodes[freeList].parent = -1;
+  }
+  int node = freeList;
+  freeList = nodes[node].parent;
+  nodes[node].parent = nodes[node].left = nodes[node].right = -1;
+  nodes[node].data = nullptr;
+  nodes[node].bits = 0;
+  return node;
+}
+
+void DynamicTree::release(int node)
+{
+  nodes[node].parent = freeList;
+  nodes[node].left = nodes[node].right = -2;
+  freeList = node;
+}
+
+void DynamicTree::refit(int node)
+{
+  while(node != -1) {
+    Node &n = nodes[node];
+    n.box = AABB::merge(nodes[n.left].box, nodes[n.right].box);
+    n.bits = nodes[n.left].bits | nodes[n.right].bits;
+    node = n.parent;
+  }
+}
+
+void DynamicTree::insertLeaf(int leaf)
+{
+  if (root == -1) {
+    root = leaf;
+    nodes[root].parent = -1;
+    return;
+  }
+
+  // Descend towards the cheapest sibling
+  const AABB box = nodes[leaf].box;
+  int index = root;
+  while(!nodes[index].isLeaf()) {
+    const Node &n = nodes[index];
+    float area = n.box.surfaceArea();
+    float combined = AABB::merge(n.box, box).surfaceArea();
+    float cost = 2 * combined;
+    float inherited = 2 * (combined - area);
+
+    float costs[2];
+    int children[2] = { n.left, n.right };
+    for(int i=0; i<2; i++) {
+      const Node &c = nodes[children[i]];
+      float merged = AABB::merge(c.box, box).surfaceArea();
+      costs[i] = c.isLeaf() ? merged + inherited : merged - c.box.surfaceArea() + inherited;
+    }
+
+    if (cost < costs[0] && cost < costs[1]) break;
+    index = costs[0] < costs[1] ? children[0] : children[1];
+  }
+
+  int sibling = index;
+  int oldParent = nodes[sibling].parent;
+  int parent = allocate();
+  nodes[parent].parent = oldParent;
+  nodes[parent].left = sibling;
+  nodes[parent].right = leaf;
+  nodes[parent].box = AABB::merge(box, nodes[sibling].box);
+  nodes[parent].bits = nodes[leaf].bits | nodes[sibling].bits;
+  nodes[sibling].parent = parent;
+  nodes[leaf].parent = parent;
+
+  if (oldParent == -1) root = parent;
+  else if (nodes[oldParent].left == sibling) nodes[oldParent].left = parent;
+  else nodes[oldParent].right = parent;
+
+  refit(nodes[parent].parent);
+}
+
+void DynamicTree::removeLeaf(int leaf)
+{
+  if (leaf == root) {
+    root = -1;
+    return;
+  }
+
+  int parent = nodes[leaf].parent;
+  int grandParent = nodes[parent].parent;
+  int sibling = nodes[parent].left == leaf ? nodes[parent].right : nodes[parent].left;
+
+  if (grandParent == -1) {
+    root = sibling;
+    nodes[sibling].parent = -1;
+  } else {
+    if (nodes[grandParent].left == parent) nodes[grandParent].left = sibling;
+    else nodes[grandParent].right = sibling;
+    nodes[sibling].parent = grandParent;
+    refit(grandParent);
+  }
+  release(parent);
+}
+
+int DynamicTree::insert(const AABB &box, void* data, unsigned int bits)
+{
+  int leaf = allocate();
+  nodes[leaf].box = box.fattened(AABB_MARGIN);
+  nodes[leaf].data = data;
+  nodes[leaf].bits = bits;
+  insertLeaf(leaf);
+  leafCount++;
+  return leaf;
+}
+
+void DynamicTree::remove(int proxy)
+{
+  removeLeaf(proxy);
+  release(proxy);
+  leafCount--;
+}
+
+bool DynamicTree::move(int proxy, const AABB &box)
+{
+  if (nodes[proxy].box.contains(box)) return false;
+  removeLeaf(proxy);
+  nodes[proxy].box = box.fattened(AABB_MARGIN);
+  insertLeaf(proxy);
+  return true;
+}
+
+void DynamicTree::setBits(int proxy, unsigned int bits)
+{
+  nodes[proxy].bits = bits;
+  // Bits of ancestors can only be recomputed from both children
+  for(int node = nodes[proxy].parent; node != -1; node = nodes[node].parent)
+    nodes[node].bits = nodes[nodes[node].left].bits | nodes[nodes[node].right].bits;
+}
+
+template <typename F>
+int DynamicTree::query(const AABB &box, F callback, unsigned int mask) const
+{
+  int skipped = 0;
+  if (root == -1) return skipped;
+  int stack[64];
+  std::vector<int> overflow;
+  int top = 0;
+  stack[top++] = root;
+  while(top > 0 || !overflow.empty()) {
+    int index;
+    if (!overflow.empty()) { index = overflow.back(); overflow.pop_back(); }
+    else index = stack[--top];
+
+    const Node &n = nodes[index];
+    if (!n.box.overlaps(box)) continue;
+    if (!(n.bits & mask)) {
+      skipped++;
+      continue;
+    }
+    if (n.isLeaf()) {
+      if (!callback(n.data)) return skipped;
+      continue;
+    }
+    if (top + 2 <= 64) {
+      stack[top++] = n.left;
+      stack[top++] = n.right;
+    } else {
+      overflow.push_back(n.left);
+      overflow.push_back(n.right);
+    }
+  }
+  return skipped;
+}
+
+template <typename F>
+void DynamicTree::raycast(const Ray &ray, float maxT, F callback) const
+{
+  if (root == -1) return;
+  Vector3 invDir = ray.inverseDir();
+  std::vector<int> stack;
+  stack.reserve(64);
+  stack.push_back(root);
+  while(!stack.empty()) {
+    int index = stack.back();
+    stack.pop_back();
+    const Node &n = nodes[index];
+    if (!n.box.intersects(ray.origin, invDir, maxT)) continue;
+    if (n.isLeaf()) {
+      maxT = callback(n.data, maxT);
+      if (maxT <= 0) return;
+      continue;
+    }
+
+    // Visit the nearer child first so that closest hit queries clip early
+    float tl, tr;
+    bool hl = nodes[n.left].box.intersects(ray.origin, invDir, maxT, &tl);
+    bool hr = nodes[n.right].box.intersects(ray.origin, invDir, maxT, &tr);
+    if (hl && hr) {
+      stack.push_back(tl < tr ? n.right : n.left);
+      stack.push_back(tl < tr ? n.left : n.right);
+    }
+    else if (hl) stack.push_back(n.left);
+    else if (hr) stack.push_back(n.right);
+  }
+}
+
+#endif
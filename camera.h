@@ -4,25 +4,39 @@
 #include <math.h>
 #include "linmath.h"
 
+// Clip planes of the projection
+#define CAMERA_NEAR 0.1f
+#define CAMERA_FAR 1000.0f
+
 class Camera
 {
 private:
-   float fov;
+   float fov, ratio;
    Matrix4 matrix;
    void calcMatrix(float ratio);
 
 public:
-   Vector3 pos, viewDir;
+   Vector3 pos;
+   // Rotation from world to view space
+   Quaternion orientation;
    Camera(float fov);
+   Vector3 viewDir() const { return orientation.conjugate().rotate(Vector3(0, 0, -1)); }
    virtual void update(float ratio, const Keyboard* keyboard);
+   // Places the camera directly instead of following the keyboard
+   void setPose(const Vector3 &pos, const Quaternion &orientation, float ratio);
    Matrix4 getMatrix() const { return matrix; }
+   // Vertical field of view in radians and width over height
+   float getFov() const { return fov; }
+   float getRatio() const { return ratio; }
 };
 
 
 Camera::Camera(float fov)
 {
-  viewDir = Vector3(0, 0, 1); 
+  // Looking down the positive z axis
+  orientation = Quaternion::FromAxisRotations(0, 3.1415926f, 0);
   this->fov = fov;
+  this->ratio = 1;
 }
 
 void Camera::update(float ratio, const Keyboard* keyboard)
@@ -30,6 +44,7 @@ void Camera::update(float ratio, const Keyboard* keyboard)
   float speed = 0.5f;
   float rot_speed = 0.02f;
 
+  Vector3 viewDir = this->viewDir();
   Vector3 move_dir = Vector3(viewDir.x, 0, viewDir.z).normalize();
   Vector3 unitY = Vector3(0, 1, 0);
 
@@ -42,12 +57,6 @@ void Camera::update(float ratio, const Keyboard* keyboard)
   // Up/down move vector
   Vector3 move_vert = unitY * speed;
 
-  // Tangent to view vector in xz plane
-  Vector3 view_tan = Vector3::cross(move_dir, unitY).normalize() * rot_speed;
-
-  // Tangent to view vector and view tangent
-  Vector3 view_bitan = Vector3::cross(viewDir, view_tan).normalize() * rot_speed;
-
   if (keyboard->isDown(MOVE_FORWARD))   pos += move_par; 
   if (keyboard->isDown(MOVE_BACKWARD))  pos -= move_par;
   if (keyboard->isDown(MOVE_LEFT))      pos -= move_tan;
@@ -55,40 +64,36 @@ void Camera::update(float ratio, const Keyboard* keyboard)
   if (keyboard->isDown(MOVE_UP))        pos += move_vert;
   if (keyboard->isDown(MOVE_DOWN))      pos -= move_vert;
 
-  // Change to adding tangent or bi-tangent and then normalizing
-  if (keyboard->isDown(LOOK_UP)) {
-    float ny = viewDir.y + view_bitan.y;
-    if (ny < 0.99 && ny > -0.99) 
-      viewDir += view_bitan;
-  }
+  // Yaw turns around the world up axis, pitch around the view space x axis
+  if (keyboard->isDown(LOOK_LEFT))  orientation = orientation * Quaternion::FromAxisAngle(unitY, -rot_speed);
+  if (keyboard->isDown(LOOK_RIGHT)) orientation = orientation * Quaternion::FromAxisAngle(unitY, rot_speed);
 
-  if (keyboard->isDown(LOOK_DOWN)) {
-    float ny = viewDir.y - view_bitan.y;
+  float pitch = 0;
+  if (keyboard->isDown(LOOK_UP))    pitch -= rot_speed;
+  if (keyboard->isDown(LOOK_DOWN))  pitch += rot_speed;
+  if (pitch != 0) {
+    Quaternion pitched = Quaternion::FromAxisAngle(Vector3(1, 0, 0), pitch) * orientation;
+    float ny = pitched.conjugate().rotate(Vector3(0, 0, -1)).y;
     if (ny < 0.99 && ny > -0.99)
-      viewDir -= view_bitan;
+      orientation = pitched;
   }
+  orientation = orientation.normalized();
+  calcMatrix(ratio);
+}
 
-  if (keyboard->isDown(LOOK_LEFT))      viewDir -= view_tan;
-  if (keyboard->isDown(LOOK_RIGHT))     viewDir += view_tan;
-  viewDir.normalize();
+void Camera::setPose(const Vector3 &pos, const Quaternion &orientation, float ratio)
+{
+  this->pos = pos;
+  this->orientation = orientation;
   calcMatrix(ratio);
 }
 
 void Camera::calcMatrix(float screenRatio)
 {
-  float theta, phi;
-  Vector3 xz = Vector3(viewDir.x, 0, viewDir.z).normalize();
-
-  theta = -atan2(xz.x, -xz.z);
-  if (theta < 0)
-    theta = theta + 2 * 3.1415926f;
-
-  phi = atan2(viewDir.y, sqrt(viewDir.x * viewDir.x + viewDir.z * viewDir.z));
-
-  Matrix4 p = Matrix4::FromPerspective(fov, screenRatio, 0.1f, 1000.0f);
+  ratio = screenRatio;
+  Matrix4 p = Matrix4::FromPerspective(fov, screenRatio, CAMERA_NEAR, CAMERA_FAR);
   Matrix4 t = Matrix4::FromTranslation(-pos);
-  Matrix4 r = Matrix4::FromAxisRotations(phi, theta, 0);
-  matrix = p * r * t;
+  matrix = p * orientation.toMatrix() * t;
 }
 
 
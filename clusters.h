@@ -0,0 +1,170 @@
+#ifndef CLUSTERS_H
+#define CLUSTERS_H
+
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+#include "vec.h"
+#include "camera.h"
+#include "light.h"
+#include "workers.h"
+
+// Screen tiles by depth slices, the slices grow exponentially from CLUSTER_NEAR to
+// CLUSTER_FAR. The first and last also hold everything before and beyond them.
+// The fragment shaders repeat these.
+#define CLUSTER_X 16
+#define CLUSTER_Y 9
+#define CLUSTER_Z 24
+#define CLUSTER_NEAR 1.0f
+#define CLUSTER_FAR 200.0f
+// Binding points of the storage buffers, fixed in the shaders as well
+#define CLUSTER_LIGHTS_BINDING 0
+#define CLUSTER_GRID_BINDING 1
+#define CLUSTER_INDICES_BINDING 2
+// Lights bounded per job
+#define CLUSTER_BATCH 256
+
+// Lists the lights that reach each cluster of the view frustum, so a fragment only
+// shades the lights of its own cluster. The lists are rebuilt on the CPU every frame,
+// one job per depth slice, and stored in three buffers:
+//   lights:  position and radius, color times brightness, two vec4 per light
+//   grid:    vec4 (tiles per pixel x, y, slice scale, slice bias), vec4 view depth
+//            plane, then (offset, count) into the indices for every cluster
+//   indices: light indices, cluster after cluster
+class LightClusters {
+  private:
+    // Bounding sphere of a light in view space and the slices it overlaps, inclusive,
+    // none when z0 > z1
+    struct Sphere {
+      Vector3 center;
+      float radius;
+      int z0, z1;
+    };
+    WorkerPool pool;
+    GLuint buffers[3];
+    std::vector<float> lights;
+    std::vector<Sphere> spheres;
+    // Light indices per cluster of every slice
+    std::vector<std::vector<std::vector<unsigned int>>> slices;
+    std::vector<unsigned int> grid, indices;
+    float zScale, zBias;
+    int slice(float depth) const { return std::min(CLUSTER_Z - 1, std::max(0, (int)(logf(depth) * zScale + zBias))); }
+    float sliceStart(int z) const { return z == 0 ? CAMERA_NEAR : expf((z - zBias) / zScale); }
+    void binSlice(int z, float tanX, float tanY);
+  public:
+    // Threads of the binning, by default one per core
+    LightClusters(int threads = 0);
+    ~LightClusters();
+    LightClusters(const LightClusters&) = delete;
+    LightClusters& operator=(const LightClusters&) = delete;
+    // Bins for a viewport of width by height and uploads the buffers
+    void update(const Camera* camera, const LightSet &set, int width, int height);
+    // Binds the buffers to their binding points for the next draws
+    void bind() const;
+    // Sum of the light counts of all clusters
+    size_t assignments() const { return indices.size(); }
+};
+
+LightClusters::LightClusters(int threads)
+  : pool(threads > 0 ? threads : std::max(1u, std::thread::hardware_concurrency())),
+    slices(CLUSTER_Z, std::vector<std::vector<unsigned int>>(CLUSTER_X * CLUSTER_Y)),
+    grid(CLUSTER_X * CLUSTER_Y * CLUSTER_Z * 2)
+{
+  glGenBuffers(3, buffers);
+  zScale = CLUSTER_Z / logf(CLUSTER_FAR / CLUSTER_NEAR);
+  zBias = -logf(CLUSTER_NEAR) * zScale;
+}
+
+LightClusters::~LightClusters()
+{
+  glDeleteBuffers(3, buffers);
+}
+
+// Bounds the part of every sphere within the depths of the slice by a box in view
+// space and divides each side by the depth that makes it widest on screen
+void LightClusters::binSlice(int z, float tanX, float tanY)
+{
+  std::vector<std::vector<unsigned int>> &cells = slices[z];
+  for(std::vector<unsigned int> &cell : cells) cell.clear();
+  float d0 = sliceStart(z), d1 = z == CLUSTER_Z - 1 ? CAMERA_FAR : sliceStart(z + 1);
+  for(size_t i=0; i<spheres.size(); i++) {
+    const Sphere &s = spheres[i];
+    if (z < s.z0 || z > s.z1) continue;
+    float depth = -s.center.z;
+    float dz = depth - std::min(std::max(depth, d0), d1);
+    float r = sqrtf(std::max(0.0f, s.radius * s.radius - dz * dz));
+    float x0 = s.center.x - r, x1 = s.center.x + r, y0 = s.center.y - r, y1 = s.center.y + r;
+    x0 /= (x0 < 0 ? d0 : d1) * tanX;
+    x1 /= (x1 > 0 ? d0 : d1) * tanX;
+    y0 /= (y0 < 0 ? d0 : d1) * tanY;
+    y1 /= (y1 > 0 ? d0 : d1) * tanY;
+    if (x1 < -1 || x0 > 1 || y1 < -1 || y0 > 1) continue;
+    int tx0 = std::max(0, (int)floorf((x0 + 1) / 2 * CLUSTER_X)), tx1 = std::min(CLUSTER_X - 1, (int)floorf((x1 + 1) / 2 * CLUSTER_X));
+    int ty0 = std::max(0, (int)floorf((y0 + 1) / 2 * CLUSTER_Y)), ty1 = std::min(CLUSTER_Y - 1, (int)floorf((y1 + 1) / 2 * CLUSTER_Y));
+    for(int y=ty0; y<=ty1; y++)
+      for(int x=tx0; x<=tx1; x++) cells[y * CLUSTER_X + x].push_back(i);
+  }
+}
+
+void LightClusters::update(const Camera* camera, const LightSet &set, int width, int height)
+{
+  int count = set.size();
+  float tanY = tanf(camera->getFov() / 2), tanX = tanY * camera->getRatio();
+  lights.resize(count * 8);
+  spheres.resize(count);
+  pool.run((count + CLUSTER_BATCH - 1) / CLUSTER_BATCH, [&](int job) {
+    for(int i=job*CLUSTER_BATCH; i<std::min(count, (job + 1) * CLUSTER_BATCH); i++) {
+      const Light &l = set[i];
+      float r = l.radius();
+      float* dst = &lights[i * 8];
+      dst[0] = l.position.x; dst[1] = l.position.y; dst[2] = l.position.z; dst[3] = r;
+      dst[4] = l.color.x * l.brightness; dst[5] = l.color.y * l.brightness; dst[6] = l.color.z * l.brightness; dst[7] = 0;
+      Sphere &s = spheres[i];
+      s.center = camera->orientation.rotate(l.position - camera->pos);
+      s.radius = r;
+      float zn = -s.center.z - r, zf = -s.center.z + r;
+      s.z0 = 1;
+      s.z1 = 0;
+      if (r > 0 && zf >= CAMERA_NEAR && zn <= CAMERA_FAR) {
+        s.z0 = slice(std::max(zn, CAMERA_NEAR));
+        s.z1 = slice(std::min(zf, CAMERA_FAR));
+      }
+    }
+  });
+  pool.run(CLUSTER_Z, [&](int z) { binSlice(z, tanX, tanY); });
+
+  indices.clear();
+  for(int z=0; z<CLUSTER_Z; z++) {
+    for(int c=0; c<CLUSTER_X * CLUSTER_Y; c++) {
+      const std::vector<unsigned int> &cell = slices[z][c];
+      int cluster = z * CLUSTER_X * CLUSTER_Y + c;
+      grid[cluster * 2] = indices.size();
+      grid[cluster * 2 + 1] = cell.size();
+      indices.insert(indices.end(), cell.begin(), cell.end());
+    }
+  }
+
+  Vector3 forward = camera->viewDir();
+  const float header[8] = { CLUSTER_X / (float)width, CLUSTER_Y / (float)height, zScale, zBias,
+                            forward.x, forward.y, forward.z, -Vector3::dot(forward, camera->pos) };
+  // Empty buffers cannot be bound, so there is always something to upload
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[0]);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, std::max<size_t>(1, lights.size()) * sizeof(float), lights.empty() ? nullptr : lights.data(), GL_STREAM_DRAW);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[1]);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(header) + grid.size() * sizeof(unsigned int), nullptr, GL_STREAM_DRAW);
+  glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(header), header);
+  glBufferSubData(GL_SHADER_STORAGE_BUFFER, sizeof(header), grid.size() * sizeof(unsigned int), grid.data());
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffers[2]);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, std::max<size_t>(1, indices.size()) * sizeof(unsigned int), indices.empty() ? nullptr : indices.data(), GL_STREAM_DRAW);
+  glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+void LightClusters::bind() const
+{
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_LIGHTS_BINDING, buffers[0]);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_GRID_BINDING, buffers[1]);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_INDICES_BINDING, buffers[2]);
+}
+
+#endif
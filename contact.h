@@ -0,0 +1,272 @@
+#ifndef CONTACT_H
+#define CONTACT_H
+
+#include <map>
+#include <vector>
+#include <algorithm>
+#include "vec.h"
+#include "physics.h"
+#include "meshcollider.h"
+
+#define MAX_CONTACTS 4
+
+class ISolid;
+
+struct Contact {
+  Vector3 point;
+  float depth;
+  // Identifies the reference axis and the penetrating vertex that generated
+  // this contact so it can be matched against last frame's manifold.
+  unsigned int feature;
+  // Accumulated impulses, reused as a warm start in the next frame
+  float normalImpulse, tangentImpulse[2];
+  Contact() : depth(0), feature(0), normalImpulse(0), tangentImpulse{0, 0} {}
+};
+
+struct ContactManifold {
+  ISolid *a, *b;
+  // Points from a towards b
+  Vector3 normal;
+  float depth;
+  std::array<Contact, MAX_CONTACTS> contacts;
+  int count;
+  unsigned int frame;
+  ContactManifold() : a(nullptr), b(nullptr), depth(0), count(0), frame(0) {}
+};
+
+inline unsigned int contactFeature(int axis, bool fromB, int vertex) {
+  return (axis << 8) | (fromB << 4) | vertex;
+}
+
+// Narrowphase: runs SAT on both boxes and collects the vertices of each box that lie
+// within the other as contact points, keeping the deepest MAX_CONTACTS. Separated
+// boxes report the axis of OBB::intersects that separates them.
+bool collide(const OBB &a, const OBB &b, ContactManifold* manifold, int* separating = nullptr)
+{
+  Vector3 normal;
+  float dist;
+  int axis = 0;
+  if (!a.intersects(b, &normal, &dist, &axis)) {
+    if (separating) *separating = axis;
+    return false;
+  }
+
+  normal.normalize();
+  if (Vector3::dot(b.center() - a.center(), normal) < 0) normal = -normal;
+  manifold->normal = normal;
+  manifold->depth = fabs(dist);
+  manifold->count = 0;
+
+  auto pa = a.getPoints();
+  auto pb = b.getPoints();
+  float maxA = -std::numeric_limits<float>::infinity();
+  float minB =  std::numeric_limits<float>::infinity();
+  for(int i=0; i<8; i++) {
+    maxA = std::max(maxA, Vector3::dot(pa[i], normal));
+    minB = std::min(minB, Vector3::dot(pb[i], normal));
+  }
+
+  std::array<Contact, 16> candidates;
+  int n = 0;
+  Affine3 ia = Affine3(a.m).inverted();
+  Affine3 ib = Affine3(b.m).inverted();
+  for(int i=0; i<8; i++) {
+    if (b.contains(ib, pa[i])) {
+      Contact &c = candidates[n++];
+      c.point = pa[i];
+      c.depth = Vector3::dot(pa[i], normal) - minB;
+      c.feature = contactFeature(axis, false, i);
+    }
+    if (a.contains(ia, pb[i])) {
+      Contact &c = candidates[n++];
+      c.point = pb[i];
+      c.depth = maxA - Vector3::dot(pb[i], normal);
+      c.feature = contactFeature(axis, true, i);
+    }
+  }
+
+  if (n == 0) {
+    // Edge on edge, no vertex is contained. Fall back to a single contact between the centers.
+    Contact &c = manifold->contacts[manifold->count++];
+    c.point = (a.center() + b.center()) * 0.5f;
+    c.depth = manifold->depth;
+    c.feature = contactFeature(axis, false, 0xf);
+    return true;
+  }
+
+  std::sort(candidates.begin(), candidates.begin() + n,
+      [](const Contact &l, const Contact &r) { return l.depth > r.depth; });
+  manifold->count = std::min(n, MAX_CONTACTS);
+  for(int i=0; i<manifold->count; i++) {
+    manifold->contacts[i] = candidates[i];
+    manifold->contacts[i].depth = std::max(0.0f, std::min(candidates[i].depth, manifold->depth));
+  }
+  return true;
+}
+
+// Narrowphase of a box against a triangle mesh placed by the transform of its boundary.
+// The deepest overlapping triangle provides the normal, which points from the mesh
+// towards the box, and the box vertices below its plane are the contact points.
+bool collideMesh(const TriangleMeshCollider &mesh, const OBB &meshBoundary, const OBB &box, ContactManifold* manifold)
+{
+  std::vector<MeshBoxHit> hits;
+  if (!mesh.overlapBox(box, meshBoundary.m, hits)) return false;
+
+  const MeshBoxHit* deepest = &hits[0];
+  for(const MeshBoxHit &h : hits)
+    if (h.depth > deepest->depth) deepest = &h;
+
+  Vector3 normal = deepest->normal;
+  manifold->normal = normal;
+  manifold->depth = deepest->depth;
+  manifold->count = 0;
+
+  // Deepest vertex of the box along the normal marks the reference plane
+  auto points = box.getPoints();
+  float lowest = std::numeric_limits<float>::infinity();
+  for(const Vector3 &p : points) lowest = std::min(lowest, Vector3::dot(p, normal));
+  float plane = lowest + deepest->depth;
+
+  std::array<Contact, 8> candidates;
+  int n = 0;
+  for(int i=0; i<8; i++) {
+    float depth = plane - Vector3::dot(points[i], normal);
+    if (depth <= 0) continue;
+    Contact &c = candidates[n++];
+    c.point = points[i];
+    c.depth = depth;
+    c.feature = (deepest->triangle << 4) | i;
+  }
+  // Deepest first, an insertion sort as there are at most eight
+  for(int i=1; i<n; i++) {
+    Contact c = candidates[i];
+    int j = i;
+    for(; j>0 && candidates[j-1].depth < c.depth; j--) candidates[j] = candidates[j-1];
+    candidates[j] = c;
+  }
+  manifold->count = std::min(n, MAX_CONTACTS);
+  for(int i=0; i<manifold->count; i++) manifold->contacts[i] = candidates[i];
+  if (manifold->count == 0) {
+    Contact &c = manifold->contacts[manifold->count++];
+    c.point = box.center();
+    c.depth = deepest->depth;
+    c.feature = deepest->triangle << 4 | 0xf;
+  }
+  return true;
+}
+
+// Open addressing table from pairs of bodies to the axis that separated them when they
+// were last tested. Bodies move little per frame, so it most likely still does.
+class SeparatingAxisCache {
+  private:
+    struct Slot {
+      unsigned long long key;
+      unsigned int frame;
+      int axis;
+    };
+    static const unsigned long long EMPTY = ~0ull;
+    std::vector<Slot> slots;
+    size_t used;
+    size_t slot(unsigned long long key) const {
+      size_t i = (key * 0x9E3779B97F4A7C15ull) >> 32;
+      for(i &= slots.size() - 1; slots[i].key != key && slots[i].key != EMPTY; i = (i + 1) & (slots.size() - 1));
+      return i;
+    }
+    void rehash(unsigned int frame);
+  public:
+    SeparatingAxisCache() : slots(16, Slot{ EMPTY, 0, -1 }), used(0) {}
+    // Axis as reported by OBB::intersects for the box of the lower id, -1 when unknown
+    int lookup(unsigned long long key) const {
+      const Slot &s = slots[slot(key)];
+      return s.key == key ? s.axis : -1;
+    }
+    void store(unsigned long long key, int axis, unsigned int frame);
+    size_t size() const { return used; }
+};
+
+void SeparatingAxisCache::store(unsigned long long key, int axis, unsigned int frame)
+{
+  size_t i = slot(key);
+  if (slots[i].key == EMPTY) {
+    if ((used + 1) * 2 > slots.size()) {
+      rehash(frame);
+      i = slot(key);
+    }
+    used++;
+  }
+  slots[i] = Slot{ key, frame, axis };
+}
+
+// Growing is the only time the table is rebuilt, so entries of pairs that were
+// not tested in the last frames are dropped then.
+void SeparatingAxisCache::rehash(unsigned int frame)
+{
+  std::vector<Slot> old;
+  old.swap(slots);
+  size_t kept = 0;
+  for(const Slot &s : old)
+    if (s.key != EMPTY && s.frame + 1 >= frame) kept++;
+  size_t capacity = 16;
+  while(capacity < kept * 4) capacity *= 2;
+  slots.assign(capacity, Slot{ EMPTY, 0, -1 });
+  used = 0;
+  for(const Slot &s : old) {
+    if (s.key == EMPTY || s.frame + 1 < frame) continue;
+    slots[slot(s.key)] = s;
+    used++;
+  }
+}
+
+// Keeps manifolds alive across frames per pair of bodies so that accumulated
+// impulses of matching features can be carried over.
+class ContactCache {
+  private:
+    std::map<unsigned long long, ContactManifold> manifolds;
+  public:
+    static unsigned long long key(unsigned int a, unsigned int b) {
+      if (a > b) std::swap(a, b);
+      return ((unsigned long long)a << 32) | b;
+    }
+    ContactManifold* update(unsigned long long key, const ContactManifold &fresh, bool warmStart);
+    void prune(unsigned int frame);
+    std::map<unsigned long long, ContactManifold>& all() { return manifolds; }
+    size_t size() const { return manifolds.size(); }
+};
+
+ContactManifold* ContactCache::update(unsigned long long key, const ContactManifold &fresh, bool warmStart)
+{
+  auto it = manifolds.find(key);
+  if (it == manifolds.end()) {
+    return &(manifolds[key] = fresh);
+  }
+
+  ContactManifold &old = it->second;
+  ContactManifold merged = fresh;
+  // A normal that rotated too far means the old impulses no longer apply
+  bool coherent = warmStart && old.frame + 1 == fresh.frame && Vector3::dot(old.normal, fresh.normal) > 0.95f;
+  if (coherent) {
+    for(int i=0; i<merged.count; i++) {
+      Contact &c = merged.contacts[i];
+      for(int j=0; j<old.count; j++) {
+        if (old.contacts[j].feature == c.feature) {
+          c.normalImpulse = old.contacts[j].normalImpulse;
+          c.tangentImpulse[0] = old.contacts[j].tangentImpulse[0];
+          c.tangentImpulse[1] = old.contacts[j].tangentImpulse[1];
+          break;
+        }
+      }
+    }
+  }
+  old = merged;
+  return &old;
+}
+
+void ContactCache::prune(unsigned int frame)
+{
+  for(auto it = manifolds.begin(); it != manifolds.end();) {
+    if (it->second.frame != frame) it = manifolds.erase(it);
+    else ++it;
+  }
+}
+
+#endif
@@ -0,0 +1,120 @@
+#ifndef DEFERRED_H
+#define DEFERRED_H
+
+#include "shaders.h"
+#include "camera.h"
+
+// Render targets of the deferred path, 8 bytes per pixel besides depth:
+//   albedo  RGBA8, alpha unused
+//   normal  RG16_SNORM, octahedral encoding of the world space normal
+//   depth   DEPTH_COMPONENT24, positions are rebuilt from it
+// Meshes are drawn into it with the GBUFFER_PASS programs, after which resolve shades
+// every pixel once with the lights of its cluster.
+class GBuffer {
+  private:
+    GLuint fbo, albedo, normal, depth;
+    int width, height;
+    // Framebuffer to resolve into, the one bound at begin
+    GLint target;
+    GLuint program, vao;
+    GLint uInverse, uCamPos, uAlbedo, uNormal, uDepth;
+    void allocate(int w, int h);
+  public:
+    GBuffer();
+    ~GBuffer();
+    GBuffer(const GBuffer&) = delete;
+    GBuffer& operator=(const GBuffer&) = delete;
+    // Binds and clears the buffer, resized to w by h when needed
+    void begin(int w, int h);
+    // Lights the buffer into the framebuffer bound before begin, with the buffers of
+    // LightClusters::bind
+    void resolve(const Camera* camera);
+};
+
+GBuffer::GBuffer() : albedo(0), normal(0), depth(0), width(0), height(0), target(0)
+{
+  glGenFramebuffers(1, &fbo);
+  program = GenerateProgram(CompileShaderF(GL_VERTEX_SHADER, "shaders/deferred_vs.c"),
+                            CompileShaderF(GL_FRAGMENT_SHADER, "shaders/deferred_fs.c"));
+  uInverse = glGetUniformLocation(program, "uInverse");
+  uCamPos = glGetUniformLocation(program, "uCamPos");
+  uAlbedo = glGetUniformLocation(program, "albedoTex");
+  uNormal = glGetUniformLocation(program, "normalTex");
+  uDepth = glGetUniformLocation(program, "depthTex");
+  // Core profiles draw nothing without a vertex array, even an empty one
+  glGenVertexArrays(1, &vao);
+}
+
+GBuffer::~GBuffer()
+{
+  const GLuint textures[3] = { albedo, normal, depth };
+  glDeleteTextures(3, textures);
+  glDeleteFramebuffers(1, &fbo);
+  glDeleteVertexArrays(1, &vao);
+  glDeleteProgram(program);
+}
+
+void GBuffer::allocate(int w, int h)
+{
+  if (albedo) {
+    const GLuint textures[3] = { albedo, normal, depth };
+    glDeleteTextures(3, textures);
+  }
+  width = w;
+  height = h;
+  auto texture = [w, h](GLenum internal, GLenum format, GLenum type) {
+    GLuint t;
+    glGenTextures(1, &t);
+    glBindTexture(GL_TEXTURE_2D, t);
+    glTexImage2D(GL_TEXTURE_2D, 0, internal, w, h, 0, format, type, nullptr);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    return t;
+  };
+  albedo = texture(GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE);
+  normal = texture(GL_RG16_SNORM, GL_RG, GL_SHORT);
+  depth = texture(GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT);
+  glBindTexture(GL_TEXTURE_2D, 0);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, albedo, 0);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, normal, 0);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depth, 0);
+  const GLenum attachments[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+  glDrawBuffers(2, attachments);
+  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    logError("G-buffer of %ix%i is incomplete", w, h);
+}
+
+void GBuffer::begin(int w, int h)
+{
+  glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &target);
+  if (w != width || h != height) allocate(w, h);
+  glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+}
+
+void GBuffer::resolve(const Camera* camera)
+{
+  glBindFramebuffer(GL_FRAMEBUFFER, target);
+  mat4x4 inverse;
+  camera->getMatrix().inverted().unpack(inverse);
+
+  glUseProgram(program);
+  glUniformMatrix4fv(uInverse, 1, GL_FALSE, (const GLfloat*)inverse);
+  glUniform3f(uCamPos, camera->pos.x, camera->pos.y, camera->pos.z);
+  const GLuint textures[3] = { albedo, normal, depth };
+  const GLint samplers[3] = { uAlbedo, uNormal, uDepth };
+  for(int i=0; i<3; i++) {
+    glUniform1i(samplers[i], i);
+    glActiveTexture(GL_TEXTURE0 + i);
+    glBindTexture(GL_TEXTURE_2D, textures[i]);
+  }
+  glActiveTexture(GL_TEXTURE0);
+
+  glBindVertexArray(vao);
+  glDrawArrays(GL_TRIANGLES, 0, 3);
+  glBindVertexArray(0);
+}
+
+#endif
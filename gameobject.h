@@ -5,55 +5,54 @@
 #include "keyboard.h"
 #include "camera.h"
 #include "resources.h"
-#include "physics.h"
+#include "solid.h"
+#include "occlusion.h"
 
 class IGameObject {
 public:
+  virtual ~IGameObject() {}
   virtual void update(Keyboard* keyboard) = 0;
   virtual void draw(Camera* camera) const = 0;
+  // Sleeping objects are skipped by the update loop
+  virtual bool isSleeping() const { return false; }
+  // World bounds of everything draw renders, objects without any are always drawn
+  virtual bool getBounds(AABB* out) const { return false; }
+  // Geometry that hides what lies behind it
+  virtual void addOccluders(OcclusionCuller &culler) const {}
 };
 
-class ISolid {
-  private:
-    OBB boundary;
-  protected:
-    void updateBoundary(Matrix4 m) { boundary.update(m); }
-  public:
-    virtual void onCollision(const ISolid* other, Vector3 normal, float dis) {}
-    virtual void updateBoundary() = 0; 
-    ISolid() : boundary(OBB(Vector3(0), Vector3(0))) {}
-    ISolid(OBB boundary) : boundary(boundary) {}
-    bool intersects(const ISolid* o, Vector3* normal, float* min_dis) {
-      return boundary.intersects(o->boundary, normal, min_dis);
-    }
-    void drawBoundary(const Camera* cam) const { boundary.draw(cam); }
-};
+// Wireframe mesh used to draw collision boundaries
+IMesh* boundaryMesh;
+// While set, drawBoundary queues the solids here instead of drawing them. Lines do
+// not reach the same depths in every program, so frames with a depth pre-pass draw
+// them after shading.
+std::vector<const ISolid*>* boundaryQueue = nullptr;
 
-class IMeshObject : public IGameObject {
-public:
-  Vector3 position, rotation, anchor, scale;
-protected:
-  IMeshObject() : scale(Vector3(1)) {}
-  IMeshObject(float scale) : scale(scale) {}
-  virtual Matrix4 getMvp() const {
-    Matrix4 t = Matrix4::FromTranslation(position);
-    Matrix4 r = Matrix4::FromAxisRotations(rotation);
-    Matrix4 s = Matrix4::FromScale(scale);
-    Matrix4 a1 = Matrix4::FromTranslation(anchor);
-    Matrix4 a2 = Matrix4::FromTranslation(-anchor);
-    return t * a2 * r * a1 * s;
+void drawBoundary(const ISolid* solid, const Camera* cam)
+{
+  if (boundaryQueue) {
+    boundaryQueue->push_back(solid);
+    return;
   }
-};
+  glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+  boundaryMesh->draw(cam, Affine3(solid->getBoundary().cubeTransform()));
+  glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+}
 
-class SolidMesh : public IMeshObject, public ISolid {
+class SolidMesh : public IGameObject, public SolidBody {
   public:
-    SolidMesh(float scale, OBB boundary) : IMeshObject(scale), ISolid(boundary) {}
-    void updateBoundary() override { ISolid::updateBoundary(getMvp()); }
+    SolidMesh(float scale, OBB boundary) : SolidBody(scale, boundary) {}
+    bool isSleeping() const override { return !awake; }
+  protected:
+    bool meshBounds(const IMesh* mesh, AABB* out) const {
+      *out = transformAABB(getMvp().toMatrix(), mesh->bounds);
+      return true;
+    }
 };
 
 class Floor : public SolidMesh {
 public:
-  Floor() : SolidMesh(15, OBB(Vector3(0), Vector3(1, 0.1, 1))) {}
+  Floor() : SolidMesh(FLOOR_SCALE, FLOOR_BOUNDARY) { category = LAYER_LEVEL; }
   static IMesh* mesh;
   void onCollision(const ISolid* other, Vector3 normal, float dis) override {
   }
@@ -63,56 +62,94 @@ public:
   void draw(Camera* camera) const override {
     mesh->draw(camera, getMvp(), 0.8f);
   }
+  bool getBounds(AABB* out) const override { return meshBounds(mesh, out); }
+  void addOccluders(OcclusionCuller &culler) const override {
+    culler.addOccluder(getMvp(), FLOOR_OCCLUDER, 1);
+  }
 };
 IMesh* Floor::mesh;
 
+// Floor that is always drawn and hides nothing, stacked to measure overdraw
+class Layer : public Floor {
+public:
+  bool getBounds(AABB* out) const override { return false; }
+  void addOccluders(OcclusionCuller &culler) const override {}
+};
+
 class Player : public SolidMesh {
 private:
 public:
-  Vector3 velocity;
-  Player() : SolidMesh(1, OBB(Vector3(0, 9, 0), Vector3(2, 9, 2))) {}
-  static IMesh* mesh;
-  void onCollision(const ISolid* other, Vector3 normal, float dis) override {
-    position += normal * dis;
-    velocity = Vector3::reflect(velocity, normal) * 0.37;
-    updateBoundary();
+  Player() : SolidMesh(1, PLAYER_BOUNDARY) {
+    inverseMass = 1;
+    category = LAYER_PLAYER;
   }
+  static IMesh* mesh;
   void update(Keyboard* keyboard) override {
-    velocity.y -= 0.004f;
+    // Gravity, integration and collision response are left to the PhysicsWorld
     velocity.z += 0.0001f;
-    position += velocity;
-    updateBoundary();
   };
   void draw(Camera* camera) const override {
-    Matrix4 mvp = getMvp();
+    const Affine3 &mvp = getMvp();
     mesh->draw(camera, mvp);
-    drawBoundary(camera);
+    drawBoundary(this, camera);
   };
+  // The arms reach outside the boundary, which is drawn as well
+  bool getBounds(AABB* out) const override {
+    meshBounds(mesh, out);
+    *out = AABB::merge(*out, getBoundary().getAABB());
+    return true;
+  }
 };
 IMesh* Player::mesh;
 
+class Crate : public SolidMesh {
+public:
+  Crate() : SolidMesh(CRATE_SCALE, CRATE_BOUNDARY) { inverseMass = 1; }
+  static IMesh* mesh;
+  void update(Keyboard* keyboard) override {}
+  void draw(Camera* camera) const override {
+    mesh->draw(camera, getMvp());
+  }
+  bool getBounds(AABB* out) const override { return meshBounds(mesh, out); }
+};
+IMesh* Crate::mesh;
+
+// Static boxes collided with by their triangles, not by the boundary around them
+class Stack : public SolidMesh {
+public:
+  Stack() : SolidMesh(STACK_SCALE, STACK_BOUNDARY) {
+    category = LAYER_LEVEL;
+    collider = stackCollider();
+  }
+  static IMesh* mesh;
+  void update(Keyboard* keyboard) override {
+    updateBoundary();
+  }
+  void draw(Camera* camera) const override {
+    mesh->draw(camera, getMvp());
+  }
+  bool getBounds(AABB* out) const override { return meshBounds(mesh, out); }
+};
+IMesh* Stack::mesh;
+
 class CameraObject : public Camera, public ISolid {
 public:
-  Vector3 velocity;
-  CameraObject(float fov) : Camera(fov), ISolid(OBB(Vector3(0,0,0), Vector3(1.5, 15, 1.5))) {}
+  CameraObject(float fov) : Camera(fov), ISolid(OBB(Vector3(0,0,0), Vector3(1.5, 15, 1.5))) {
+    inverseMass = 1;
+    allowSleep = false;
+    category = LAYER_CAMERA;
+    gravityScale = 12.5f;
+  }
   void updateBoundary() override {
     Matrix4 t = Matrix4::FromTranslation(pos);
     ISolid::updateBoundary(t);
   }
+  void translate(const Vector3 &d) override { pos += d; }
   void update(float ratio, const Keyboard* keyboard) override {
     Camera::update(ratio, keyboard);
     if (keyboard->isPressed(JUMP)) {
         velocity.y += 0.5;
     }
-    velocity.y -= 0.05f;
-    pos += velocity;
-    updateBoundary();
-  }
-  void onCollision(const ISolid* other, Vector3 normal, float dis) override {
-    (normal*dis).print();
-    pos += normal * dis;
-    velocity = (velocity + normal * dis) / 2;
-    velocity.print();
     updateBoundary();
   }
 };
@@ -121,7 +158,9 @@ void gameInit(ResourceManager* RM)
 {
   Floor::mesh = RM->getMesh("floor");
   Player::mesh = RM->getMesh("player");
-  OBB::mesh = RM->getMesh("cube");
+  Crate::mesh = RM->getMesh("cube");
+  Stack::mesh = RM->getMesh("stack");
+  boundaryMesh = RM->getMesh("cube");
 }
 
 #endif
@@ -0,0 +1,275 @@
+#ifndef HASHGRID_H
+#define HASHGRID_H
+
+#include <vector>
+#include <algorithm>
+#include "vec.h"
+
+// Cell size as a multiple of the median extent of the inserted boxes
+#define GRID_CELL_FACTOR 2.0f
+// Number of buckets per proxy in the hash table
+#define GRID_LOAD 2
+
+// Loose hashed uniform grid. Every box is kept in the one cell holding its center,
+// so a box only moves between cells when its center does. Cells are loose: a box may
+// stick out of its cell by at most half a cell, boxes too large for that are kept in
+// a separate list that every query scans. The cell size follows the median extent
+// of all boxes and is retuned whenever the number of boxes doubled or halved.
+// Offers the same interface as the DynamicTree.
+class HashGrid {
+  private:
+    struct Proxy {
+      AABB box;
+      void* data;
+      unsigned int bits;
+      int cell[3];
+      // Links within a bucket, or within the list of large boxes
+      int prev, next;
+      bool large;
+    };
+    std::vector<Proxy> proxies;
+    std::vector<int> buckets;
+    int largeList, freeList;
+    size_t proxyCount, tunedCount;
+    float cellSize;
+    // Holds every box inserted since the last retune
+    AABB bounds;
+
+    int bucket(const int* cell) const {
+      unsigned int h = (cell[0] * 73856093u) ^ (cell[1] * 19349663u) ^ (cell[2] * 83492791u);
+      return h & (buckets.size() - 1);
+    }
+    void cellOf(const Vector3 &p, int* cell) const {
+      cell[0] = (int)floorf(p.x / cellSize);
+      cell[1] = (int)floorf(p.y / cellSize);
+      cell[2] = (int)floorf(p.z / cellSize);
+    }
+    bool fits(const AABB &box) const {
+      Vector3 e = box.extent();
+      return std::max(e.x, std::max(e.y, e.z)) < cellSize;
+    }
+    int& head(int proxy) { return proxies[proxy].large ? largeList : buckets[bucket(proxies[proxy].cell)]; }
+    void link(int proxy);
+    void unlink(int proxy);
+    void retune();
+    // Calls visit(index) for every proxy overlapping box, stops early if it returns false
+    template <typename F> void candidates(const AABB &box, F visit) const;
+  public:
+    HashGrid() : largeList(-1), freeList(-1), proxyCount(0), tunedCount(0), cellSize(1) {}
+
+    int insert(const AABB &box, void* data, unsigned int bits = ~0u);
+    void remove(int proxy);
+    // Returns true when the box changed cells
+    bool move(int proxy, const AABB &box);
+    void* getData(int proxy) const { return proxies[proxy].data; }
+    const AABB& getFatAABB(int proxy) const { return proxies[proxy].box; }
+    unsigned int getBits(int proxy) const { return proxies[proxy].bits; }
+    void setBits(int proxy, unsigned int bits) { proxies[proxy].bits = bits; }
+    size_t size() const { return proxyCount; }
+    float getCellSize() const { return cellSize; }
+
+    // Same contracts as DynamicTree::query and DynamicTree::raycast, the mask is
+    // tested per box so the returned count is the number of boxes skipped.
+    template <typename F> int query(const AABB &box, F callback, unsigned int mask = ~0u) const;
+    template <typename F> void raycast(const Ray &ray, float maxT, F callback) const;
+};
+
+void HashGrid::link(int proxy)
+{
+  Proxy &p = proxies[proxy];
+  bounds = AABB::merge(bounds, p.box);
+  p.large = !fits(p.box);
+  if (!p.large) cellOf(p.box.center(), p.cell);
+  int &h = head(proxy);
+  p.prev = -1;
+  p.next = h;
+  if (h != -1) proxies[h].prev = proxy;
+  h = proxy;
+}
+
+void HashGrid::unlink(int proxy)
+{
+  Proxy &p = proxies[proxy];
+  if (p.prev != -1) proxies[p.prev].next = p.next;
+  else head(proxy) = p.next;
+  if (p.next != -1) proxies[p.next].prev = p.prev;
+}
+
+void HashGrid::retune()
+{
+  std::vector<float> extents;
+  for(const Proxy &p : proxies) {
+    if (p.data == nullptr) continue;
+    Vector3 e = p.box.extent();
+    extents.push_back(std::max(e.x, std::max(e.y, e.z)));
+  }
+  if (!extents.empty()) {
+    std::nth_element(extents.begin(), extents.begin() + extents.size() / 2, extents.end());
+    cellSize = std::max(extents[extents.size() / 2] * GRID_CELL_FACTOR, 1e-3f);
+  }
+
+  size_t count = 16;
+  while(count < proxyCount * GRID_LOAD) count *= 2;
+  buckets.assign(count, -1);
+  largeList = -1;
+  bounds = AABB();
+  for(size_t i=0; i<proxies.size(); i++)
+    if (proxies[i].data != nullptr) link(i);
+  tunedCount = proxyCount;
+}
+
+int HashGrid::insert(const AABB &box, void* data, unsigned int bits)
+{
+  int proxy;
+  if (freeList != -1) {
+    proxy = freeList;
+    freeList = proxies[proxy].next;
+  } else {
+    proxy = proxies.size();
+    proxies.push_back(Proxy());
+  }
+  Proxy &p = proxies[proxy];
+  p.box = box;
+  p.data = data;
+  p.bits = bits;
+  proxyCount++;
+
+  if (proxyCount > tunedCount * 2 || buckets.empty()) retune();
+  else link(proxy);
+  return proxy;
+}
+
+void HashGrid::remove(int proxy)
+{
+  unlink(proxy);
+  proxies[proxy].data = nullptr;
+  proxies[proxy].next = freeList;
+  freeList = proxy;
+  proxyCount--;
+  if (proxyCount * 2 < tunedCount) retune();
+}
+
+bool HashGrid::move(int proxy, const AABB &box)
+{
+  Proxy &p = proxies[proxy];
+  p.box = box;
+  bounds = AABB::merge(bounds, box);
+  int cell[3];
+  cellOf(box.center(), cell);
+  bool large = !fits(box);
+  if (large == p.large && (large || (cell[0] == p.cell[0] && cell[1] == p.cell[1] && cell[2] == p.cell[2])))
+    return false;
+  unlink(proxy);
+  link(proxy);
+  return true;
+}
+
+template <typename F>
+void HashGrid::candidates(const AABB &box, F visit) const
+{
+  for(int index = largeList; index != -1; index = proxies[index].next)
+    if (proxies[index].box.overlaps(box) && !visit(index)) return;
+  if (buckets.empty()) return;
+
+  // Boxes stick out of their cell by up to half a cell
+  int lo[3], hi[3];
+  cellOf(box.min - Vector3(cellSize * 0.5f), lo);
+  cellOf(box.max + Vector3(cellSize * 0.5f), hi);
+  auto inRange = [&](const Proxy &p) {
+    return p.cell[0] >= lo[0] && p.cell[0] <= hi[0] && p.cell[1] >= lo[1] && p.cell[1] <= hi[1] &&
+           p.cell[2] >= lo[2] && p.cell[2] <= hi[2];
+  };
+
+  // Scanning every bucket is cheaper than walking a range of more cells than that
+  double cells = (double)(hi[0] - lo[0] + 1) * (hi[1] - lo[1] + 1) * (hi[2] - lo[2] + 1);
+  if (cells >= buckets.size()) {
+    for(int b : buckets)
+      for(int index = b; index != -1; index = proxies[index].next)
+        if (inRange(proxies[index]) && proxies[index].box.overlaps(box) && !visit(index)) return;
+    return;
+  }
+
+  int cell[3];
+  for(cell[0] = lo[0]; cell[0] <= hi[0]; cell[0]++)
+  for(cell[1] = lo[1]; cell[1] <= hi[1]; cell[1]++)
+  for(cell[2] = lo[2]; cell[2] <= hi[2]; cell[2]++) {
+    for(int index = buckets[bucket(cell)]; index != -1; index = proxies[index].next) {
+      const Proxy &p = proxies[index];
+      // Other cells sharing this bucket are visited on their own turn
+      if (p.cell[0] != cell[0] || p.cell[1] != cell[1] || p.cell[2] != cell[2]) continue;
+      if (p.box.overlaps(box) && !visit(index)) return;
+    }
+  }
+}
+
+template <typename F>
+int HashGrid::query(const AABB &box, F callback, unsigned int mask) const
+{
+  int skipped = 0;
+  candidates(box, [&](int index) {
+    const Proxy &p = proxies[index];
+    if (!(p.bits & mask)) {
+      skipped++;
+      return true;
+    }
+    return (bool)callback(p.data);
+  });
+  return skipped;
+}
+
+template <typename F>
+void HashGrid::raycast(const Ray &ray, float maxT, F callback) const
+{
+  Vector3 invDir = ray.inverseDir();
+  // Only the part of the ray within the grid is walked
+  float t;
+  if (proxyCount == 0 || !bounds.intersects(ray.origin, invDir, maxT, &t)) return;
+  t = std::max(t, 0.0f);
+  Vector3 t1 = (bounds.min - ray.origin) * invDir, t2 = (bounds.max - ray.origin) * invDir;
+  float end = std::min(maxT, std::min(std::max(t1.x, t2.x), std::min(std::max(t1.y, t2.y), std::max(t1.z, t2.z))));
+
+  // Boxes hit by the ray, visited in order of entry so that closest hit queries clip early
+  std::vector<std::pair<float, int>> hits;
+  // A box is shorter than a piece along the main axis of the ray, so it can only be
+  // found again by the piece directly after the one that found it
+  std::vector<int> previous, current;
+  auto gather = [&](int index) {
+    float entry;
+    if (proxies[index].large) return true;
+    if (std::find(previous.begin(), previous.end(), index) != previous.end()) return true;
+    if (std::find(current.begin(), current.end(), index) != current.end()) return true;
+    current.push_back(index);
+    if (proxies[index].box.intersects(ray.origin, invDir, maxT, &entry)) hits.push_back({ std::max(entry, 0.0f), index });
+    return true;
+  };
+  auto report = [&]() {
+    std::sort(hits.begin(), hits.end());
+    for(const std::pair<float, int> &h : hits) {
+      if (h.first > maxT) break;
+      maxT = callback(proxies[h.second].data, maxT);
+      if (maxT <= 0) return false;
+    }
+    hits.clear();
+    return true;
+  };
+
+  for(int index = largeList; index != -1; index = proxies[index].next) {
+    float entry;
+    if (proxies[index].box.intersects(ray.origin, invDir, maxT, &entry)) hits.push_back({ std::max(entry, 0.0f), index });
+  }
+  if (!report()) return;
+
+  // Walk the ray in pieces of a cell, every box it hits overlaps the piece holding its entry point
+  float step = cellSize / std::max(fabs(ray.dir.x), std::max(fabs(ray.dir.y), fabs(ray.dir.z)));
+  for(; t <= std::min(end, maxT); t += step) {
+    AABB piece;
+    piece.consume(ray.at(t));
+    piece.consume(ray.at(std::min(t + step, end)));
+    candidates(piece, gather);
+    if (!report()) return;
+    std::swap(previous, current);
+    current.clear();
+  }
+}
+
+#endif
@@ -0,0 +1,29 @@
+#include <stdio.h>
+#include <string.h>
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#include "logger.h"
+#include "headless.h"
+#include "rasterbench.h"
+#include "querybench.h"
+#include "mathbench.h"
+
+// Physics only build, links without GLFW or GL. The CPU rasterizer needs neither.
+int main(int argc, char** argv) {
+  log_set_level(L_INFO);
+  if (argc > 1 && strcmp(argv[1], "--raster") == 0)
+    return runRasterBenchmark(argc - 1, argv + 1);
+  if (argc > 1 && strcmp(argv[1], "--occlusion") == 0)
+    return runOcclusionBenchmark(argc - 1, argv + 1);
+  if (argc > 1 && strcmp(argv[1], "--queries") == 0)
+    return runQueryBenchmark(argc - 1, argv + 1);
+  if (argc > 1 && strcmp(argv[1], "--meshes") == 0)
+    return runMeshBenchmark(argc - 1, argv + 1);
+  if (argc > 1 && strcmp(argv[1], "--broadphase") == 0)
+    return runBroadphaseBenchmark(argc - 1, argv + 1);
+  if (argc > 1 && strcmp(argv[1], "--math") == 0)
+    return runMathBenchmark(argc - 1, argv + 1);
+  return runHeadless(argc, argv);
+}
@@ -0,0 +1,351 @@
+#ifndef HEADLESS_H
+#define HEADLESS_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+#include "logger.h"
+#include "solid.h"
+#include "world.h"
+
+// Physics only scenes, stepped without any window or GL context. Every instance
+// owns its own world so many of them can run side by side, one per core.
+class HeadlessScene {
+  private:
+    std::vector<SolidBody*> bodies;
+    SolidBody* xramp;
+    // The thin plate of the tunnel scene and the crate fired at it
+    SolidBody *plate, *projectile;
+    // Half the width of the plate in its model space, which the projectile must cross within
+    float footprint;
+    SolidBody* add(SolidBody* body) {
+      body->updateBoundary();
+      world.add(body);
+      bodies.push_back(body);
+      return body;
+    }
+    SolidBody* addFloor() { return add(new SolidBody(FLOOR_SCALE, FLOOR_BOUNDARY)); }
+    SolidBody* addCrate() {
+      SolidBody* crate = new SolidBody(CRATE_SCALE, CRATE_BOUNDARY);
+      crate->inverseMass = 1;
+      return crate;
+    }
+    void buildDefault();
+    void buildStack(int variant);
+    void buildPile(int variant);
+    void buildTunnel(int variant);
+    void buildCrossing(int variant);
+    void buildSteps(int variant);
+  public:
+    PhysicsWorld world;
+    // Summed over all steps
+    long long pairsTested, pairsRejected, recomputations;
+    // Tested pairs the cached separating axis settled, and those it did not
+    long long axisHits, axisMisses;
+    // Solver iterations and final residuals, summed over all steps, and the steps
+    // that ran out of iterations before reaching the tolerance
+    long long solverIterations, unconverged;
+    int maxSolverIterations;
+    double residuals;
+    // Whether the projectile of the tunnel or crossing scene passed through the plate
+    bool tunneled;
+    // Variant selects a parameter of the scene, so that a batch doubles as a sweep
+    HeadlessScene(const std::string &name, int variant, BroadphaseType broadphase = BROADPHASE_TREE);
+    ~HeadlessScene() { for(SolidBody* b : bodies) delete b; }
+    bool valid() const { return !bodies.empty(); }
+    size_t bodyCount() const { return bodies.size(); }
+    void step();
+    // Sum over all body positions, compared between builds for regression runs
+    double checksum() const;
+};
+
+HeadlessScene::HeadlessScene(const std::string &name, int variant, BroadphaseType broadphase) : xramp(nullptr), plate(nullptr), projectile(nullptr), footprint(0), pairsTested(0), pairsRejected(0), recomputations(0),
+    axisHits(0), axisMisses(0), solverIterations(0), unconverged(0), maxSolverIterations(0), residuals(0), tunneled(false)
+{
+  world.setBroadphase(broadphase);
+  if (name == "default") buildDefault();
+  else if (name == "stack") buildStack(variant);
+  else if (name == "pile") buildPile(variant);
+  else if (name == "tunnel") buildTunnel(variant);
+  else if (name == "crossing") buildCrossing(variant);
+  else if (name == "steps") buildSteps(variant);
+}
+
+// Same layout as Application::init, without the camera
+void HeadlessScene::buildDefault()
+{
+  SolidBody* back = new SolidBody(FLOOR_SCALE, FLOOR_BOUNDARY);
+  back->transform.setRotation(Quaternion::FromAxisRotations(-PI / 2, 0, 0));
+  back->transform.setPosition(Vector3(0, 15, 15));
+
+  SolidBody* left = new SolidBody(FLOOR_SCALE, FLOOR_BOUNDARY);
+  left->transform.setRotation(Quaternion::FromAxisRotations(PI / 2, 0, PI / 2));
+  left->transform.setPosition(Vector3(15, 15, 0));
+
+  SolidBody* right = new SolidBody(FLOOR_SCALE, FLOOR_BOUNDARY);
+  right->transform.setRotation(Quaternion::FromAxisRotations(PI / 2, 0, -PI / 2));
+  right->transform.setPosition(Vector3(-15, 15, 0));
+
+  SolidBody* ramp = new SolidBody(FLOOR_SCALE, FLOOR_BOUNDARY);
+  ramp->transform.setPosition(Vector3(0, 0, -30));
+  ramp->transform.setAnchor(Vector3(0, 0, -15));
+  ramp->transform.setRotation(Quaternion::FromAxisRotations(PI / 6, 0, 0));
+
+  xramp = new SolidBody(FLOOR_SCALE, FLOOR_BOUNDARY);
+  xramp->transform.setPosition(Vector3(0, 0, -60));
+
+  SolidBody* player = new SolidBody(1, PLAYER_BOUNDARY);
+  player->inverseMass = 1;
+  player->transform.setRotation(Quaternion::FromAxisRotations(0, PI, 0));
+  player->transform.translate(Vector3(0, 2, 0));
+
+  add(back);
+  addFloor();
+  add(left);
+  add(right);
+  add(ramp);
+  add(xramp);
+  add(player);
+}
+
+void HeadlessScene::buildStack(int variant)
+{
+  SolidBody* floor = addFloor();
+  float top = floor->getBoundary().getAABB().max.y;
+  for(int i=0; i<20; i++) {
+    SolidBody* crate = addCrate();
+    crate->transform.setPosition(Vector3(0.01f * variant * (i % 2), top + 1 + i * 2, 0));
+    add(crate);
+  }
+}
+
+void HeadlessScene::buildPile(int variant)
+{
+  SolidBody* floor = addFloor();
+  float top = floor->getBoundary().getAABB().max.y;
+  // Deterministic jitter per variant
+  unsigned int seed = 12345 + variant;
+  for(int y=0; y<4; y++) {
+    for(int x=0; x<6; x++) {
+      for(int z=0; z<6; z++) {
+        seed = seed * 1103515245 + 12345;
+        float jitter = ((seed >> 16) & 0xff) / 255.0f - 0.5f;
+        SolidBody* crate = addCrate();
+        crate->transform.setPosition(Vector3(x * 3 - 7.5f + jitter, top + 2 + y * 3, z * 3 - 7.5f - jitter));
+        add(crate);
+      }
+    }
+  }
+}
+
+// Crates dropped onto the boxes of models/stack.obj, which only collide as a
+// triangle mesh. The stack turns by 0.1 radians per variant.
+void HeadlessScene::buildSteps(int variant)
+{
+  SolidBody* floor = addFloor();
+  float top = floor->getBoundary().getAABB().max.y;
+  SolidBody* stack = new SolidBody(STACK_SCALE, STACK_BOUNDARY);
+  stack->collider = stackCollider();
+  stack->transform.setRotation(Quaternion::FromAxisRotations(0, variant * 0.1f, 0));
+  stack->transform.setPosition(Vector3(0, top + STACK_SCALE, 0));
+  add(stack);
+  for(int y=0; y<2; y++) {
+    for(int x=0; x<4; x++) {
+      for(int z=0; z<4; z++) {
+        SolidBody* crate = addCrate();
+        crate->transform.setPosition(Vector3(x * 2.5f - 3.75f, top + 14 + y * 3, z * 2.5f - 3.75f));
+        add(crate);
+      }
+    }
+  }
+}
+
+// Number of speeds of the tunnel scene, each fired at TUNNEL_TILTS plate angles
+#define TUNNEL_SPEEDS 22
+#define TUNNEL_TILTS 8
+
+// A crate fired down at a 0.2 thick plate, at 0.5 * 1.25^(variant / TUNNEL_TILTS)
+// units per step, the plate tilted by 0.1 radians per variant % TUNNEL_TILTS
+void HeadlessScene::buildTunnel(int variant)
+{
+  int tilt = variant % TUNNEL_TILTS;
+  float speed = 0.5f * powf(1.25f, variant / TUNNEL_TILTS);
+  plate = new SolidBody(FLOOR_SCALE, FLOOR_BOUNDARY);
+  plate->transform.setScale(Vector3(5, 1, 5));
+  plate->transform.setRotation(Quaternion::FromAxisRotations(tilt * 0.1f, 0, 0));
+  add(plate);
+  footprint = 1;
+  projectile = addCrate();
+  projectile->transform.setPosition(Vector3(0.3f * tilt, 30 + 0.37f * tilt, 0));
+  projectile->velocity = Vector3(0.05f * tilt, -speed, 0);
+  add(projectile);
+}
+
+// The tunnel scene with a crate for the plate, fired up at the speed the projectile is
+// fired down at, so both move into each other within the step
+void HeadlessScene::buildCrossing(int variant)
+{
+  int tilt = variant % TUNNEL_TILTS;
+  float speed = 0.5f * powf(1.25f, variant / TUNNEL_TILTS);
+  plate = addCrate();
+  plate->transform.setRotation(Quaternion::FromAxisRotations(tilt * 0.1f, 0, 0));
+  plate->velocity = Vector3(0, speed, 0);
+  add(plate);
+  footprint = 0.5f;
+  projectile = addCrate();
+  projectile->transform.setPosition(Vector3(0.1f * tilt, 30, 0));
+  projectile->velocity = Vector3(0, -speed, 0);
+  add(projectile);
+}
+
+void HeadlessScene::step()
+{
+  // In the frame of the plate before and after the step, it moves in the crossing scene
+  Vector3 from = projectile ? plate->transform.getWorld().inverted().transformPoint(projectile->getBoundary().center()) : Vector3(0);
+  unsigned long long before = Transform::recomputations;
+  if (xramp) {
+    Vector3 p = xramp->transform.getPosition();
+    p.y += 0.1f;
+    if (p.y > 50)
+      p.y = 0;
+    xramp->transform.setPosition(p);
+    xramp->transform.rotate(Quaternion::FromAxisAngle(Vector3(1, 0, 0), 0.01f));
+    xramp->updateBoundary();
+    world.wake(xramp);
+  }
+  world.step();
+  if (projectile) {
+    // Tunneled when the center crossed the plane of the plate within its footprint
+    Vector3 to = plate->transform.getWorld().inverted().transformPoint(projectile->getBoundary().center());
+    if (from.y > 0 && to.y < 0) {
+      Vector3 p = from + (to - from) * (from.y / (from.y - to.y));
+      if (fabs(p.x) < footprint && fabs(p.z) < footprint) tunneled = true;
+    }
+  }
+  pairsTested += world.pairStats.tested;
+  pairsRejected += world.pairStats.rejected();
+  axisHits += world.pairStats.axisHits;
+  axisMisses += world.pairStats.axisMisses;
+  recomputations += Transform::recomputations - before;
+  solverIterations += world.iterations;
+  maxSolverIterations = std::max(maxSolverIterations, world.iterations);
+  residuals += world.residual;
+  if (world.residual >= world.tolerance) unconverged++;
+}
+
+double HeadlessScene::checksum() const
+{
+  double sum = 0;
+  for(const SolidBody* b : bodies)
+    sum += b->transform.getPosition().x + b->transform.getPosition().y + b->transform.getPosition().z;
+  return sum;
+}
+
+// Fires every variant of the tunnel and crossing scenes with and without continuous
+// collision and counts the crates that end up on the other side of the plate per speed
+int runTunnelTest(int steps)
+{
+  const char* scenes[] = { "tunnel", "crossing" };
+  const char* titles[] = { "crates through a 0.2 thick plate", "crates through a crate fired at them" };
+  for(int n=0; n<2; n++) {
+    int tunneled[2][TUNNEL_SPEEDS] = {};
+    for(int ccd=0; ccd<2; ccd++) {
+      for(int v=0; v<TUNNEL_SPEEDS * TUNNEL_TILTS; v++) {
+        HeadlessScene scene(scenes[n], v);
+        scene.world.continuousCollision = ccd;
+        for(int s=0; s<steps; s++) scene.step();
+        tunneled[ccd][v / TUNNEL_TILTS] += scene.tunneled;
+      }
+    }
+    printf("%s, %i tilts per speed, %i steps\n", titles[n], TUNNEL_TILTS, steps);
+    printf("   speed  without CCD  with CCD\n");
+    int total[2] = { 0, 0 };
+    for(int i=0; i<TUNNEL_SPEEDS; i++) {
+      printf("%8.2f  %11i  %8i\n", 0.5f * powf(1.25f, i), tunneled[0][i], tunneled[1][i]);
+      total[0] += tunneled[0][i];
+      total[1] += tunneled[1][i];
+    }
+    printf("   total  %7i/%i  %4i/%i\n", total[0], TUNNEL_SPEEDS * TUNNEL_TILTS, total[1], TUNNEL_SPEEDS * TUNNEL_TILTS);
+  }
+  return 0;
+}
+
+// Usage: --headless [scene] [instances] [steps] [threads] [tree|grid] [--cold]
+// --cold turns off warm starting, to compare the iterations the solver needs.
+// The tunnel scene runs runTunnelTest instead, along with the crossing scene: --headless tunnel [steps]
+int runHeadless(int argc, char** argv)
+{
+  bool warmStarting = !takeOption(argc, argv, "--cold", 0);
+  if (argc > 1 && strcmp(argv[1], "tunnel") == 0)
+    return runTunnelTest(argc > 2 ? atoi(argv[2]) : 200);
+  std::string name = argc > 1 ? argv[1] : "default";
+  int instances = argc > 2 ? atoi(argv[2]) : 0;
+  int steps = argc > 3 ? atoi(argv[3]) : 1000;
+  int threads = argc > 4 ? atoi(argv[4]) : 0;
+  BroadphaseType broadphase = argc > 5 && strcmp(argv[5], "grid") == 0 ? BROADPHASE_GRID : BROADPHASE_TREE;
+  if (threads <= 0) threads = std::max(1u, std::thread::hardware_concurrency());
+  if (instances <= 0) instances = threads;
+
+  if (!HeadlessScene(name, 0).valid()) {
+    logError("Unknown headless scene '%s', expected default, stack, pile, steps, tunnel or crossing", name.c_str());
+    return 1;
+  }
+  logInfo("headless: %i instances of '%s' for %i steps on %i threads, %s broadphase%s", instances, name.c_str(), steps, threads,
+          broadphase == BROADPHASE_GRID ? "grid" : "tree", warmStarting ? "" : ", no warm starting");
+
+  std::vector<double> checksums(instances);
+  std::vector<size_t> bodies(instances);
+  std::vector<long long> tested(instances), rejected(instances), recomputed(instances);
+  std::vector<long long> axisHits(instances), axisMisses(instances);
+  std::vector<long long> iterations(instances), unconverged(instances);
+  std::vector<int> maxIterations(instances);
+  std::vector<double> residuals(instances);
+  std::atomic<int> next(0);
+  auto worker = [&]() {
+    for(int i = next++; i < instances; i = next++) {
+      HeadlessScene scene(name, i, broadphase);
+      scene.world.warmStarting = warmStarting;
+      for(int s=0; s<steps; s++) scene.step();
+      checksums[i] = scene.checksum();
+      bodies[i] = scene.bodyCount();
+      tested[i] = scene.pairsTested;
+      rejected[i] = scene.pairsRejected;
+      recomputed[i] = scene.recomputations;
+      axisHits[i] = scene.axisHits;
+      axisMisses[i] = scene.axisMisses;
+      iterations[i] = scene.solverIterations;
+      maxIterations[i] = scene.maxSolverIterations;
+      unconverged[i] = scene.unconverged;
+      residuals[i] = scene.residuals;
+    }
+  };
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> pool;
+  for(int i=0; i<threads; i++) pool.push_back(std::thread(worker));
+  for(std::thread &t : pool) t.join();
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  size_t bodySteps = 0;
+  for(int i=0; i<instances; i++) {
+    printf("instance %i: %zu bodies, checksum %.6f, %.1f pairs tested and %.1f rejected per step, %.1f transforms recomputed per step\n",
+           i, bodies[i], checksums[i], tested[i] / (double)steps, rejected[i] / (double)steps, recomputed[i] / (double)steps);
+    long long cached = axisHits[i] + axisMisses[i];
+    printf("  separating axis cache: %.1f hits and %.1f misses per step, %.0f%% of box pairs settled\n",
+           axisHits[i] / (double)steps, axisMisses[i] / (double)steps, cached ? 100.0 * axisHits[i] / cached : 0.0);
+    printf("  solver: %.2f iterations per step, at most %i, mean residual %.3g, %lld of %i steps unconverged\n",
+           iterations[i] / (double)steps, maxIterations[i], residuals[i] / steps, unconverged[i], steps);
+    bodySteps += bodies[i] * steps;
+  }
+  double total = (double)instances * steps;
+  printf("%.0f steps in %.3f s: %.0f steps/s, %.0f body steps/s\n", total, seconds, total / seconds, bodySteps / seconds);
+  return 0;
+}
+
+#endif
@@ -18,6 +18,13 @@ enum action {
   LOOK_RIGHT,
 
   JUMP,
+
+  TOGGLE_PROFILER,
+  DUMP_TRACE,
+  TOGGLE_DEFERRED,
+  TOGGLE_OBJECT_LIGHTS,
+  TOGGLE_PREPASS,
+  TOGGLE_OVERDRAW,
 };
 
 class Keyboard
@@ -48,7 +55,7 @@ Keyboard::Keyboard(GLFWwindow* window)
   // Preserves keypresses until polled to prevent missing events
   // This implicitly requires that all keys are polled to maintain
   // normal behavior
-  glfwSetInputMode(window, GLFW_STICKY_KEYS, GLFW_TRUE);
+  if (window) glfwSetInputMode(window, GLFW_STICKY_KEYS, GLFW_TRUE);
 
   map_size = GLFW_KEY_LAST + 1;
   key_map = std::vector<int>(map_size);
@@ -59,6 +66,8 @@ Keyboard::Keyboard(GLFWwindow* window)
 
 void Keyboard::swapBuffers()
 {
+  // Offscreen runs have no window, all keys stay released
+  if (!window) return;
   // Keys below barcode 32 are not in use and generate errors.
   for(int i=32; i<map_size; i++)
   {
@@ -101,5 +110,12 @@ void Keyboard::generateActionMap()
   action_map[LOOK_RIGHT]    = GLFW_KEY_RIGHT;
   
   action_map[JUMP]          = GLFW_KEY_SPACE;
+
+  action_map[TOGGLE_PROFILER] = GLFW_KEY_F3;
+  action_map[DUMP_TRACE]      = GLFW_KEY_F4;
+  action_map[TOGGLE_DEFERRED] = GLFW_KEY_F5;
+  action_map[TOGGLE_OBJECT_LIGHTS] = GLFW_KEY_F6;
+  action_map[TOGGLE_PREPASS] = GLFW_KEY_F7;
+  action_map[TOGGLE_OVERDRAW] = GLFW_KEY_F8;
 }
 #endif
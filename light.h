@@ -1,28 +1,45 @@
 #ifndef LIGHT_H
 #define LIGHT_H
 
+#include <vector>
 #include "vec.h"
 
+// Light below this is not shaded, one step of an 8 bit color channel
+#define LIGHT_CUTOFF (1 / 256.0f)
+// Lights of a single draw when they are assigned per object, shaders/*_fs.c repeat it
+#define OBJECT_LIGHTS 8
+
 struct Light {
   Vector3 position, color;
   float brightness;
 
   Light() : brightness(1) {}
 
-  void sendToShader(GLint uPos, GLint uCol) const {
-    glUniform3f(uPos, position.x, position.y, position.z);
-    glUniform3f(uCol, color.x * brightness, color.y * brightness, color.z * brightness);
+  // Distance at which the 1 / d^2 attenuation of the shaders brings the brightest
+  // channel below LIGHT_CUTOFF, black lights reach nothing
+  float radius() const {
+    float peak = std::max(color.x, std::max(color.y, color.z)) * brightness;
+    return peak > 0 ? sqrtf(peak / LIGHT_CUTOFF) : 0;
   }
 };
 
 struct LightSet {
-  std::array<Light, 10> set;
+  // The first ten are the lights of the level, any number can follow
+  std::vector<Light> set;
+  LightSet() : set(10) {}
   Light& operator [](int index) { return set[index]; }
-  void sendToShader(std::array<GLint, 10> uPos, std::array<GLint, 10> uCol) const {
-    for(int i=0; i<10; i++) {
-      set[i].sendToShader(uPos[i], uCol[i]);
-    }
-  }
+  const Light& operator [](int index) const { return set[index]; }
+  int size() const { return set.size(); }
+  void add(const Light &light) { set.push_back(light); }
+};
+
+// Lights of one draw as the shaders take them, picked by LightGrid::assign
+struct ObjectLights {
+  int count;
+  // Position and radius
+  float position[OBJECT_LIGHTS * 4];
+  // Color times brightness
+  float color[OBJECT_LIGHTS * 3];
 };
 
 #endif
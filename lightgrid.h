@@ -0,0 +1,112 @@
+#ifndef LIGHTGRID_H
+#define LIGHTGRID_H
+
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+
+#include "vec.h"
+#include "light.h"
+
+// Edge of a grid cell
+#define LIGHT_GRID_CELL 4.0f
+// Lights reaching over more cells than this along an axis are not put in the grid,
+// every object tests them instead
+#define LIGHT_GRID_SPAN 8
+
+// Hashed uniform grid over the bounding boxes of the lights, to find the lights that
+// reach an object without testing every one of them
+class LightGrid {
+  private:
+    const LightSet* set;
+    std::unordered_map<long long, std::vector<int>> cells;
+    std::vector<int> wide;
+    // Query that last saw each light, so lights in several cells count once
+    std::vector<unsigned int> seen;
+    unsigned int query;
+    struct Candidate {
+      int light;
+      float weight;
+    };
+    std::vector<Candidate> candidates;
+    static int cell(float x) { return (int)floorf(x / LIGHT_GRID_CELL); }
+    static long long key(int x, int y, int z) { return ((long long)(x & 0x1fffff) << 42) | ((long long)(y & 0x1fffff) << 21) | (z & 0x1fffff); }
+    void consider(int light, const AABB &box);
+  public:
+    LightGrid() : set(nullptr), query(0) {}
+    // Rebuilds the grid, the set has to outlive the queries
+    void build(const LightSet &set);
+    // The OBJECT_LIGHTS lights that reach the box, the brightest at its nearest point first
+    void assign(const AABB &box, ObjectLights &out);
+};
+
+void LightGrid::build(const LightSet &set)
+{
+  this->set = &set;
+  for(auto &c : cells) c.second.clear();
+  wide.clear();
+  seen.assign(set.size(), query);
+  for(int i=0; i<set.size(); i++) {
+    float r = set[i].radius();
+    if (r <= 0) continue;
+    Vector3 p = set[i].position;
+    int x0 = cell(p.x - r), x1 = cell(p.x + r), y0 = cell(p.y - r), y1 = cell(p.y + r), z0 = cell(p.z - r), z1 = cell(p.z + r);
+    if (x1 - x0 >= LIGHT_GRID_SPAN || y1 - y0 >= LIGHT_GRID_SPAN || z1 - z0 >= LIGHT_GRID_SPAN) {
+      wide.push_back(i);
+      continue;
+    }
+    for(int z=z0; z<=z1; z++)
+      for(int y=y0; y<=y1; y++)
+        for(int x=x0; x<=x1; x++) cells[key(x, y, z)].push_back(i);
+  }
+}
+
+// Weighs a light by its intensity at the point of the box nearest to it, lights that
+// do not reach the box are left out
+void LightGrid::consider(int light, const AABB &box)
+{
+  if (seen[light] == query) return;
+  seen[light] = query;
+  const Light &l = (*set)[light];
+  Vector3 p = l.position;
+  Vector3 nearest(std::min(std::max(p.x, box.min.x), box.max.x),
+                  std::min(std::max(p.y, box.min.y), box.max.y),
+                  std::min(std::max(p.z, box.min.z), box.max.z));
+  float d2 = (p - nearest).sq_length(), r = l.radius();
+  if (d2 > r * r) return;
+  // Inside the box the distance to the surface is unknown, take one unit
+  candidates.push_back(Candidate{ light, r * r / std::max(d2, 1.0f) });
+}
+
+void LightGrid::assign(const AABB &box, ObjectLights &out)
+{
+  query++;
+  candidates.clear();
+  for(int light : wide) consider(light, box);
+  int x0 = cell(box.min.x), x1 = cell(box.max.x), y0 = cell(box.min.y), y1 = cell(box.max.y), z0 = cell(box.min.z), z1 = cell(box.max.z);
+  for(int z=z0; z<=z1; z++) {
+    for(int y=y0; y<=y1; y++) {
+      for(int x=x0; x<=x1; x++) {
+        auto c = cells.find(key(x, y, z));
+        if (c == cells.end()) continue;
+        for(int light : c->second) consider(light, box);
+      }
+    }
+  }
+
+  // The squared radius is the peak intensity over the cutoff, so the weight orders by
+  // intensity at the nearest point
+  size_t n = std::min<size_t>(OBJECT_LIGHTS, candidates.size());
+  std::partial_sort(candidates.begin(), candidates.begin() + n, candidates.end(),
+                    [](const Candidate &a, const Candidate &b) { return a.weight > b.weight; });
+  out.count = n;
+  for(size_t i=0; i<n; i++) {
+    const Light &l = (*set)[candidates[i].light];
+    float* p = &out.position[i * 4];
+    p[0] = l.position.x; p[1] = l.position.y; p[2] = l.position.z; p[3] = l.radius();
+    float* c = &out.color[i * 3];
+    c[0] = l.color.x * l.brightness; c[1] = l.color.y * l.brightness; c[2] = l.color.z * l.brightness;
+  }
+}
+
+#endif
@@ -2,6 +2,7 @@
 #define LOGGER_H
 #include <stdio.h>
 #include <stdarg.h>
+#include "linmath.h"
 
 enum LOG_LEVEL{L_DEBUG, L_INFO, L_CRITICAL, L_ERROR};
 static const char* LOG_LEVEL_MAPPING[] = {
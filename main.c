@@ -17,6 +17,13 @@
 #include "logger.h"
 #include "application.h"
 #include "keyboard.h"
+#include "headless.h"
+#include "rasterbench.h"
+#include "querybench.h"
+#include "mathbench.h"
+#include "offscreen.h"
+#include "benchmark.h"
+#include "trace.h"
 
 #ifdef GL_DEBUG
 #include "gl_debug.h"
@@ -25,6 +32,8 @@
 GLFWwindow* window;
 Application* app;
 Keyboard* keyboard;
+int extraLights = 0, extraLayers = 0;
+bool startDeferred = false, startObjectLights = false, startPrepass = false, startOverdraw = false;
 
 void glfw_error_callback(int error, const char* description)
 {
@@ -36,10 +45,9 @@ void key_callback(GLFWwindow* window, int key, int scancode, int action, int mod
   //printf("key: %i, scancode: %i, action: %i\n", key, scancode, action);
 }
 
-int main(int argc, char** argv) {
-  // Set log level
-  log_set_level(L_DEBUG);
-
+// Window of w by h with a current GL 4.5 context, null on failure
+GLFWwindow* openWindow(int w, int h)
+{
   // Setup GLFW handlers
   glfwSetErrorCallback(glfw_error_callback);
 
@@ -51,15 +59,34 @@ int main(int argc, char** argv) {
   glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
   glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 5);
   // Initialize window
-  window = glfwCreateWindow(640, 480, "Rasterizer", NULL, NULL);
+  GLFWwindow* window = glfwCreateWindow(w, h, "Rasterizer", NULL, NULL);
   if (!window) {
     fprintf(stderr, "Window creation failed!\n");
-    return 1;
+    return nullptr;
   }
 
   glfwMakeContextCurrent(window);
   glfwSetKeyCallback(window, key_callback);
+  return window;
+}
+
+// Initialized application with the additions of the options
+Application* createApplication()
+{
+  Application* app = new Application();
+  app->init();
+  app->addLights(extraLights);
+  app->addLayers(extraLayers);
+  app->deferred = startDeferred;
+  app->objectLights = startObjectLights;
+  app->prepass = startPrepass;
+  app->showOverdraw = startOverdraw;
+  return app;
+}
 
+// State shared by the window and the offscreen context, which has to be current
+void setupGL()
+{
 #ifdef GL_DEBUG
   printf("OpenGL debugging enabled.\n");
   // Enable debugging
@@ -79,17 +106,290 @@ int main(int argc, char** argv) {
 
   //glCullFace(GL_FRONT_AND_BACK);
   glEnable(GL_DEPTH_TEST);
+}
+
+// Usage: --offscreen [frames] [width]x[height] [png prefix]
+// Renders the application into a framebuffer object without a window, for machines
+// without a display or GPU. With a prefix every frame is written to <prefix>0000.png...
+int runOffscreen(int argc, char** argv)
+{
+  int frames = argc > 1 ? atoi(argv[1]) : 60;
+  int w = 640, h = 480;
+  if (argc > 2 && sscanf(argv[2], "%ix%i", &w, &h) != 2) {
+    logError("Invalid resolution %s", argv[2]);
+    return 1;
+  }
+  const char* prefix = argc > 3 ? argv[3] : nullptr;
+
+  OffscreenContext context;
+  if (!context.create(4, 5)) return 1;
+  setupGL();
+  OffscreenTarget target(w, h);
+  if (!target.isComplete()) {
+    logError("Framebuffer of %ix%i is incomplete", w, h);
+    return 1;
+  }
+  logInfo("startup completed");
+
+  // No window to take keys from, none are ever pressed
+  keyboard = new Keyboard(nullptr);
+  app = createApplication();
+
+  std::vector<unsigned char> pixels;
+  char filename[512];
+  // GLFW is not initialized, so its timer is not available
+  auto start = std::chrono::steady_clock::now();
+  for(int f=0; f<frames; f++) {
+    target.bind();
+    glViewport(0, 0, w, h);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
+
+    app->loop(w, h, keyboard);
+
+    if (prefix) {
+      target.read(pixels);
+      snprintf(filename, sizeof(filename), "%s%04i.png", prefix, f);
+      if (!writePNG(filename, w, h, pixels.data())) return 1;
+    }
+  }
+  glFinish();
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  logInfo("%i frames of %ix%i in %.2f s, %.1f fps", frames, w, h, seconds, frames / seconds);
+  if (Tracer::isEnabled()) Tracer::dump("Offscreen run finished");
+
+  delete app;
+  delete keyboard;
+  return 0;
+}
+
+// Usage: --benchmark [frames] [report.json] [width]x[height]
+// Flies the camera along the CameraPath without vsync and writes the frame times as
+// JSON, to stdout without a report file. A resolution renders offscreen instead of
+// into a window of 640x480.
+int runBenchmark(int argc, char** argv)
+{
+  int frames = argc > 1 ? atoi(argv[1]) : 600;
+  const char* filename = argc > 2 && strcmp(argv[2], "-") != 0 ? argv[2] : nullptr;
+  int w = 640, h = 480;
+  bool offscreen = argc > 3;
+  if (offscreen && sscanf(argv[3], "%ix%i", &w, &h) != 2) {
+    logError("Invalid resolution %s", argv[3]);
+    return 1;
+  }
+
+  OffscreenContext context;
+  OffscreenTarget* target = nullptr;
+  if (offscreen) {
+    if (!context.create(4, 5)) return 1;
+    target = new OffscreenTarget(w, h);
+    if (!target->isComplete()) {
+      logError("Framebuffer of %ix%i is incomplete", w, h);
+      return 1;
+    }
+  }
+  else {
+    window = openWindow(w, h);
+    if (!window) return 1;
+  }
+  setupGL();
+  if (window) glfwSwapInterval(0);
+
+  keyboard = new Keyboard(window);
+  app = createApplication();
+  CameraPath path;
+  app->setCameraPath(&path);
+
+  BenchmarkReport report;
+  report.width = w;
+  report.height = h;
+  report.renderer = (const char*)glGetString(GL_RENDERER);
+  // Scope times arrive a few frames late
+  app->profiler.onFrame = [&](int frame, const std::vector<ProfileNode> &nodes) {
+    if (frame >= BENCHMARK_WARMUP) report.addProfile(nodes);
+  };
+  SpikeTrigger spikes;
+  for(int f=0; f<BENCHMARK_WARMUP + frames; f++) {
+    auto start = std::chrono::steady_clock::now();
+    long long traceStart = Tracer::now();
+    if (target) target->bind();
+    else glfwGetFramebufferSize(window, &w, &h);
+    glViewport(0, 0, w, h);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
+
+    app->loop(w, h, keyboard);
+
+    if (window) {
+      TRACE_SCOPE("swap");
+      glfwSwapBuffers(window);
+      glfwPollEvents();
+    }
+    else glFlush();
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    if (f >= BENCHMARK_WARMUP) report.frame.add(ms);
+    if (Tracer::isEnabled() && f >= BENCHMARK_WARMUP) spikes.frame(traceStart, Tracer::now());
+  }
+  app->profiler.flush();
+  if (Tracer::isEnabled()) Tracer::dump("Benchmark finished");
+
+  bool written = report.write(filename);
+  if (!written) logError("Could not write %s", filename);
+
+  delete app;
+  delete keyboard;
+  delete target;
+  if (window) {
+    glfwDestroyWindow(window);
+    glfwTerminate();
+  }
+  return written ? 0 : 1;
+}
+
+// Usage: --shading [frames] [width]x[height]
+// Median frame times of the forward path with and without depth pre-pass and of the
+// deferred path offscreen along the CameraPath, for a growing number of lights and
+// layers of overdraw below the floor, and the fragments shaded per covered pixel
+// without pre-pass on the first frame
+int runShadingBenchmark(int argc, char** argv)
+{
+  int frames = argc > 1 ? atoi(argv[1]) : 20;
+  int w = 640, h = 480;
+  if (argc > 2 && sscanf(argv[2], "%ix%i", &w, &h) != 2) {
+    logError("Invalid resolution %s", argv[2]);
+    return 1;
+  }
+  OffscreenContext context;
+  if (!context.create(4, 5)) return 1;
+  setupGL();
+  OffscreenTarget target(w, h);
+  if (!target.isComplete()) {
+    logError("Framebuffer of %ix%i is incomplete", w, h);
+    return 1;
+  }
+  keyboard = new Keyboard(nullptr);
+  CameraPath path;
+  // Loaded once, every configuration only adds its lights to them
+  ResourceManager resources;
+  // Ignored by the timings, but long enough for the first frames to settle
+  const int warmup = 5;
+  const int lightCounts[] = { 0, 1024, 4096 }, layerCounts[] = { 0, 3, 7 };
+  printf("%ix%i, median of %i frames\n", w, h, frames);
+  for(int lights : lightCounts) {
+    for(int layers : layerCounts) {
+      app = new Application();
+      app->init(&resources);
+      app->addLights(lights);
+      app->addLayers(layers);
+      auto frame = [&]() {
+        target.bind();
+        glViewport(0, 0, w, h);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        app->loop(w, h, keyboard);
+      };
+      app->setCameraPath(&path);
+      app->showOverdraw = true;
+      frame();
+      double overdraw = app->overdraw->average();
+      app->showOverdraw = false;
+      // Forward, forward after the depth pre-pass and deferred
+      double median[3];
+      for(int mode=0; mode<3; mode++) {
+        // Every path sees the same frames
+        app->setCameraPath(&path);
+        app->prepass = mode == 1;
+        app->deferred = mode == 2;
+        FrameSamples samples;
+        for(int f=0; f<warmup + frames; f++) {
+          auto start = std::chrono::steady_clock::now();
+          frame();
+          glFinish();
+          if (f >= warmup) samples.add(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+        }
+        median[mode] = samples.percentile(0.5);
+      }
+      delete app;
+      printf("%4i lights, %i layers, overdraw %4.2f: forward %7.2f ms, pre-pass %7.2f ms, deferred %7.2f ms\n",
+             lights, layers, overdraw, median[0], median[1], median[2]);
+    }
+  }
+  delete keyboard;
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  // Set log level
+  log_set_level(L_DEBUG);
+
+  // Options of every mode, taken out before the rest is parsed
+  // --trace records from the start
+  if (takeOption(argc, argv, "--trace", 0)) Tracer::enable(true);
+  // --lights N adds N small lights to the level
+  const char* lights = nullptr;
+  if (takeOption(argc, argv, "--lights", 1, &lights)) extraLights = atoi(lights);
+  // --layers N stacks N copies of the floor below it
+  const char* layers = nullptr;
+  if (takeOption(argc, argv, "--layers", 1, &layers)) extraLayers = atoi(layers);
+  // --deferred starts with the deferred path
+  startDeferred = takeOption(argc, argv, "--deferred", 0);
+  // --object-lights starts with the lights assigned per object
+  startObjectLights = takeOption(argc, argv, "--object-lights", 0);
+  // --prepass starts with the depth pre-pass, --overdraw with the heat map
+  startPrepass = takeOption(argc, argv, "--prepass", 0);
+  startOverdraw = takeOption(argc, argv, "--overdraw", 0);
+  Tracer::nameThread("main");
+
+  // Step physics scenes only, no window is created
+  if (argc > 1 && strcmp(argv[1], "--headless") == 0)
+    return runHeadless(argc - 1, argv + 1);
+  // Frame rates of the CPU rasterizer, no window either
+  if (argc > 1 && strcmp(argv[1], "--raster") == 0)
+    return runRasterBenchmark(argc - 1, argv + 1);
+  if (argc > 1 && strcmp(argv[1], "--occlusion") == 0)
+    return runOcclusionBenchmark(argc - 1, argv + 1);
+  // Rays per second of SceneQuery with either broadphase, and of a single triangle mesh
+  if (argc > 1 && strcmp(argv[1], "--queries") == 0)
+    return runQueryBenchmark(argc - 1, argv + 1);
+  if (argc > 1 && strcmp(argv[1], "--meshes") == 0)
+    return runMeshBenchmark(argc - 1, argv + 1);
+  if (argc > 1 && strcmp(argv[1], "--broadphase") == 0)
+    return runBroadphaseBenchmark(argc - 1, argv + 1);
+  // Matrix operations of the compiled SIMD backend
+  if (argc > 1 && strcmp(argv[1], "--math") == 0)
+    return runMathBenchmark(argc - 1, argv + 1);
+  // Rendered with GL, but into a framebuffer object instead of a window
+  if (argc > 1 && strcmp(argv[1], "--offscreen") == 0)
+    return runOffscreen(argc - 1, argv + 1);
+  // Scripted camera and no vsync, reports frame times
+  if (argc > 1 && strcmp(argv[1], "--benchmark") == 0)
+    return runBenchmark(argc - 1, argv + 1);
+  // Forward against deferred
+  if (argc > 1 && strcmp(argv[1], "--shading") == 0)
+    return runShadingBenchmark(argc - 1, argv + 1);
+
+  window = openWindow(640, 480);
+  if (!window) return 1;
+
+  setupGL();
   glfwSwapInterval(1); //vsync
 
   logInfo("startup completed");
 
   keyboard = new Keyboard(window);
-  app = new Application();
-  app->init();
+  app = createApplication();
 
+  bool titled = false;
+  SpikeTrigger spikes;
   while(!(glfwWindowShouldClose(window) | app->shouldClose()))
   {
+     long long start = Tracer::now();
      keyboard->swapBuffers();
+     // The first press starts recording, later ones write what was recorded
+     if (keyboard->isPressed(DUMP_TRACE)) {
+       if (Tracer::isEnabled()) Tracer::dump("Requested");
+       else {
+         Tracer::enable(true);
+         logInfo("Tracing started, F4 writes the trace");
+       }
+     }
      int w, h;
      glfwGetFramebufferSize(window, &w, &h);
 
@@ -97,9 +397,18 @@ int main(int argc, char** argv) {
      glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT );
 
      app->loop(w, h, keyboard);
+     // The overlay has no font, the times are written in the title instead
+     if (app->showProfiler || titled) {
+       glfwSetWindowTitle(window, app->showProfiler ? app->profiler.summary().c_str() : "Rasterizer");
+       titled = app->showProfiler;
+     }
 
-     glfwSwapBuffers(window);
-     glfwPollEvents();
+     {
+       TRACE_SCOPE("swap");
+       glfwSwapBuffers(window);
+       glfwPollEvents();
+     }
+     if (Tracer::isEnabled()) spikes.frame(start, Tracer::now());
   }
 
   delete app;
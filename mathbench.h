@@ -0,0 +1,124 @@
+#ifndef MATHBENCH_H
+#define MATHBENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <vector>
+#include <random>
+#include <chrono>
+
+#include "logger.h"
+#include "vec.h"
+#include "solid.h"
+
+#if defined(VEC_SSE) && defined(__AVX__)
+#define VEC_BACKEND "AVX"
+#elif defined(VEC_SSE)
+#define VEC_BACKEND "SSE"
+#else
+#define VEC_BACKEND "scalar"
+#endif
+
+// Results are written here so the timed loops are not optimized away
+static volatile float mathSink;
+
+// Nanoseconds per call of fn(count), the best of seven runs
+template <typename F> static double timeMath(F fn, int count)
+{
+  double best = 1e30;
+  for(int run=0; run<7; run++) {
+    auto start = std::chrono::steady_clock::now();
+    fn(count);
+    best = std::min(best, std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / count);
+  }
+  return best;
+}
+
+// Nanoseconds per operation of the Matrix4 and Transform hot paths, to compare
+// the SIMD backends of vec.h. Usage: --math [iterations]
+int runMathBenchmark(int argc, char** argv)
+{
+  int iterations = argc > 1 ? atoi(argv[1]) : 5000000;
+  // A power of two, small enough to stay in the L1 cache
+  const int count = 1024;
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<float> U(-1, 1);
+  std::vector<Matrix4> matrices(count);
+  std::vector<Vector4> vectors(count);
+  std::vector<Affine3> affines(count);
+  std::vector<Quaternion> rotations(count);
+  // Whole results are stored, reading a single element lets the compiler drop the rest
+  std::vector<Matrix4> products(count);
+  std::vector<Vector4> transformed(count);
+  std::vector<Affine3> inverses(count);
+  for(int i=0; i<count; i++) {
+    matrices[i] = Matrix4::FromTranslation(U(rng), U(rng), U(rng)) * Matrix4::FromAxisRotations(U(rng), U(rng), U(rng)) *
+                  Matrix4::FromScale(2 + U(rng), 2 + U(rng), 2 + U(rng));
+    affines[i] = Affine3(matrices[i]);
+    vectors[i] = Vector4(U(rng), U(rng), U(rng), 1);
+    rotations[i] = Quaternion::FromAxisRotations(U(rng), U(rng), U(rng));
+  }
+  logInfo("math: %s backend, %i iterations", VEC_BACKEND, iterations);
+
+  double mul = timeMath([&](int n) {
+    for(int i=0; i<n; i++) products[i & (count - 1)] = matrices[i & (count - 1)] * matrices[(i * 7) & (count - 1)];
+    mathSink = products[n & (count - 1)][0][0];
+  }, iterations);
+  // Each product depends on the last, which measures latency rather than throughput
+  double chain = timeMath([&](int n) {
+    Matrix4 m = Matrix4::Identity();
+    for(int i=0; i<n; i++) m = m * matrices[i & (count - 1)];
+    mathSink = m[0][0];
+  }, iterations);
+  double mulVec4 = timeMath([&](int n) {
+    for(int i=0; i<n; i++) transformed[i & (count - 1)] = matrices[i & (count - 1)] * vectors[(i * 3) & (count - 1)];
+    mathSink = transformed[n & (count - 1)].x;
+  }, iterations);
+  double inverse = timeMath([&](int n) {
+    for(int i=0; i<n; i++) products[i & (count - 1)] = matrices[i & (count - 1)].inverted();
+    mathSink = products[n & (count - 1)][1][2];
+  }, iterations / 4);
+  double affineInverse = timeMath([&](int n) {
+    for(int i=0; i<n; i++) inverses[i & (count - 1)] = affines[i & (count - 1)].inverted();
+    mathSink = inverses[n & (count - 1)].at(1, 2);
+  }, iterations / 4);
+
+  // Every call recomputes the world transform of a body after it turned, which is
+  // what getMvp returns
+  SolidBody body(CRATE_SCALE, CRATE_BOUNDARY);
+  body.transform.setPosition(Vector3(1, 2, 3));
+  body.transform.setAnchor(Vector3(0, 0, -1));
+  double mvp = timeMath([&](int n) {
+    float sum = 0;
+    for(int i=0; i<n; i++) {
+      body.transform.setRotation(rotations[i & (count - 1)]);
+      sum += body.transform.getWorld().at(0, 3);
+    }
+    mathSink = sum;
+  }, iterations / 10);
+  double boundary = timeMath([&](int n) {
+    float sum = 0;
+    for(int i=0; i<n; i++) {
+      body.transform.setRotation(rotations[i & (count - 1)]);
+      body.updateBoundary();
+      sum += body.getBoundary().getPoints()[i & 7].x;
+    }
+    mathSink = sum;
+  }, iterations / 10);
+
+  // Largest deviation of m * m^-1 from the identity
+  float error = 0;
+  for(const Matrix4 &m : matrices) {
+    Matrix4 p = m * m.inverted();
+    for(int c=0; c<4; c++)
+      for(int r=0; r<4; r++) error = std::max(error, fabsf(p[c][r] - (c == r ? 1.0f : 0.0f)));
+  }
+
+  printf("%s: mul %.2f ns, chained mul %.2f ns, mul_vec4 %.2f ns, inverse %.2f ns, affine inverse %.2f ns, "
+         "getMvp %.2f ns, getMvp with boundary %.2f ns, inverse error %.2g\n",
+         VEC_BACKEND, mul, chain, mulVec4, inverse, affineInverse, mvp, boundary, error);
+  return 0;
+}
+
+#endif
@@ -6,10 +6,15 @@
 #include "obj_loader.h"
 #include "keyboard.h"
 #include "camera.h"
+#include "softraster.h"
+#include "light.h"
 
 class IMesh {
   public: 
-    virtual void draw(const Camera* camera, Matrix4 m, float texSize=1) const = 0;
+    // Model space bounds of the vertices, for culling
+    AABB bounds;
+    virtual ~IMesh() {}
+    virtual void draw(const Camera* camera, const Affine3 &m, float texSize=1) const = 0;
 };
 
 
@@ -17,17 +22,21 @@ class DefaultMesh : public IMesh
 {
 private:
   DefaultShader* shader;
-  GLuint vao;
+  GLuint vao, positionVao;
   GLuint vbo, nbo, uvo;
   unsigned int triangle_count;
 
 public:
   GLuint tex;
   DefaultMesh(DefaultShader* shader, GLuint tex, const char* model);
-  void draw(const Camera* camera, Matrix4 m, float texSize=1) const override;
+  ~DefaultMesh();
+  DefaultMesh(const DefaultMesh&) = delete;
+  DefaultMesh& operator=(const DefaultMesh&) = delete;
+  void draw(const Camera* camera, const Affine3 &m, float texSize=1) const override;
 };
 
 DefaultMesh::DefaultMesh(DefaultShader* shader, GLuint tex, const char* model) {
+  TRACE_SCOPE("load mesh");
   logDebug("Initializing Mesh");
 
   this->tex = tex;
@@ -39,6 +48,7 @@ DefaultMesh::DefaultMesh(DefaultShader* shader, GLuint tex, const char* model) {
   std::vector<float> uvs;
   obj.renderBuffers(vertices, normals, uvs);
   triangle_count = vertices.size() / 3;
+  for(size_t i=0; i<vertices.size(); i+=3) bounds.consume(Vector3(vertices[i], vertices[i+1], vertices[i+2]));
 
 
   // Generate objects on GPU
@@ -65,13 +75,23 @@ DefaultMesh::DefaultMesh(DefaultShader* shader, GLuint tex, const char* model) {
   shader->prepare(vbo, nbo, uvo);
 
   glBindVertexArray(0);
+  positionVao = PositionArray(vbo);
 
   logDebug("Done initializing mesh");
 }
 
-void DefaultMesh::draw(const Camera* camera, Matrix4 m, float texSize) const
+DefaultMesh::~DefaultMesh()
 {
-   glBindVertexArray(vao);
+  const GLuint buffers[] = { vbo, nbo, uvo };
+  glDeleteBuffers(3, buffers);
+  glDeleteVertexArrays(1, &vao);
+  glDeleteVertexArrays(1, &positionVao);
+}
+
+void DefaultMesh::draw(const Camera* camera, const Affine3 &m, float texSize) const
+{
+   TRACE_SCOPE("draw mesh");
+   glBindVertexArray(shader->positionOnly() ? positionVao : vao);
    shader->bind(camera, m, tex, texSize);
    glDrawArrays(GL_TRIANGLES, 0, triangle_count);
    glBindVertexArray(0);
@@ -81,18 +101,22 @@ class NormalMappedMesh : public IMesh
 {
 private:
   NormalMappedShader* shader;
-  GLuint vao;
+  GLuint vao, positionVao;
   GLuint vbo, nbo, uvo, tbo, btbo;
   unsigned int triangle_count;
 
 public:
   GLuint tex, n_tex;
   NormalMappedMesh(NormalMappedShader* shader, GLuint tex, GLuint n_tex, const char* model);
-  void draw(const Camera* camera, Matrix4 m, float texSize=1) const override;
+  ~NormalMappedMesh();
+  NormalMappedMesh(const NormalMappedMesh&) = delete;
+  NormalMappedMesh& operator=(const NormalMappedMesh&) = delete;
+  void draw(const Camera* camera, const Affine3 &m, float texSize=1) const override;
 };
 
 NormalMappedMesh::NormalMappedMesh(NormalMappedShader* shader, GLuint tex, GLuint n_tex, const char* model)
 {
+  TRACE_SCOPE("load mesh");
   logDebug("Initializing Mesh");
 
   this->tex = tex;
@@ -107,6 +131,7 @@ NormalMappedMesh::NormalMappedMesh(NormalMappedShader* shader, GLuint tex, GLuin
   std::vector<float> bitangents;
   obj.renderBuffersTangents(vertices, normals, uvs, tangents, bitangents);
   triangle_count = vertices.size() / 3;
+  for(size_t i=0; i<vertices.size(); i+=3) bounds.consume(Vector3(vertices[i], vertices[i+1], vertices[i+2]));
 
 
   // Generate objects on GPU
@@ -143,16 +168,60 @@ NormalMappedMesh::NormalMappedMesh(NormalMappedShader* shader, GLuint tex, GLuin
   shader->prepare(vbo, nbo, uvo, tbo, btbo);
 
   glBindVertexArray(0);
+  positionVao = PositionArray(vbo);
 
   logDebug("Done initializing mesh");
 }
 
-void NormalMappedMesh::draw(const Camera* camera, Matrix4 m, float texSize) const
+NormalMappedMesh::~NormalMappedMesh()
 {
-   glBindVertexArray(vao);
+  const GLuint buffers[] = { vbo, nbo, uvo, tbo, btbo };
+  glDeleteBuffers(5, buffers);
+  glDeleteVertexArrays(1, &vao);
+  glDeleteVertexArrays(1, &positionVao);
+}
+
+void NormalMappedMesh::draw(const Camera* camera, const Affine3 &m, float texSize) const
+{
+   TRACE_SCOPE("draw mesh");
+   glBindVertexArray(shader->positionOnly() ? positionVao : vao);
    shader->bind(camera, m, tex, n_tex, texSize);
    glDrawArrays(GL_TRIANGLES, 0, triangle_count);
    glBindVertexArray(0);
 }
 
+// Queues its triangles on a SoftwareRenderer instead of drawing with GL, the
+// image is complete after SoftwareRenderer::flush.
+class SoftwareMesh : public IMesh
+{
+private:
+  SoftwareRenderer* renderer;
+  const LightSet* lights;
+  SoftwareModel model;
+  const SoftwareTexture *tex, *n_tex;
+
+public:
+  // n_tex may be null, a normal map selects the NormalMappedShader lighting
+  SoftwareMesh(SoftwareRenderer* renderer, const LightSet* lights, const SoftwareTexture* tex, const SoftwareTexture* n_tex, const char* model);
+  void draw(const Camera* camera, const Affine3 &m, float texSize=1) const override;
+};
+
+SoftwareMesh::SoftwareMesh(SoftwareRenderer* renderer, const LightSet* lights, const SoftwareTexture* tex, const SoftwareTexture* n_tex, const char* model)
+  : renderer(renderer), lights(lights), model(cObj(model), n_tex != nullptr), tex(tex), n_tex(n_tex)
+{
+  bounds = this->model.bounds;
+}
+
+void SoftwareMesh::draw(const Camera* camera, const Affine3 &m, float texSize) const
+{
+  // All of them, the renderer keeps those that reach the mesh
+  std::vector<SoftwareLight> set(lights->size());
+  for(int i=0; i<lights->size(); i++) {
+    set[i].position = (*lights)[i].position;
+    set[i].color = (*lights)[i].color * (*lights)[i].brightness;
+  }
+  renderer->setLights(set.data(), set.size());
+  renderer->draw(model, m, camera->getMatrix(), camera->pos, tex, n_tex, texSize);
+}
+
 #endif
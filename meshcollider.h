@@ -0,0 +1,514 @@
+#ifndef MESHCOLLIDER_H
+#define MESHCOLLIDER_H
+
+#include <vector>
+#include <array>
+#include <algorithm>
+#include "vec.h"
+#include "physics.h"
+#include "obj_loader.h"
+
+#define BVH_LEAF_SIZE 4
+#define BVH_BINS 12
+// Child references with this bit set are leaves, holding the number of triangles
+// in bits 24-30 and the index of the first triangle in the lower 24 bits.
+#define BVH_LEAF_BIT 0x80000000u
+#define BVH_MAX_LEAF 127
+// Traversals of trees up to this deep keep their stack on the call stack
+#define BVH_STACK_SIZE 64
+
+// 32 byte node. Stores the bounds of both children, quantized to 16 bits over the
+// bounds of the whole mesh, so a traversal step only touches a single node.
+struct MeshBVHNode {
+  unsigned short qmin[2][3], qmax[2][3];
+  unsigned int child[2];
+};
+static_assert(sizeof(MeshBVHNode) == 32, "MeshBVHNode must stay 32 bytes");
+
+struct MeshBoxHit {
+  int triangle;
+  // Points from the triangle towards the box
+  Vector3 normal;
+  float depth;
+};
+
+// Static triangle mesh in model space with a BVH built by the binned surface area heuristic.
+class TriangleMeshCollider {
+  private:
+    struct TriangleRef {
+      AABB box;
+      Vector3 centroid;
+      unsigned int index;
+    };
+
+    std::vector<Vector3> positions;
+    std::vector<unsigned int> indices;
+    std::vector<MeshBVHNode> nodes;
+    unsigned int root;
+    // Levels of nodes below the root, the most a traversal stack holds is one more
+    int depth;
+    AABB bounds;
+    Vector3 quantScale;
+
+    void init();
+    unsigned int build(std::vector<TriangleRef> &refs, int first, int count, int level);
+    void quantize(const AABB &box, unsigned short qmin[3], unsigned short qmax[3]) const;
+    AABB dequantize(const unsigned short qmin[3], const unsigned short qmax[3]) const;
+    void triangle(int i, Vector3* v0, Vector3* v1, Vector3* v2) const {
+      *v0 = positions[indices[i*3+0]];
+      *v1 = positions[indices[i*3+1]];
+      *v2 = positions[indices[i*3+2]];
+    }
+    template <typename E, typename L> void traverse(E enter, L leaf) const;
+    // Candidate separating axes of a box with unit axes and the triangle v
+    static int separatingAxes(const std::array<Vector3, 3> &axes, const Vector3 v[3], std::array<Vector3, 13> &candidates);
+    // Separating axis test of a box given by its center, unit axes and half extents
+    // against the triangle v, in whichever space both are given in
+    static bool overlapTriangle(const Vector3 &center, const std::array<Vector3, 3> &axes, const float ext[3], const Vector3 v[3], MeshBoxHit* hit);
+  public:
+    TriangleMeshCollider(const cObj &obj);
+    TriangleMeshCollider(const std::vector<Vector3> &positions, const std::vector<unsigned int> &indices);
+
+    size_t triangleCount() const { return indices.size() / 3; }
+    size_t nodeCount() const { return nodes.size(); }
+    int getDepth() const { return depth; }
+    const AABB& getBounds() const { return bounds; }
+    Vector3 triangleNormal(int i) const;
+
+    // Queries in model space, ray.dir does not have to be normalized
+    bool raycast(const Ray &ray, float maxT, float* t, int* triangle) const;
+    // Triangles overlapping the box given by its center, unit axes and half extents
+    int overlapBox(const Vector3 &center, const std::array<Vector3, 3> &axes, const Vector3 &halfExtents, std::vector<MeshBoxHit> &hits) const;
+    // Same for a world space box against the mesh placed with transform
+    int overlapBox(const OBB &box, const Matrix4 &transform, std::vector<MeshBoxHit> &hits) const;
+    // Whether any triangle of the mesh placed with transform comes within radius of the
+    // world space center
+    bool overlapSphere(const Vector3 &center, float radius, const Matrix4 &transform) const;
+    // First contact of a world space box translating by motion with the mesh placed with
+    // transform. toi receives the fraction of motion and normal the world space normal
+    // pointing from the mesh towards the box. Triangles the box already overlaps are
+    // left to the discrete test, as in OBB::sweep.
+    bool sweepBox(const OBB &box, const Vector3 &motion, const Matrix4 &transform, float* toi, Vector3* normal) const;
+};
+
+TriangleMeshCollider::TriangleMeshCollider(const cObj &obj) : root(BVH_LEAF_BIT), depth(0)
+{
+  obj.collisionBuffers(positions, indices);
+  init();
+}
+
+TriangleMeshCollider::TriangleMeshCollider(const std::vector<Vector3> &positions, const std::vector<unsigned int> &indices)
+  : positions(positions), indices(indices), root(BVH_LEAF_BIT), depth(0)
+{
+  init();
+}
+
+void TriangleMeshCollider::init()
+{
+  int count = indices.size() / 3;
+  std::vector<TriangleRef> refs(count);
+  for(int i=0; i<count; i++) {
+    Vector3 v0, v1, v2;
+    triangle(i, &v0, &v1, &v2);
+    refs[i].box.consume(v0);
+    refs[i].box.consume(v1);
+    refs[i].box.consume(v2);
+    refs[i].centroid = (v0 + v1 + v2) * (1.0f / 3);
+    refs[i].index = i;
+    bounds = AABB::merge(bounds, refs[i].box);
+  }
+  if (count == 0) return;
+
+  quantScale = bounds.extent() * (1.0f / 65535);
+  nodes.reserve(2 * count / BVH_LEAF_SIZE + 1);
+  root = build(refs, 0, count, 0);
+
+  // Store the triangles in leaf order so that leaves reference contiguous ranges
+  std::vector<unsigned int> sorted(indices.size());
+  for(int i=0; i<count; i++)
+    for(int k=0; k<3; k++) sorted[i*3+k] = indices[refs[i].index*3+k];
+  indices.swap(sorted);
+}
+
+void TriangleMeshCollider::quantize(const AABB &box, unsigned short qmin[3], unsigned short qmax[3]) const
+{
+  const float lo[3] = { box.min.x - bounds.min.x, box.min.y - bounds.min.y, box.min.z - bounds.min.z };
+  const float hi[3] = { box.max.x - bounds.min.x, box.max.y - bounds.min.y, box.max.z - bounds.min.z };
+  const float scale[3] = { quantScale.x, quantScale.y, quantScale.z };
+  for(int i=0; i<3; i++) {
+    // Round outwards so the quantized box always contains the original
+    if (scale[i] <= 0) { qmin[i] = 0; qmax[i] = 65535; continue; }
+    qmin[i] = (unsigned short)clamp(floorf(lo[i] / scale[i]), 0.0f, 65535.0f);
+    qmax[i] = (unsigned short)clamp(ceilf(hi[i] / scale[i]), 0.0f, 65535.0f);
+  }
+}
+
+AABB TriangleMeshCollider::dequantize(const unsigned short qmin[3], const unsigned short qmax[3]) const
+{
+  return AABB(bounds.min + Vector3(qmin[0], qmin[1], qmin[2]) * quantScale,
+              bounds.min + Vector3(qmax[0], qmax[1], qmax[2]) * quantScale);
+}
+
+unsigned int TriangleMeshCollider::build(std::vector<TriangleRef> &refs, int first, int count, int level)
+{
+  depth = std::max(depth, level);
+  if (count <= BVH_LEAF_SIZE)
+    return BVH_LEAF_BIT | (count << 24) | first;
+
+  AABB centroids;
+  for(int i=first; i<first+count; i++) centroids.consume(refs[i].centroid);
+  Vector3 extent = centroids.extent();
+  const float ext[3] = { extent.x, extent.y, extent.z };
+
+  // Evaluate the SAH over a fixed number of bins along every axis
+  int bestAxis = -1, bestSplit = 0;
+  float bestCost = std::numeric_limits<float>::infinity();
+  for(int axis=0; axis<3; axis++) {
+    if (ext[axis] <= 0) continue;
+    AABB bins[BVH_BINS];
+    int counts[BVH_BINS] = { 0 };
+    float lo = axis == 0 ? centroids.min.x : axis == 1 ? centroids.min.y : centroids.min.z;
+    float k = BVH_BINS * 0.9999f / ext[axis];
+    for(int i=first; i<first+count; i++) {
+      const Vector3 &c = refs[i].centroid;
+      int b = (int)(((axis == 0 ? c.x : axis == 1 ? c.y : c.z) - lo) * k);
+      counts[b]++;
+      bins[b] = AABB::merge(bins[b], refs[i].box);
+    }
+
+    float rightArea[BVH_BINS];
+    int rightCount[BVH_BINS];
+    AABB acc;
+    int n = 0;
+    for(int b=BVH_BINS-1; b>0; b--) {
+      acc = AABB::merge(acc, bins[b]);
+      n += counts[b];
+      rightArea[b] = n ? acc.surfaceArea() : 0;
+      rightCount[b] = n;
+    }
+    acc = AABB();
+    n = 0;
+    for(int b=0; b<BVH_BINS-1; b++) {
+      acc = AABB::merge(acc, bins[b]);
+      n += counts[b];
+      float cost = (n ? acc.surfaceArea() * n : 0) + rightArea[b+1] * rightCount[b+1];
+      if (cost < bestCost) {
+        bestCost = cost;
+        bestAxis = axis;
+        bestSplit = b;
+      }
+    }
+  }
+
+  int mid = first + count / 2;
+  if (bestAxis != -1) {
+    AABB box;
+    for(int i=first; i<first+count; i++) box = AABB::merge(box, refs[i].box);
+    // Splitting isn't worth it when a leaf is cheaper
+    if (count <= BVH_MAX_LEAF && bestCost >= box.surfaceArea() * count)
+      return BVH_LEAF_BIT | (count << 24) | first;
+
+    float lo = bestAxis == 0 ? centroids.min.x : bestAxis == 1 ? centroids.min.y : centroids.min.z;
+    float k = BVH_BINS * 0.9999f / ext[bestAxis];
+    auto it = std::partition(refs.begin() + first, refs.begin() + first + count, [&](const TriangleRef &r) {
+      float c = bestAxis == 0 ? r.centroid.x : bestAxis == 1 ? r.centroid.y : r.centroid.z;
+      return (int)((c - lo) * k) <= bestSplit;
+    });
+    mid = it - refs.begin();
+  }
+  if (mid == first || mid == first + count) mid = first + count / 2;
+
+  unsigned int index = nodes.size();
+  nodes.push_back(MeshBVHNode());
+  unsigned int left = build(refs, first, mid - first, level + 1);
+  unsigned int right = build(refs, mid, first + count - mid, level + 1);
+
+  AABB lbox, rbox;
+  for(int i=first; i<mid; i++) lbox = AABB::merge(lbox, refs[i].box);
+  for(int i=mid; i<first+count; i++) rbox = AABB::merge(rbox, refs[i].box);
+  MeshBVHNode &node = nodes[index];
+  node.child[0] = left;
+  node.child[1] = right;
+  quantize(lbox, node.qmin[0], node.qmax[0]);
+  quantize(rbox, node.qmin[1], node.qmax[1]);
+  return index;
+}
+
+// Walks every child whose bounds pass enter(box), calling leaf(first, count) for leaves
+template <typename E, typename L>
+void TriangleMeshCollider::traverse(E enter, L leaf) const
+{
+  if (indices.empty()) return;
+  if (root & BVH_LEAF_BIT) {
+    if (enter(bounds)) leaf(root & 0xffffff, (root >> 24) & 0x7f);
+    return;
+  }
+  // Every pop pushes at most two children one level further down
+  unsigned int fixed[BVH_STACK_SIZE];
+  std::vector<unsigned int> grown;
+  unsigned int* stack = fixed;
+  if (depth + 1 > BVH_STACK_SIZE) {
+    grown.resize(depth + 1);
+    stack = grown.data();
+  }
+  int top = 0;
+  stack[top++] = root;
+  while(top > 0) {
+    const MeshBVHNode &n = nodes[stack[--top]];
+    for(int c=0; c<2; c++) {
+      if (!enter(dequantize(n.qmin[c], n.qmax[c]))) continue;
+      unsigned int ref = n.child[c];
+      if (ref & BVH_LEAF_BIT) leaf(ref & 0xffffff, (ref >> 24) & 0x7f);
+      else stack[top++] = ref;
+    }
+  }
+}
+
+Vector3 TriangleMeshCollider::triangleNormal(int i) const
+{
+  Vector3 v0, v1, v2;
+  triangle(i, &v0, &v1, &v2);
+  return Vector3::cross(v1 - v0, v2 - v0).normalize();
+}
+
+bool TriangleMeshCollider::raycast(const Ray &ray, float maxT, float* t, int* hitTriangle) const
+{
+  Vector3 invDir = ray.inverseDir();
+  bool hit = false;
+  traverse([&](const AABB &box) { return box.intersects(ray.origin, invDir, maxT); },
+    [&](int first, int count) {
+      for(int i=first; i<first+count; i++) {
+        // Moller-Trumbore
+        Vector3 v0, v1, v2;
+        triangle(i, &v0, &v1, &v2);
+        Vector3 e1 = v1 - v0;
+        Vector3 e2 = v2 - v0;
+        Vector3 p = Vector3::cross(ray.dir, e2);
+        float det = Vector3::dot(e1, p);
+        if (fabs(det) < 1e-12f) continue;
+        float inv = 1.0f / det;
+        Vector3 s = ray.origin - v0;
+        float u = Vector3::dot(s, p) * inv;
+        if (u < 0 || u > 1) continue;
+        Vector3 q = Vector3::cross(s, e1);
+        float v = Vector3::dot(ray.dir, q) * inv;
+        if (v < 0 || u + v > 1) continue;
+        float d = Vector3::dot(e2, q) * inv;
+        if (d < 0 || d > maxT) continue;
+        maxT = d;
+        *t = d;
+        *hitTriangle = i;
+        hit = true;
+      }
+    });
+  return hit;
+}
+
+int TriangleMeshCollider::separatingAxes(const std::array<Vector3, 3> &axes, const Vector3 v[3], std::array<Vector3, 13> &candidates)
+{
+  Vector3 edges[3] = { v[1] - v[0], v[2] - v[1], v[0] - v[2] };
+  int n = 0;
+  for(int k=0; k<3; k++) candidates[n++] = axes[k];
+  candidates[n++] = Vector3::cross(edges[0], edges[1]);
+  for(int a=0; a<3; a++)
+    for(int e=0; e<3; e++) candidates[n++] = Vector3::cross(axes[a], edges[e]);
+  return n;
+}
+
+bool TriangleMeshCollider::overlapTriangle(const Vector3 &center, const std::array<Vector3, 3> &axes, const float ext[3], const Vector3 v[3], MeshBoxHit* hit)
+{
+  std::array<Vector3, 13> candidates;
+  int n = separatingAxes(axes, v, candidates);
+
+  // Keeps the axis of least penetration
+  hit->depth = std::numeric_limits<float>::infinity();
+  for(int k=0; k<n; k++) {
+    Vector3 L = candidates[k];
+    float len = L.length();
+    if (len < 1e-6f) continue;
+    L = L * (1.0f / len);
+    float r = ext[0] * fabs(Vector3::dot(axes[0], L)) + ext[1] * fabs(Vector3::dot(axes[1], L)) + ext[2] * fabs(Vector3::dot(axes[2], L));
+    float c = Vector3::dot(center, L);
+    float t0 = Vector3::dot(v[0], L), t1 = Vector3::dot(v[1], L), t2 = Vector3::dot(v[2], L);
+    float tmin = std::min(t0, std::min(t1, t2));
+    float tmax = std::max(t0, std::max(t1, t2));
+    if (c - r > tmax || c + r < tmin) return false;
+    // Push the box out along whichever side of the triangle it is closest to
+    float up = tmax - (c - r);
+    float down = (c + r) - tmin;
+    float depth = std::min(up, down);
+    if (depth < hit->depth) {
+      hit->depth = depth;
+      hit->normal = up < down ? L : -L;
+    }
+  }
+  return true;
+}
+
+int TriangleMeshCollider::overlapBox(const Vector3 &center, const std::array<Vector3, 3> &axes, const Vector3 &h, std::vector<MeshBoxHit> &hits) const
+{
+  const float ext[3] = { h.x, h.y, h.z };
+  AABB query;
+  for(int i=0; i<8; i++) {
+    Vector3 corner = center;
+    for(int k=0; k<3; k++) corner += axes[k] * (((i >> k) & 1) ? ext[k] : -ext[k]);
+    query.consume(corner);
+  }
+
+  int found = 0;
+  traverse([&](const AABB &box) { return box.overlaps(query); },
+    [&](int first, int count) {
+      for(int i=first; i<first+count; i++) {
+        Vector3 v[3];
+        triangle(i, &v[0], &v[1], &v[2]);
+        MeshBoxHit hit;
+        if (!overlapTriangle(center, axes, ext, v, &hit)) continue;
+        hit.triangle = i;
+        hits.push_back(hit);
+        found++;
+      }
+    });
+  return found;
+}
+
+int TriangleMeshCollider::overlapBox(const OBB &box, const Matrix4 &transform, std::vector<MeshBoxHit> &hits) const
+{
+  // Tested in world space, where the box stays a box under any scale of the mesh and
+  // normals and depths come out as they are. The BVH is walked with the model space
+  // bounds of the box.
+  Affine3 m = Affine3(transform);
+  Affine3 inverse = m.inverted();
+  auto axes = box.getNormals();
+  Vector3 h = box.halfExtents();
+  const float ext[3] = { h.x, h.y, h.z };
+  Vector3 center = box.center();
+  AABB query;
+  for(const Vector3 &p : box.getPoints()) query.consume(inverse.transformPoint(p));
+
+  int found = 0;
+  traverse([&](const AABB &node) { return node.overlaps(query); },
+    [&](int first, int count) {
+      for(int i=first; i<first+count; i++) {
+        Vector3 v[3];
+        triangle(i, &v[0], &v[1], &v[2]);
+        for(int k=0; k<3; k++) v[k] = m.transformPoint(v[k]);
+        MeshBoxHit hit;
+        if (!overlapTriangle(center, axes, ext, v, &hit)) continue;
+        hit.triangle = i;
+        hits.push_back(hit);
+        found++;
+      }
+    });
+  return found;
+}
+
+// Closest point to p on the triangle a, b, c, by the Voronoi region p lies in
+static Vector3 closestPointOnTriangle(const Vector3 &p, const Vector3 &a, const Vector3 &b, const Vector3 &c)
+{
+  Vector3 ab = b - a, ac = c - a, ap = p - a;
+  float d1 = Vector3::dot(ab, ap), d2 = Vector3::dot(ac, ap);
+  if (d1 <= 0 && d2 <= 0) return a;
+  Vector3 bp = p - b;
+  float d3 = Vector3::dot(ab, bp), d4 = Vector3::dot(ac, bp);
+  if (d3 >= 0 && d4 <= d3) return b;
+  float vc = d1 * d4 - d3 * d2;
+  if (vc <= 0 && d1 >= 0 && d3 <= 0) return a + ab * (d1 / (d1 - d3));
+  Vector3 cp = p - c;
+  float d5 = Vector3::dot(ab, cp), d6 = Vector3::dot(ac, cp);
+  if (d6 >= 0 && d5 <= d6) return c;
+  float vb = d5 * d2 - d1 * d6;
+  if (vb <= 0 && d2 >= 0 && d6 <= 0) return a + ac * (d2 / (d2 - d6));
+  float va = d3 * d6 - d5 * d4;
+  if (va <= 0 && d4 - d3 >= 0 && d5 - d6 >= 0) return b + (c - b) * ((d4 - d3) / ((d4 - d3) + (d5 - d6)));
+  float denom = 1.0f / (va + vb + vc);
+  return a + ab * (vb * denom) + ac * (vc * denom);
+}
+
+bool TriangleMeshCollider::overlapSphere(const Vector3 &center, float radius, const Matrix4 &transform) const
+{
+  // The sphere is no sphere in model space under non-uniform scale, so the BVH is
+  // walked with its bounds and the triangles are tested in world space
+  Affine3 m = Affine3(transform);
+  Affine3 inverse = m.inverted();
+  AABB query = transformAABB(inverse.toMatrix(), AABB(center - Vector3(radius), center + Vector3(radius)));
+  bool found = false;
+  traverse([&](const AABB &box) { return !found && box.overlaps(query); },
+    [&](int first, int count) {
+      for(int i=first; i<first+count && !found; i++) {
+        Vector3 v0, v1, v2;
+        triangle(i, &v0, &v1, &v2);
+        Vector3 p = closestPointOnTriangle(center, m.transformPoint(v0), m.transformPoint(v1), m.transformPoint(v2));
+        found = (p - center).sq_length() <= radius * radius;
+      }
+    });
+  return found;
+}
+
+bool TriangleMeshCollider::sweepBox(const OBB &box, const Vector3 &motion, const Matrix4 &transform, float* toi, Vector3* normal) const
+{
+  // Swept in world space, where the box stays a box under any scale of the mesh.
+  // The BVH is walked with the model space bounds of the swept box.
+  Affine3 m = Affine3(transform);
+  Affine3 inverse = m.inverted();
+  auto axes = box.getNormals();
+  Vector3 h = box.halfExtents();
+  const float ext[3] = { h.x, h.y, h.z };
+  Vector3 center = box.center();
+  AABB query;
+  for(const Vector3 &p : box.getPoints()) {
+    query.consume(inverse.transformPoint(p));
+    query.consume(inverse.transformPoint(p + motion));
+  }
+
+  float best = 1;
+  bool hit = false;
+  traverse([&](const AABB &node) { return node.overlaps(query); },
+    [&](int first, int count) {
+      for(int i=first; i<first+count; i++) {
+        Vector3 v[3];
+        triangle(i, &v[0], &v[1], &v[2]);
+        for(int k=0; k<3; k++) v[k] = m.transformPoint(v[k]);
+        std::array<Vector3, 13> candidates;
+        int n = separatingAxes(axes, v, candidates);
+
+        // The projections of box and triangle overlap from enter to exit on every
+        // axis, they touch once all of them do
+        float enter = -std::numeric_limits<float>::infinity();
+        float exit = std::numeric_limits<float>::infinity();
+        Vector3 axis;
+        bool separated = false;
+        for(int k=0; k<n && !separated; k++) {
+          Vector3 L = candidates[k];
+          float len = L.length();
+          if (len < 1e-6f) continue;
+          L = L * (1.0f / len);
+          float r = ext[0] * fabs(Vector3::dot(axes[0], L)) + ext[1] * fabs(Vector3::dot(axes[1], L)) + ext[2] * fabs(Vector3::dot(axes[2], L));
+          float c = Vector3::dot(center, L);
+          float t0 = Vector3::dot(v[0], L), t1 = Vector3::dot(v[1], L), t2 = Vector3::dot(v[2], L);
+          float tmin = std::min(t0, std::min(t1, t2));
+          float tmax = std::max(t0, std::max(t1, t2));
+          float speed = Vector3::dot(motion, L);
+          if (fabs(speed) < 1e-9f) {
+            separated = c - r > tmax || c + r < tmin;
+            continue;
+          }
+          float from = ((speed > 0 ? tmin : tmax) - (c + (speed > 0 ? r : -r))) / speed;
+          float to = ((speed > 0 ? tmax : tmin) - (c - (speed > 0 ? r : -r))) / speed;
+          if (from > enter) {
+            enter = from;
+            axis = speed > 0 ? -L : L;
+          }
+          exit = std::min(exit, to);
+          separated = enter > exit || enter > best || exit < 0;
+        }
+        if (separated || enter < 0) continue;
+        best = enter;
+        *normal = axis;
+        hit = true;
+      }
+    });
+  if (hit) *toi = best;
+  return hit;
+}
+
+#endif
@@ -3,8 +3,11 @@
 #include <stdio.h>
 #include <vector>
 #include <sstream>
+#include <fstream>
+#include <iostream>
 
 #include "vec.h"
+#include "logger.h"
 
 
 struct vertex {
@@ -63,6 +66,8 @@ class cObj {
 
   void renderBuffers(std::vector<float> &v_buf, std::vector<float> &n_buf, std::vector<float> &uv_buf) const;
   void renderBuffersTangents(std::vector<float> &v_buf, std::vector<float> &n_buf, std::vector<float> &uv_buf, std::vector<float> &t_buf, std::vector<float> &bt_buf) const;
+  // Positions with fan triangulated faces, normals and texture coordinates are not required
+  void collisionBuffers(std::vector<Vector3> &positions, std::vector<unsigned int> &indices) const;
 };
 
 cObj::cObj(std::string filename) {
@@ -305,6 +310,21 @@ void cObj::renderBuffersTangents(std::vector<float> &v_buf, std::vector<float> &
   }
 }
 
+void cObj::collisionBuffers(std::vector<Vector3> &positions, std::vector<unsigned int> &indices) const
+{
+  for(const vertex &v : vertices)
+    positions.push_back(Vector3(v.v[0], v.v[1], v.v[2]));
+  for(const face &f : faces)
+  {
+    for(size_t i=2; i<f.vertex.size(); i++)
+    {
+      indices.push_back(f.vertex[0]);
+      indices.push_back(f.vertex[i-1]);
+      indices.push_back(f.vertex[i]);
+    }
+  }
+}
+
 cObj::~cObj() { }
 
 #endif
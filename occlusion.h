@@ -0,0 +1,293 @@
+#ifndef OCCLUSION_H
+#define OCCLUSION_H
+
+#include <vector>
+#include <algorithm>
+#include "vec.h"
+#include "transform.h"
+#include "workers.h"
+
+// Masked software occlusion culling. Occluders are convex planar quads, rasterized
+// into a small depth buffer of tiles that keep a coverage mask and two depths
+// instead of a depth per pixel. Bounding boxes are tested against it before they
+// are drawn. Only pixels that an occluder covers entirely count as covered, so
+// nothing visible is culled at any screen resolution.
+
+#define OCCLUSION_WIDTH 256
+#define OCCLUSION_HEIGHT 128
+// One bit of the coverage mask per pixel of a tile
+#define OCCLUSION_TILE_WIDTH 8
+#define OCCLUSION_TILE_HEIGHT 4
+// Rows of tiles rasterized by one job
+#define OCCLUSION_BAND_ROWS 4
+// A quad clipped by the near plane gains a vertex
+#define OCCLUSION_MAX_EDGES 5
+
+// Per frame counters
+struct OcclusionStats {
+  unsigned long long occluders, tested, frustumCulled, occluded;
+};
+
+class OcclusionCuller {
+  private:
+    struct Tile {
+      // Depths are in [0, 1]. Every pixel lies in front of zMax0, the pixels in mask
+      // also in front of zMax1, which is 0 while the mask is empty.
+      unsigned int mask;
+      float zMax0, zMax1;
+    };
+    struct Polygon {
+      // Edge functions a * x + b * y + c at pixel centers, positive for pixels entirely inside
+      float a[OCCLUSION_MAX_EDGES], b[OCCLUSION_MAX_EDGES], c[OCCLUSION_MAX_EDGES];
+      int edges;
+      // Depth plane z + dzdx * x + dzdy * y, capped by the farthest vertex
+      float z, dzdx, dzdy, zmax;
+      int minX, minY, maxX, maxY;
+    };
+
+    WorkerPool pool;
+    int tilesX, tilesY;
+    Matrix4 camera;
+    std::vector<Tile> tiles;
+    std::vector<Polygon> polygons;
+
+    void setup(const Vector4* clip, int count);
+    void rasterizeBand(int band);
+    template <typename T> unsigned int coverage(const Polygon &p, int tileX, int tileY) const;
+  public:
+    OcclusionStats stats;
+    // Zero threads uses every core
+    OcclusionCuller(int threads = 0);
+    int threadCount() const { return pool.size(); }
+    // Clears the buffer, camera is the view projection as in Camera::getMatrix
+    void begin(const Matrix4 &camera);
+    // Quads of four vertices each in model space, placed by m
+    void addOccluder(const Affine3 &m, const Vector3* quads, int count);
+    void rasterize();
+    // False when the box is outside the view or hidden behind the occluders
+    bool isVisible(const AABB &box);
+};
+
+OcclusionCuller::OcclusionCuller(int threads)
+  : pool(threads > 0 ? threads : std::max(1u, std::thread::hardware_concurrency())),
+    tilesX(OCCLUSION_WIDTH / OCCLUSION_TILE_WIDTH), tilesY(OCCLUSION_HEIGHT / OCCLUSION_TILE_HEIGHT),
+    camera(Matrix4::Identity()), tiles(tilesX * tilesY), stats()
+{
+}
+
+void OcclusionCuller::begin(const Matrix4 &camera)
+{
+  this->camera = camera;
+  polygons.clear();
+  stats = OcclusionStats();
+  for(Tile &t : tiles) t = Tile{ 0, 1, 0 };
+}
+
+void OcclusionCuller::addOccluder(const Affine3 &m, const Vector3* quads, int count)
+{
+  Matrix4 mvp = camera * m.toMatrix();
+  for(int q=0; q<count; q++) {
+    Vector4 in[4];
+    for(int i=0; i<4; i++) in[i] = mvp * Vector4(quads[q * 4 + i], 1);
+
+    // Clip against the near plane, z + w >= 0
+    Vector4 out[OCCLUSION_MAX_EDGES];
+    int n = 0;
+    for(int i=0; i<4; i++) {
+      const Vector4 &a = in[i], &b = in[(i + 1) % 4];
+      float da = a.z + a.w, db = b.z + b.w;
+      if (da >= 0) out[n++] = a;
+      if ((da >= 0) != (db >= 0)) {
+        float t = da / (da - db);
+        out[n++] = Vector4(a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t, a.z + (b.z - a.z) * t, a.w + (b.w - a.w) * t);
+      }
+    }
+    if (n >= 3) setup(out, n);
+  }
+  stats.occluders += count;
+}
+
+void OcclusionCuller::setup(const Vector4* clip, int count)
+{
+  float x[OCCLUSION_MAX_EDGES], y[OCCLUSION_MAX_EDGES], z[OCCLUSION_MAX_EDGES];
+  float minX = INFINITY, minY = INFINITY, maxX = -INFINITY, maxY = -INFINITY, zmax = 0;
+  for(int i=0; i<count; i++) {
+    float iw = 1 / clip[i].w;
+    // Pixel coordinates from the top left like SoftwareRenderer, depth mapped to [0, 1]
+    x[i] = (clip[i].x * iw * 0.5f + 0.5f) * OCCLUSION_WIDTH;
+    y[i] = (0.5f - clip[i].y * iw * 0.5f) * OCCLUSION_HEIGHT;
+    z[i] = clip[i].z * iw * 0.5f + 0.5f;
+    minX = std::min(minX, x[i]); maxX = std::max(maxX, x[i]);
+    minY = std::min(minY, y[i]); maxY = std::max(maxY, y[i]);
+    zmax = std::max(zmax, z[i]);
+  }
+
+  // Signed area of the fan, the edges run counter clockwise in pixel coordinates
+  // when it is positive. The largest triangle of the fan gives the depth plane.
+  float area = 0, best = 0;
+  int apex = 1;
+  for(int i=1; i+1<count; i++) {
+    float t = (x[i] - x[0]) * (y[i + 1] - y[0]) - (x[i + 1] - x[0]) * (y[i] - y[0]);
+    area += t;
+    if (fabsf(t) > fabsf(best)) { best = t; apex = i; }
+  }
+  if (fabsf(best) < 1e-6f) return;
+
+  Polygon p;
+  p.edges = count;
+  float sign = area > 0 ? 1 : -1;
+  for(int i=0; i<count; i++) {
+    int j = (i + 1) % count;
+    p.a[i] = (y[i] - y[j]) * sign;
+    p.b[i] = (x[j] - x[i]) * sign;
+    // Moved inwards by half a pixel along both axes
+    p.c[i] = -(p.a[i] * x[i] + p.b[i] * y[i]) - 0.5f * (fabsf(p.a[i]) + fabsf(p.b[i]));
+  }
+
+  float x1 = x[apex] - x[0], y1 = y[apex] - y[0], z1 = z[apex] - z[0];
+  float x2 = x[apex + 1] - x[0], y2 = y[apex + 1] - y[0], z2 = z[apex + 1] - z[0];
+  p.dzdx = (z1 * y2 - z2 * y1) / best;
+  p.dzdy = (z2 * x1 - z1 * x2) / best;
+  p.z = z[0] - p.dzdx * x[0] - p.dzdy * y[0];
+  p.zmax = std::min(zmax, 1.0f);
+
+  // Pixels whose center lies in the bounds
+  p.minX = std::max(0, (int)ceilf(minX - 0.5f));
+  p.minY = std::max(0, (int)ceilf(minY - 0.5f));
+  p.maxX = std::min(OCCLUSION_WIDTH - 1, (int)floorf(maxX - 0.5f));
+  p.maxY = std::min(OCCLUSION_HEIGHT - 1, (int)floorf(maxY - 0.5f));
+  if (p.minX > p.maxX || p.minY > p.maxY) return;
+  polygons.push_back(p);
+}
+
+void OcclusionCuller::rasterize()
+{
+  int bands = (tilesY + OCCLUSION_BAND_ROWS - 1) / OCCLUSION_BAND_ROWS;
+  pool.run(bands, [this](int band) { rasterizeBand(band); });
+}
+
+// Bit y * OCCLUSION_TILE_WIDTH + x for every pixel of the tile inside all edges
+template <typename T>
+unsigned int OcclusionCuller::coverage(const Polygon &p, int tileX, int tileY) const
+{
+  unsigned int mask = 0;
+  T offsets = lanesIndex<T>() + lanes<T>(0.5f + tileX * OCCLUSION_TILE_WIDTH);
+  for(int r=0; r<OCCLUSION_TILE_HEIGHT; r++) {
+    float py = tileY * OCCLUSION_TILE_HEIGHT + r + 0.5f;
+    for(int x=0; x<OCCLUSION_TILE_WIDTH; x += BATCH_WIDTH) {
+      T px = offsets + lanes<T>(x);
+      auto inside = lanes<T>(p.a[0]) * px + lanes<T>(p.b[0] * py + p.c[0]) >= lanes<T>(0);
+      for(int e=1; e<p.edges; e++)
+        inside = inside & (lanes<T>(p.a[e]) * px + lanes<T>(p.b[e] * py + p.c[e]) >= lanes<T>(0));
+      mask |= (unsigned int)lanesBits(inside) << (r * OCCLUSION_TILE_WIDTH + x);
+    }
+  }
+  return mask;
+}
+
+void OcclusionCuller::rasterizeBand(int band)
+{
+  int firstRow = band * OCCLUSION_BAND_ROWS;
+  int lastRow = std::min(tilesY, firstRow + OCCLUSION_BAND_ROWS) - 1;
+  for(const Polygon &p : polygons) {
+    int y0 = std::max(firstRow, p.minY / OCCLUSION_TILE_HEIGHT), y1 = std::min(lastRow, p.maxY / OCCLUSION_TILE_HEIGHT);
+    int x0 = p.minX / OCCLUSION_TILE_WIDTH, x1 = p.maxX / OCCLUSION_TILE_WIDTH;
+    for(int ty=y0; ty<=y1; ty++) {
+      for(int tx=x0; tx<=x1; tx++) {
+        // Pixel centers at the corners of the tile
+        float left = tx * OCCLUSION_TILE_WIDTH + 0.5f, right = left + OCCLUSION_TILE_WIDTH - 1;
+        float top = ty * OCCLUSION_TILE_HEIGHT + 0.5f, bottom = top + OCCLUSION_TILE_HEIGHT - 1;
+
+        // The smallest and largest value of every edge function over the tile
+        bool full = true, empty = false;
+        for(int e=0; e<p.edges; e++) {
+          float lo = p.a[e] * (p.a[e] > 0 ? left : right) + p.b[e] * (p.b[e] > 0 ? top : bottom) + p.c[e];
+          float hi = p.a[e] * (p.a[e] > 0 ? right : left) + p.b[e] * (p.b[e] > 0 ? bottom : top) + p.c[e];
+          full &= lo >= 0;
+          empty |= hi < 0;
+        }
+        if (empty) continue;
+
+        Tile &t = tiles[ty * tilesX + tx];
+        float z = p.z + p.dzdx * (p.dzdx > 0 ? right : left) + p.dzdy * (p.dzdy > 0 ? bottom : top);
+        z = std::min(z, p.zmax);
+        if (z >= t.zMax0) continue;
+        unsigned int mask = full ? ~0u : coverage<batch>(p, tx, ty);
+        if (!mask) continue;
+
+        // Merge into the working layer, which is dropped when it lies much further
+        // behind the polygon than in front of the reference layer
+        if (t.zMax1 - z > t.zMax0 - t.zMax1) {
+          t.zMax1 = 0;
+          t.mask = 0;
+        }
+        t.zMax1 = std::max(t.zMax1, z);
+        t.mask |= mask;
+        if (t.mask == ~0u) {
+          t.zMax0 = t.zMax1;
+          t.zMax1 = 0;
+          t.mask = 0;
+        }
+      }
+    }
+  }
+}
+
+bool OcclusionCuller::isVisible(const AABB &box)
+{
+  stats.tested++;
+  Vector4 clip[8];
+  // Planes of the view frustum that every corner lies outside of
+  unsigned int outside = 0x3f;
+  bool crossesNear = false;
+  for(int i=0; i<8; i++) {
+    Vector3 corner = Vector3(i & 1 ? box.max.x : box.min.x, i & 2 ? box.max.y : box.min.y, i & 4 ? box.max.z : box.min.z);
+    const Vector4 &c = clip[i] = camera * Vector4(corner, 1);
+    outside &= (c.x < -c.w) | (c.x > c.w) << 1 | (c.y < -c.w) << 2 | (c.y > c.w) << 3 | (c.z < -c.w) << 4 | (c.z > c.w) << 5;
+    crossesNear |= c.z + c.w < 0;
+  }
+  if (outside) {
+    stats.frustumCulled++;
+    return false;
+  }
+  // The projected bounds are meaningless for corners behind the camera
+  if (crossesNear) return true;
+
+  float minX = INFINITY, minY = INFINITY, maxX = -INFINITY, maxY = -INFINITY, zmin = INFINITY;
+  for(const Vector4 &c : clip) {
+    float iw = 1 / c.w;
+    float x = (c.x * iw * 0.5f + 0.5f) * OCCLUSION_WIDTH;
+    float y = (0.5f - c.y * iw * 0.5f) * OCCLUSION_HEIGHT;
+    minX = std::min(minX, x); maxX = std::max(maxX, x);
+    minY = std::min(minY, y); maxY = std::max(maxY, y);
+    zmin = std::min(zmin, c.z * iw * 0.5f + 0.5f);
+  }
+
+  // Every pixel the box touches
+  int x0 = std::max(0, (int)floorf(minX)), x1 = std::min(OCCLUSION_WIDTH - 1, (int)floorf(maxX));
+  int y0 = std::max(0, (int)floorf(minY)), y1 = std::min(OCCLUSION_HEIGHT - 1, (int)floorf(maxY));
+  if (x0 > x1 || y0 > y1) {
+    stats.frustumCulled++;
+    return false;
+  }
+
+  for(int ty = y0 / OCCLUSION_TILE_HEIGHT; ty <= y1 / OCCLUSION_TILE_HEIGHT; ty++) {
+    // Rows of the tile within the box
+    int r0 = std::max(y0 - ty * OCCLUSION_TILE_HEIGHT, 0);
+    int r1 = std::min(y1 - ty * OCCLUSION_TILE_HEIGHT, OCCLUSION_TILE_HEIGHT - 1);
+    unsigned int rows = (2u << (r1 * OCCLUSION_TILE_WIDTH + OCCLUSION_TILE_WIDTH - 1)) - (1u << (r0 * OCCLUSION_TILE_WIDTH));
+    for(int tx = x0 / OCCLUSION_TILE_WIDTH; tx <= x1 / OCCLUSION_TILE_WIDTH; tx++) {
+      int c0 = std::max(x0 - tx * OCCLUSION_TILE_WIDTH, 0);
+      int c1 = std::min(x1 - tx * OCCLUSION_TILE_WIDTH, OCCLUSION_TILE_WIDTH - 1);
+      unsigned int columns = ((2u << c1) - (1u << c0)) * 0x01010101u;
+      const Tile &t = tiles[ty * tilesX + tx];
+      // Farthest depth of the pixels under the box
+      float farthest = (columns & rows & ~t.mask) ? t.zMax0 : std::min(t.zMax0, t.zMax1);
+      if (zmin <= farthest) return true;
+    }
+  }
+  stats.occluded++;
+  return false;
+}
+
+#endif
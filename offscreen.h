@@ -0,0 +1,213 @@
+#ifndef OFFSCREEN_H
+#define OFFSCREEN_H
+
+#include <stdio.h>
+#include <vector>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#include "logger.h"
+
+// GL context without a window or display server, created through EGL on the
+// surfaceless platform of Mesa. On machines without a GPU Mesa falls back to
+// llvmpipe, which still provides GL 4.5 core.
+class OffscreenContext {
+  private:
+    EGLDisplay display;
+    EGLContext context;
+  public:
+    OffscreenContext() : display(EGL_NO_DISPLAY), context(EGL_NO_CONTEXT) {}
+    ~OffscreenContext();
+    // Creates the context and makes it current
+    bool create(int major, int minor);
+};
+
+OffscreenContext::~OffscreenContext()
+{
+  if (context != EGL_NO_CONTEXT) {
+    eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(display, context);
+  }
+  if (display != EGL_NO_DISPLAY) eglTerminate(display);
+}
+
+bool OffscreenContext::create(int major, int minor)
+{
+  auto getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+  if (getPlatformDisplay) display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+  if (display == EGL_NO_DISPLAY) display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+  EGLint eglMajor, eglMinor;
+  if (display == EGL_NO_DISPLAY || !eglInitialize(display, &eglMajor, &eglMinor)) {
+    logError("No EGL display available");
+    return false;
+  }
+  logDebug("EGL version:\t\t%i.%i", eglMajor, eglMinor);
+
+  if (!eglBindAPI(EGL_OPENGL_API)) {
+    logError("EGL does not support desktop OpenGL");
+    return false;
+  }
+  // Nothing is drawn to an EGL surface, so any config will do
+  EGLConfig config = EGL_NO_CONFIG_KHR;
+  const EGLint configAttributes[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+  EGLint configs = 0;
+  eglChooseConfig(display, configAttributes, &config, 1, &configs);
+  if (configs == 0) config = EGL_NO_CONFIG_KHR;
+
+  const EGLint contextAttributes[] = {
+    EGL_CONTEXT_MAJOR_VERSION, major,
+    EGL_CONTEXT_MINOR_VERSION, minor,
+    EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+    EGL_NONE
+  };
+  context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttributes);
+  if (context == EGL_NO_CONTEXT) {
+    logError("Could not create an OpenGL %i.%i context (EGL error 0x%x)", major, minor, eglGetError());
+    return false;
+  }
+  if (!eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context)) {
+    logError("Could not make the context current (EGL error 0x%x)", eglGetError());
+    return false;
+  }
+  return true;
+}
+
+// Color and depth render target of any size, standing in for the default framebuffer
+class OffscreenTarget {
+  private:
+    GLuint fbo, color, depth;
+    int width, height;
+  public:
+    OffscreenTarget(int width, int height);
+    ~OffscreenTarget();
+    bool isComplete() const;
+    void bind() const { glBindFramebuffer(GL_FRAMEBUFFER, fbo); }
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+    // RGBA8 rows from the top
+    void read(std::vector<unsigned char> &pixels) const;
+};
+
+OffscreenTarget::OffscreenTarget(int width, int height) : width(width), height(height)
+{
+  glGenFramebuffers(1, &fbo);
+  glGenRenderbuffers(1, &color);
+  glGenRenderbuffers(1, &depth);
+  glBindRenderbuffer(GL_RENDERBUFFER, color);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+  glBindRenderbuffer(GL_RENDERBUFFER, depth);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+  glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, color);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+OffscreenTarget::~OffscreenTarget()
+{
+  glDeleteFramebuffers(1, &fbo);
+  glDeleteRenderbuffers(1, &color);
+  glDeleteRenderbuffers(1, &depth);
+}
+
+bool OffscreenTarget::isComplete() const
+{
+  glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+  bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  return complete;
+}
+
+void OffscreenTarget::read(std::vector<unsigned char> &pixels) const
+{
+  pixels.resize(width * height * 4);
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, fbo);
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+  glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+  // GL starts at the bottom row
+  std::vector<unsigned char> row(width * 4);
+  for(int y=0; y<height/2; y++) {
+    unsigned char* top = &pixels[y * width * 4];
+    unsigned char* bottom = &pixels[(height - 1 - y) * width * 4];
+    std::copy(top, top + width * 4, row.begin());
+    std::copy(bottom, bottom + width * 4, top);
+    std::copy(row.begin(), row.end(), bottom);
+  }
+}
+
+inline unsigned int pngCrc(unsigned int crc, const unsigned char* data, size_t size)
+{
+  static unsigned int table[256];
+  if (!table[1]) {
+    for(unsigned int i=0; i<256; i++) {
+      unsigned int c = i;
+      for(int k=0; k<8; k++) c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+      table[i] = c;
+    }
+  }
+  crc = ~crc;
+  for(size_t i=0; i<size; i++) crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+// RGBA8 rows from the top. The image data is stored without compression, which keeps
+// the build free of zlib at the cost of larger files.
+bool writePNG(const char* filename, int width, int height, const unsigned char* rgba)
+{
+  // Every row starts with filter type 0
+  std::vector<unsigned char> raw;
+  raw.reserve((width * 4 + 1) * height);
+  for(int y=0; y<height; y++) {
+    raw.push_back(0);
+    raw.insert(raw.end(), rgba + y * width * 4, rgba + (y + 1) * width * 4);
+  }
+
+  // zlib stream of stored deflate blocks of at most 65535 bytes each
+  std::vector<unsigned char> z = { 0x78, 0x01 };
+  unsigned int a = 1, b = 0;
+  for(size_t i=0; i<raw.size(); i+=65535) {
+    size_t n = std::min<size_t>(65535, raw.size() - i);
+    z.push_back(i + n == raw.size());
+    z.push_back(n & 0xff); z.push_back(n >> 8);
+    z.push_back(~n & 0xff); z.push_back((~n >> 8) & 0xff);
+    z.insert(z.end(), raw.begin() + i, raw.begin() + i + n);
+    for(size_t k=i; k<i+n; k++) {
+      a = (a + raw[k]) % 65521;
+      b = (b + a) % 65521;
+    }
+  }
+  unsigned int adler = (b << 16) | a;
+  for(int s=24; s>=0; s-=8) z.push_back(adler >> s);
+
+  FILE* f = fopen(filename, "wb");
+  if (!f) {
+    logError("Could not write %s", filename);
+    return false;
+  }
+  auto chunk = [f](const char* type, const unsigned char* data, size_t size) {
+    unsigned char header[8] = { (unsigned char)(size >> 24), (unsigned char)(size >> 16), (unsigned char)(size >> 8), (unsigned char)size,
+                                (unsigned char)type[0], (unsigned char)type[1], (unsigned char)type[2], (unsigned char)type[3] };
+    unsigned int crc = pngCrc(pngCrc(0, header + 4, 4), data, size);
+    unsigned char footer[4] = { (unsigned char)(crc >> 24), (unsigned char)(crc >> 16), (unsigned char)(crc >> 8), (unsigned char)crc };
+    fwrite(header, 1, 8, f);
+    fwrite(data, 1, size, f);
+    fwrite(footer, 1, 4, f);
+  };
+  const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+  fwrite(signature, 1, 8, f);
+  // 8 bits per channel, color type 6 is RGBA
+  const unsigned char header[13] = { (unsigned char)(width >> 24), (unsigned char)(width >> 16), (unsigned char)(width >> 8), (unsigned char)width,
+                                     (unsigned char)(height >> 24), (unsigned char)(height >> 16), (unsigned char)(height >> 8), (unsigned char)height,
+                                     8, 6, 0, 0, 0 };
+  chunk("IHDR", header, 13);
+  chunk("IDAT", z.data(), z.size());
+  chunk("IEND", nullptr, 0);
+  bool ok = !ferror(f);
+  fclose(f);
+  return ok;
+}
+
+#endif
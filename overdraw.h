@@ -0,0 +1,121 @@
+#ifndef OVERDRAW_H
+#define OVERDRAW_H
+
+#include <vector>
+
+#include "shaders.h"
+
+// Heat map of the fragments shaded per pixel. Meshes are drawn into it with the
+// OVERDRAW_PASS programs under the depth state of the shading pass they stand in for,
+// so after a depth pre-pass every visible pixel counts one.
+class OverdrawView {
+  private:
+    GLuint fbo, counts, depth;
+    int width, height;
+    // Framebuffer to resolve into, the one bound at begin
+    GLint target;
+    GLuint program, vao;
+    GLint uCounts;
+    void allocate(int w, int h);
+  public:
+    OverdrawView();
+    ~OverdrawView();
+    OverdrawView(const OverdrawView&) = delete;
+    OverdrawView& operator=(const OverdrawView&) = delete;
+    // Binds and clears the counts, resized to w by h when needed, and blends every
+    // fragment onto them until resolve
+    void begin(int w, int h);
+    // Draws the counts as colors into the framebuffer bound before begin
+    void resolve();
+    // Fragments per pixel that got any, reads the counts back so it stalls
+    double average() const;
+};
+
+OverdrawView::OverdrawView() : counts(0), depth(0), width(0), height(0), target(0)
+{
+  glGenFramebuffers(1, &fbo);
+  program = GenerateProgram(CompileShaderF(GL_VERTEX_SHADER, "shaders/deferred_vs.c"),
+                            CompileShaderF(GL_FRAGMENT_SHADER, "shaders/overdraw_fs.c"));
+  uCounts = glGetUniformLocation(program, "countTex");
+  glGenVertexArrays(1, &vao);
+}
+
+OverdrawView::~OverdrawView()
+{
+  glDeleteTextures(1, &counts);
+  glDeleteRenderbuffers(1, &depth);
+  glDeleteFramebuffers(1, &fbo);
+  glDeleteVertexArrays(1, &vao);
+  glDeleteProgram(program);
+}
+
+void OverdrawView::allocate(int w, int h)
+{
+  if (counts) {
+    glDeleteTextures(1, &counts);
+    glDeleteRenderbuffers(1, &depth);
+  }
+  width = w;
+  height = h;
+  // Half floats count exactly up to 2048, far beyond any overdraw
+  glGenTextures(1, &counts);
+  glBindTexture(GL_TEXTURE_2D, counts);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_R16F, w, h, 0, GL_RED, GL_FLOAT, nullptr);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glBindTexture(GL_TEXTURE_2D, 0);
+  glGenRenderbuffers(1, &depth);
+  glBindRenderbuffer(GL_RENDERBUFFER, depth);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, w, h);
+  glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, counts, 0);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, depth);
+  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    logError("Overdraw buffer of %ix%i is incomplete", w, h);
+}
+
+void OverdrawView::begin(int w, int h)
+{
+  glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &target);
+  if (w != width || h != height) allocate(w, h);
+  glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  glEnable(GL_BLEND);
+  glBlendFunc(GL_ONE, GL_ONE);
+}
+
+void OverdrawView::resolve()
+{
+  glDisable(GL_BLEND);
+  glBindFramebuffer(GL_FRAMEBUFFER, target);
+  glUseProgram(program);
+  glUniform1i(uCounts, 0);
+  glActiveTexture(GL_TEXTURE0);
+  glBindTexture(GL_TEXTURE_2D, counts);
+
+  // Covers whatever the framebuffer held
+  glDisable(GL_DEPTH_TEST);
+  glBindVertexArray(vao);
+  glDrawArrays(GL_TRIANGLES, 0, 3);
+  glBindVertexArray(0);
+  glEnable(GL_DEPTH_TEST);
+}
+
+double OverdrawView::average() const
+{
+  std::vector<float> pixels(width * height);
+  glBindTexture(GL_TEXTURE_2D, counts);
+  glGetTexImage(GL_TEXTURE_2D, 0, GL_RED, GL_FLOAT, pixels.data());
+  glBindTexture(GL_TEXTURE_2D, 0);
+  double sum = 0;
+  int covered = 0;
+  for(float count : pixels) {
+    sum += count;
+    covered += count > 0;
+  }
+  return covered ? sum / covered : 0;
+}
+
+#endif
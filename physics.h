@@ -1,9 +1,15 @@
+#ifndef PHYSICS_H
+#define PHYSICS_H
+
 #include <limits>
-#include "mesh.h"
+#include "vec.h"
+#include "transform.h"
 
 class OBB {
 private:
   Vector3 dimensions, pos;
+  // The points as structure of arrays for the batched transform
+  float corners[3][8];
   
 public: std::array<Vector3, 8> points;
   Matrix4 m;
@@ -15,16 +21,14 @@ public: std::array<Vector3, 8> points;
     }
     return line;
   }
-  void draw(const Camera* cam) const { 
+  // Maps the unit cube centered on the origin onto this box
+  Matrix4 cubeTransform() const {
     Matrix4 s = Matrix4::FromScale(dimensions * 2);
     Matrix4 p = Matrix4::FromTranslation(pos);
-    glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
-    mesh->draw(cam, m * p * s);
-    glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
+    return m * p * s;
   }
 
 public:
-  static IMesh* mesh;
   OBB(Vector3 pos, Vector3 dimensions) : m(Matrix4::Identity()), dimensions(dimensions), pos(pos) {
 
     Vector3 ux = Vector3(1, 0, 0);
@@ -41,12 +45,24 @@ public:
     points[5] = pos - dimensions.x * ux + dimensions.y * uy + dimensions.z * uz;
     points[6] = pos - dimensions.x * ux + dimensions.y * uy - dimensions.z * uz;
     points[7] = pos + dimensions.x * ux + dimensions.y * uy - dimensions.z * uz;
+    for(int i=0; i<8; i++) {
+      corners[0][i] = points[i].x;
+      corners[1][i] = points[i].y;
+      corners[2][i] = points[i].z;
+    }
   }
   std::array<Vector3, 8> getPoints() const {
     std::array<Vector3, 8> ret;
+#if BATCH_WIDTH == 8
+    // A single batch, narrower batches lose more to the shuffle back than they gain
+    float world[3][8];
+    transformPoints(m, corners[0], corners[1], corners[2], world[0], world[1], world[2], 8);
+    for(int i=0; i<8; i++) ret[i] = Vector3(world[0][i], world[1][i], world[2][i]);
+#else
     for(int i=0; i<8; i++) {
       ret[i] = (m * Vector4(points[i], 1)).xyz();
     }
+#endif
     return ret;
   };
   std::array<Vector3, 3> getNormals() const {
@@ -57,7 +73,27 @@ public:
     ret[2] = (vs[4] - vs[0]).normalize();
     return ret;
   }
-  bool intersects(const OBB &o, Vector3* normal, float* min_dist) const {
+  // Length of the shortest edge in world space
+  float smallestExtent() const {
+    auto vs = getPoints();
+    return std::min((vs[1] - vs[0]).length(), std::min((vs[3] - vs[0]).length(), (vs[4] - vs[0]).length()));
+  }
+  AABB getAABB() const {
+    return transformAABB(m, AABB(pos - dimensions, pos + dimensions));
+  }
+  Vector3 center() const { return (m * Vector4(pos, 1)).xyz(); }
+  // Whether the world space point p lies within the box
+  bool contains(const Affine3 &inverse, const Vector3 &p) const {
+    Vector3 local = inverse.transformPoint(p) - pos;
+    const float eps = 1e-4f;
+    return fabs(local.x) <= dimensions.x + eps &&
+           fabs(local.y) <= dimensions.y + eps &&
+           fabs(local.z) <= dimensions.z + eps;
+  }
+  // axis receives the index of the separating axis candidate with the smallest
+  // overlap: 0-2 are the normals of o, 3-5 the normals of this box. When the boxes
+  // don't intersect it receives the index of the axis that separates them.
+  bool intersects(const OBB &o, Vector3* normal, float* min_dist, int* axis_index = nullptr) const {
      auto nleft  = o.getNormals();
      auto nright = getNormals();
      Vector3 axis[6];
@@ -68,14 +104,19 @@ public:
      axis[4] = nright[1];
      axis[5] = nright[2];
      *min_dist = std::numeric_limits<float>::infinity();
-     for(const Vector3 &ax : axis) {
+     for(int i=0; i<6; i++) {
+       const Vector3 &ax = axis[i];
        Line p1 = project(ax);
        Line p2 = o.project(ax);
        float dist = 0;
-       if (!p1.parallel_overlap(p2, &dist)) return false;
-       if (abs(dist) < abs(*min_dist)) {
+       if (!p1.parallel_overlap(p2, &dist)) {
+         if (axis_index) *axis_index = i;
+         return false;
+       }
+       if (fabs(dist) < fabs(*min_dist)) {
          *min_dist = dist;
          *normal = ax;
+         if (axis_index) *axis_index = i;
        }
      }
      // The normal may be pointing the wrong way, beware
@@ -83,9 +124,118 @@ public:
      return true;
   }
 
+  // Whether a single axis of intersects() separates the boxes, which is a lot
+  // cheaper than the full test when the axis is known to be a likely candidate.
+  bool separatedBy(const OBB &o, int axis_index) const {
+    Vector3 ax = axis_index < 3 ? o.getNormals()[axis_index] : getNormals()[axis_index - 3];
+    float dist;
+    return !project(ax).parallel_overlap(o.project(ax), &dist);
+  }
+
+  // Half lengths of the box along its world space normals
+  Vector3 halfExtents() const {
+    auto vs = getPoints();
+    return Vector3((vs[1] - vs[0]).length(), (vs[3] - vs[0]).length(), (vs[4] - vs[0]).length()) * 0.5f;
+  }
+  Vector3 closestPoint(const Vector3 &p) const {
+    auto axes = getNormals();
+    Vector3 h = halfExtents();
+    Vector3 c = center();
+    Vector3 d = p - c;
+    Vector3 ret = c;
+    ret += axes[0] * clamp(Vector3::dot(d, axes[0]), -h.x, h.x);
+    ret += axes[1] * clamp(Vector3::dot(d, axes[1]), -h.y, h.y);
+    ret += axes[2] * clamp(Vector3::dot(d, axes[2]), -h.z, h.z);
+    return ret;
+  }
+  // Ray against the box grown by inflate along every axis. t receives the distance
+  // along the ray in units of ray.dir, normal the world space normal of the face hit.
+  bool raycast(const Ray &ray, float maxT, float* t, Vector3* normal, float inflate = 0) const {
+    auto axes = getNormals();
+    Vector3 h = halfExtents() + Vector3(inflate);
+    Vector3 d = center() - ray.origin;
+    float lo = 0, hi = maxT;
+    float ext[3] = { h.x, h.y, h.z };
+    int entered = -1;
+    float sign = 1;
+    for(int i=0; i<3; i++) {
+      float e = Vector3::dot(axes[i], d);
+      float f = Vector3::dot(axes[i], ray.dir);
+      if (fabs(f) < 1e-9f) {
+        if (-e - ext[i] > 0 || -e + ext[i] < 0) return false;
+        continue;
+      }
+      float t1 = (e + ext[i]) / f;
+      float t2 = (e - ext[i]) / f;
+      float s = 1;
+      if (t1 > t2) { std::swap(t1, t2); s = -1; }
+      if (t1 > lo) { lo = t1; entered = i; sign = s; }
+      hi = std::min(hi, t2);
+      if (lo > hi) return false;
+    }
+    // Rays starting inside the box report no face
+    *t = lo;
+    *normal = entered == -1 ? -ray.dir.normalized() : axes[entered] * sign;
+    return true;
+  }
+
+  // Swept separating axis test of this box translating by motion against a static o.
+  // On a hit toi receives the fraction of motion at first contact and normal the
+  // face normal of the contact, pointing from o towards this box. Boxes that
+  // already overlap at the start are left to the discrete test.
+  bool sweep(const OBB &o, const Vector3 &motion, float* toi, Vector3* normal) const {
+    auto pa = getPoints();
+    auto pb = o.getPoints();
+    auto na = getNormals();
+    auto nb = o.getNormals();
+
+    std::array<Vector3, 15> axis;
+    int count = 0;
+    for(int i=0; i<3; i++) axis[count++] = na[i];
+    for(int i=0; i<3; i++) axis[count++] = nb[i];
+    for(int i=0; i<3; i++) {
+      for(int j=0; j<3; j++) {
+        Vector3 c = Vector3::cross(na[i], nb[j]);
+        // Parallel edges are already covered by the face normals
+        if (c.sq_length() > 1e-6f) axis[count++] = c.normalize();
+      }
+    }
+
+    float first = -std::numeric_limits<float>::infinity();
+    float last = std::numeric_limits<float>::infinity();
+    for(int i=0; i<count; i++) {
+      const Vector3 &ax = axis[i];
+      float a0 = std::numeric_limits<float>::infinity(), a1 = -a0;
+      float b0 = a0, b1 = -a0;
+      for(int k=0; k<8; k++) {
+        float da = Vector3::dot(pa[k], ax);
+        float db = Vector3::dot(pb[k], ax);
+        a0 = std::min(a0, da); a1 = std::max(a1, da);
+        b0 = std::min(b0, db); b1 = std::max(b1, db);
+      }
+
+      float v = Vector3::dot(motion, ax);
+      if (fabs(v) < 1e-9f) {
+        if (a1 < b0 || a0 > b1) return false;
+        continue;
+      }
+      float enter = v > 0 ? (b0 - a1) / v : (b1 - a0) / v;
+      float exit  = v > 0 ? (b1 - a0) / v : (b0 - a1) / v;
+      if (enter > first) {
+        first = enter;
+        *normal = v > 0 ? -ax : ax;
+      }
+      last = std::min(last, exit);
+      if (first > last || first > 1 || last < 0) return false;
+    }
+    if (first < 0) return false;
+    *toi = first;
+    return true;
+  }
+
   void update(const Matrix4& mvp) {
     m = mvp;
   }
 };
 
-IMesh* OBB::mesh;
+#endif
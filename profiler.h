@@ -0,0 +1,295 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <string.h>
+#include <stdio.h>
+#include <array>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <functional>
+
+#include "shaders.h"
+#include "trace.h"
+
+// Frames in flight. The GPU times of a frame are read back when its slot is reused,
+// PROFILER_FRAMES - 1 frames later, by which time the GPU has long finished them.
+#define PROFILER_FRAMES 3
+
+// One scope of a frame, all calls of a scope with the same name under the same parent
+// are summed into a single node
+struct ProfileNode {
+  const char* name;
+  // Index of the parent in the same frame, -1 at the top
+  int parent, depth, calls;
+  double cpuMs, gpuMs;
+};
+
+// Records the CPU time of nested scopes with a steady clock and their GPU time with
+// GL_TIMESTAMP queries, which unlike GL_TIME_ELAPSED may overlap.
+class Profiler {
+  private:
+    typedef std::chrono::steady_clock Clock;
+    struct Sample {
+      int node, query;
+      Clock::time_point start, end;
+    };
+    struct Frame {
+      int index;
+      bool pending;
+      std::vector<ProfileNode> nodes;
+      std::vector<Sample> samples;
+      // Two per sample, created as needed and reused
+      std::vector<GLuint> queries;
+      size_t used;
+    };
+    std::array<Frame, PROFILER_FRAMES> frames;
+    int current, open, frameCount;
+    bool gpu;
+    std::vector<ProfileNode> last;
+    int lastIndex;
+    void resolve(Frame &f);
+    void order(const std::vector<ProfileNode> &nodes, int parent, std::vector<ProfileNode> &out) const;
+  public:
+    // Called with every frame once its times are known, the nodes in depth first order
+    std::function<void(int frame, const std::vector<ProfileNode> &nodes)> onFrame;
+
+    // Without gpu no GL calls are made at all
+    Profiler(bool gpu = true);
+    ~Profiler();
+    Profiler(const Profiler&) = delete;
+    Profiler& operator=(const Profiler&) = delete;
+
+    void beginFrame();
+    // Returns the sample to pass to end
+    int begin(const char* name);
+    void end(int sample);
+    // Waits for the frames still in flight
+    void flush();
+    // Latest frame with known times, in depth first order
+    const std::vector<ProfileNode>& lastFrame() const { return last; }
+    int lastFrameIndex() const { return lastIndex; }
+    // The top two levels of the last frame on a single line
+    std::string summary() const;
+};
+
+Profiler::Profiler(bool gpu) : current(0), open(-1), frameCount(0), gpu(gpu), lastIndex(-1)
+{
+  for(Frame &f : frames) {
+    f.index = -1;
+    f.pending = false;
+    f.used = 0;
+  }
+}
+
+Profiler::~Profiler()
+{
+  for(Frame &f : frames)
+    if (!f.queries.empty()) glDeleteQueries(f.queries.size(), f.queries.data());
+}
+
+void Profiler::beginFrame()
+{
+  current = (current + 1) % PROFILER_FRAMES;
+  Frame &f = frames[current];
+  if (f.pending) resolve(f);
+  f.index = frameCount++;
+  f.pending = true;
+  f.nodes.clear();
+  f.samples.clear();
+  f.used = 0;
+  open = -1;
+}
+
+int Profiler::begin(const char* name)
+{
+  Frame &f = frames[current];
+  int node = -1;
+  for(size_t i=0; i<f.nodes.size() && node < 0; i++)
+    if (f.nodes[i].parent == open && strcmp(f.nodes[i].name, name) == 0) node = i;
+  if (node < 0) {
+    node = f.nodes.size();
+    f.nodes.push_back(ProfileNode{ name, open, open < 0 ? 0 : f.nodes[open].depth + 1, 0, 0, 0 });
+  }
+  f.nodes[node].calls++;
+
+  Sample s;
+  s.node = node;
+  s.query = -1;
+  if (gpu) {
+    if (f.queries.size() < f.used + 2) {
+      size_t grown = std::max<size_t>(16, f.queries.size() * 2);
+      size_t first = f.queries.size();
+      f.queries.resize(grown);
+      glGenQueries(grown - first, &f.queries[first]);
+    }
+    s.query = f.used;
+    f.used += 2;
+    glQueryCounter(f.queries[s.query], GL_TIMESTAMP);
+  }
+  open = node;
+  s.start = Clock::now();
+  f.samples.push_back(s);
+  return f.samples.size() - 1;
+}
+
+void Profiler::end(int sample)
+{
+  Frame &f = frames[current];
+  Sample &s = f.samples[sample];
+  s.end = Clock::now();
+  if (gpu) glQueryCounter(f.queries[s.query + 1], GL_TIMESTAMP);
+  open = f.nodes[s.node].parent;
+}
+
+void Profiler::resolve(Frame &f)
+{
+  for(const Sample &s : f.samples) {
+    ProfileNode &n = f.nodes[s.node];
+    n.cpuMs += std::chrono::duration<double, std::milli>(s.end - s.start).count();
+    if (!gpu) continue;
+    GLuint64 start, end;
+    glGetQueryObjectui64v(f.queries[s.query], GL_QUERY_RESULT, &start);
+    glGetQueryObjectui64v(f.queries[s.query + 1], GL_QUERY_RESULT, &end);
+    n.gpuMs += (end - start) / 1e6;
+  }
+  last.clear();
+  order(f.nodes, -1, last);
+  lastIndex = f.index;
+  f.pending = false;
+  if (onFrame) onFrame(lastIndex, last);
+}
+
+// Nodes are created in call order, a scope entered again later in the frame can
+// gain children after those of its siblings
+void Profiler::order(const std::vector<ProfileNode> &nodes, int parent, std::vector<ProfileNode> &out) const
+{
+  int outParent = out.size() - 1;
+  for(size_t i=0; i<nodes.size(); i++) {
+    if (nodes[i].parent != parent) continue;
+    out.push_back(nodes[i]);
+    out.back().parent = parent < 0 ? -1 : outParent;
+    order(nodes, i, out);
+  }
+}
+
+void Profiler::flush()
+{
+  for(int i=1; i<=PROFILER_FRAMES; i++) {
+    Frame &f = frames[(current + i) % PROFILER_FRAMES];
+    if (f.pending) resolve(f);
+  }
+}
+
+std::string Profiler::summary() const
+{
+  std::string s;
+  char buf[128];
+  for(const ProfileNode &n : last) {
+    if (n.depth > 1) continue;
+    if (gpu) snprintf(buf, sizeof(buf), "%s%s %.2f/%.2f ms", s.empty() ? "" : ", ", n.name, n.cpuMs, n.gpuMs);
+    else snprintf(buf, sizeof(buf), "%s%s %.2f ms", s.empty() ? "" : ", ", n.name, n.cpuMs);
+    s += buf;
+  }
+  return s;
+}
+
+// Times the enclosing block, does nothing without a profiler. It is traced as well.
+class ProfileScope {
+  private:
+    TraceScope trace;
+    Profiler* profiler;
+    int sample;
+  public:
+    ProfileScope(Profiler* profiler, const char* name) : trace(name), profiler(profiler), sample(profiler ? profiler->begin(name) : -1) {}
+    ~ProfileScope() { if (profiler) profiler->end(sample); }
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_SCOPE(profiler, name) ProfileScope PROFILE_CONCAT(profileScope, __LINE__)(profiler, name)
+
+// Bars of the CPU (blue) and GPU (orange) time of every node of a frame in the top
+// left corner, one row per node indented by depth. A white line marks 60 fps.
+class ProfilerOverlay {
+  private:
+    GLuint program, vao, vbo;
+    GLint vPos, vColor;
+    std::vector<float> vertices;
+    void quad(float x0, float y0, float x1, float y1, const float* color, int w, int h);
+  public:
+    ProfilerOverlay();
+    ~ProfilerOverlay();
+    void draw(const std::vector<ProfileNode> &nodes, int w, int h);
+};
+
+ProfilerOverlay::ProfilerOverlay()
+{
+  GLuint vs = CompileShaderF(GL_VERTEX_SHADER, "shaders/overlay_vs.c");
+  GLuint fs = CompileShaderF(GL_FRAGMENT_SHADER, "shaders/overlay_fs.c");
+  program = GenerateProgram(vs, fs);
+  vPos = glGetAttribLocation(program, "vPos");
+  vColor = glGetAttribLocation(program, "vColor");
+
+  glGenVertexArrays(1, &vao);
+  glGenBuffers(1, &vbo);
+  glBindVertexArray(vao);
+  glBindBuffer(GL_ARRAY_BUFFER, vbo);
+  glVertexAttribPointer(vPos, 2, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)0);
+  glVertexAttribPointer(vColor, 4, GL_FLOAT, GL_FALSE, 6 * sizeof(float), (void*)(2 * sizeof(float)));
+  glEnableVertexAttribArray(vPos);
+  glEnableVertexAttribArray(vColor);
+  glBindVertexArray(0);
+}
+
+ProfilerOverlay::~ProfilerOverlay()
+{
+  glDeleteBuffers(1, &vbo);
+  glDeleteVertexArrays(1, &vao);
+  glDeleteProgram(program);
+}
+
+// Pixel coordinates from the top left
+void ProfilerOverlay::quad(float x0, float y0, float x1, float y1, const float* color, int w, int h)
+{
+  float l = x0 / w * 2 - 1, r = x1 / w * 2 - 1;
+  float t = 1 - y0 / h * 2, b = 1 - y1 / h * 2;
+  const float corners[6][2] = { { l, t }, { r, t }, { r, b }, { l, t }, { r, b }, { l, b } };
+  for(const float* c : corners) {
+    vertices.insert(vertices.end(), c, c + 2);
+    vertices.insert(vertices.end(), color, color + 4);
+  }
+}
+
+void ProfilerOverlay::draw(const std::vector<ProfileNode> &nodes, int w, int h)
+{
+  const float background[4] = { 0, 0, 0, 0.6f }, cpu[4] = { 0.3f, 0.5f, 1, 0.9f }, gpu[4] = { 1, 0.6f, 0.2f, 0.9f }, marker[4] = { 1, 1, 1, 0.8f };
+  // Pixels per millisecond, 60 fps ends at 200 pixels
+  const float scale = 12, row = 10, indent = 6;
+  vertices.clear();
+  float height = nodes.size() * row + 4;
+  quad(4, 4, 8 + 40 * scale, 4 + height, background, w, h);
+  for(size_t i=0; i<nodes.size(); i++) {
+    float x = 8 + nodes[i].depth * indent, y = 6 + i * row;
+    quad(x, y, x + nodes[i].cpuMs * scale, y + row / 2 - 1, cpu, w, h);
+    quad(x, y + row / 2 - 1, x + nodes[i].gpuMs * scale, y + row - 2, gpu, w, h);
+  }
+  quad(8 + 1000 / 60.0f * scale, 4, 9 + 1000 / 60.0f * scale, 4 + height, marker, w, h);
+
+  GLboolean depthTest = glIsEnabled(GL_DEPTH_TEST);
+  glDisable(GL_DEPTH_TEST);
+  glEnable(GL_BLEND);
+  glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+  glUseProgram(program);
+  glBindVertexArray(vao);
+  glBindBuffer(GL_ARRAY_BUFFER, vbo);
+  glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), vertices.data(), GL_STREAM_DRAW);
+  glDrawArrays(GL_TRIANGLES, 0, vertices.size() / 6);
+  glBindVertexArray(0);
+  glDisable(GL_BLEND);
+  if (depthTest) glEnable(GL_DEPTH_TEST);
+}
+
+#endif
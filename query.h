@@ -0,0 +1,193 @@
+#ifndef QUERY_H
+#define QUERY_H
+
+#include <vector>
+#include <algorithm>
+#include "vec.h"
+#include "solid.h"
+#include "world.h"
+#include "workers.h"
+
+struct QueryHit {
+  ISolid* solid;
+  // Distance along the ray or fraction of the sweep
+  float t;
+  Vector3 point, normal;
+  QueryHit() : solid(nullptr), t(0) {}
+};
+
+// Ray and shape queries against every solid of a PhysicsWorld. All queries go through
+// the broadphase of the world, so they never scan the full list of solids.
+class SceneQuery {
+  private:
+    const PhysicsWorld* world;
+  public:
+    SceneQuery(const PhysicsWorld* world) : world(world) {}
+
+    bool raycast(const Ray &ray, QueryHit* hit, const ISolid* ignore = nullptr) const;
+    // All hits along the ray, sorted by distance
+    int raycastAll(const Ray &ray, std::vector<QueryHit> &hits, const ISolid* ignore = nullptr) const;
+    // Closest hits of many rays at once, spread over the workers of pool.
+    // Misses are reported with a null solid.
+    void raycastBatch(const std::vector<Ray> &rays, std::vector<QueryHit> &hits, WorkerPool &pool) const;
+
+    int overlapSphere(const Vector3 &center, float radius, std::vector<ISolid*> &out) const;
+    int overlapBox(const OBB &box, std::vector<ISolid*> &out) const;
+
+    // First solid hit by box when translating it by motion
+    bool sweepBox(const OBB &box, const Vector3 &motion, QueryHit* hit, const ISolid* ignore = nullptr) const;
+    // Treats the solids as boxes grown by the radius, so hits near corners are conservative
+    bool sweepSphere(const Vector3 &center, float radius, const Vector3 &motion, QueryHit* hit, const ISolid* ignore = nullptr) const;
+};
+
+// Narrow raycast against a single solid, using its triangle mesh when it has one
+static bool raycastSolid(const ISolid* s, const Ray &ray, float maxT, float* t, Vector3* normal)
+{
+  if (!s->getBoundary().raycast(ray, maxT, t, normal)) return false;
+  if (!s->collider) return true;
+
+  // Parameters along the ray are preserved by the transform into model space
+  Affine3 m = Affine3(s->getBoundary().m);
+  Affine3 inverse = m.inverted();
+  Ray local = Ray(inverse.transformPoint(ray.origin), inverse.transformDirection(ray.dir));
+  int triangle;
+  if (!s->collider->raycast(local, maxT, t, &triangle)) return false;
+  // Normals go through the inverse-transpose to stay perpendicular under non-uniform scale
+  *normal = inverse.transposeDirection(s->collider->triangleNormal(triangle)).normalize();
+  if (Vector3::dot(*normal, ray.dir) > 0) *normal = -*normal;
+  return true;
+}
+
+bool SceneQuery::raycast(const Ray &ray, QueryHit* hit, const ISolid* ignore) const
+{
+  hit->solid = nullptr;
+  world->raycast(ray, ray.length, [&](void* data, float maxT) {
+    ISolid* s = (ISolid*)data;
+    float t;
+    Vector3 normal;
+    if (s == ignore || !raycastSolid(s, ray, maxT, &t, &normal)) return maxT;
+    hit->solid = s;
+    hit->t = t;
+    hit->normal = normal;
+    return t;
+  });
+  if (!hit->solid) return false;
+  hit->point = ray.at(hit->t);
+  return true;
+}
+
+int SceneQuery::raycastAll(const Ray &ray, std::vector<QueryHit> &hits, const ISolid* ignore) const
+{
+  size_t first = hits.size();
+  world->raycast(ray, ray.length, [&](void* data, float maxT) {
+    ISolid* s = (ISolid*)data;
+    QueryHit hit;
+    if (s != ignore && raycastSolid(s, ray, maxT, &hit.t, &hit.normal)) {
+      hit.solid = s;
+      hit.point = ray.at(hit.t);
+      hits.push_back(hit);
+    }
+    return maxT;
+  });
+  std::sort(hits.begin() + first, hits.end(), [](const QueryHit &a, const QueryHit &b) { return a.t < b.t; });
+  return hits.size() - first;
+}
+
+void SceneQuery::raycastBatch(const std::vector<Ray> &rays, std::vector<QueryHit> &hits, WorkerPool &pool) const
+{
+  hits.resize(rays.size());
+  // A few chunks per worker so uneven rays still spread
+  int chunks = std::min<size_t>(rays.size(), pool.size() * 4);
+  if (chunks == 0) return;
+  size_t chunk = (rays.size() + chunks - 1) / chunks;
+  pool.run(chunks, [&](int c) {
+    size_t to = std::min(rays.size(), (c + 1) * chunk);
+    for(size_t i=c*chunk; i<to; i++) raycast(rays[i], &hits[i]);
+  });
+}
+
+int SceneQuery::overlapSphere(const Vector3 &center, float radius, std::vector<ISolid*> &out) const
+{
+  int count = 0;
+  AABB box = AABB(center - Vector3(radius), center + Vector3(radius));
+  world->query(box, [&](void* data) {
+    ISolid* s = (ISolid*)data;
+    if ((s->getBoundary().closestPoint(center) - center).sq_length() > radius * radius) return true;
+    if (!s->collider || s->collider->overlapSphere(center, radius, s->getBoundary().m)) {
+      out.push_back(s);
+      count++;
+    }
+    return true;
+  });
+  return count;
+}
+
+int SceneQuery::overlapBox(const OBB &box, std::vector<ISolid*> &out) const
+{
+  int count = 0;
+  std::vector<MeshBoxHit> triangles;
+  world->query(box.getAABB(), [&](void* data) {
+    ISolid* s = (ISolid*)data;
+    Vector3 normal;
+    float depth;
+    if (!box.intersects(s->getBoundary(), &normal, &depth)) return true;
+    triangles.clear();
+    if (!s->collider || s->collider->overlapBox(box, s->getBoundary().m, triangles)) {
+      out.push_back(s);
+      count++;
+    }
+    return true;
+  });
+  return count;
+}
+
+bool SceneQuery::sweepBox(const OBB &box, const Vector3 &motion, QueryHit* hit, const ISolid* ignore) const
+{
+  hit->solid = nullptr;
+  hit->t = 1;
+  AABB from = box.getAABB();
+  AABB swept = AABB::merge(from, AABB(from.min + motion, from.max + motion));
+  world->query(swept, [&](void* data) {
+    ISolid* s = (ISolid*)data;
+    float t;
+    Vector3 normal;
+    if (s == ignore) return true;
+    bool swept = s->collider ? s->collider->sweepBox(box, motion, s->getBoundary().m, &t, &normal)
+                             : box.sweep(s->getBoundary(), motion, &t, &normal);
+    if (swept && t < hit->t) {
+      hit->solid = s;
+      hit->t = t;
+      hit->normal = normal;
+    }
+    return true;
+  });
+  if (!hit->solid) return false;
+  hit->point = box.center() + motion * hit->t;
+  return true;
+}
+
+bool SceneQuery::sweepSphere(const Vector3 &center, float radius, const Vector3 &motion, QueryHit* hit, const ISolid* ignore) const
+{
+  hit->solid = nullptr;
+  AABB from = AABB(center - Vector3(radius), center + Vector3(radius));
+  AABB swept = AABB::merge(from, AABB(from.min + motion, from.max + motion));
+  Ray ray = Ray(center, motion, 1);
+  float best = 1;
+  world->query(swept, [&](void* data) {
+    ISolid* s = (ISolid*)data;
+    float t;
+    Vector3 normal;
+    if (s != ignore && s->getBoundary().raycast(ray, best, &t, &normal, radius)) {
+      best = t;
+      hit->solid = s;
+      hit->t = t;
+      hit->normal = normal;
+    }
+    return true;
+  });
+  if (!hit->solid) return false;
+  hit->point = ray.at(hit->t) - hit->normal * radius;
+  return true;
+}
+
+#endif
@@ -0,0 +1,287 @@
+#ifndef QUERYBENCH_H
+#define QUERYBENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <vector>
+#include <random>
+#include <chrono>
+
+#include "logger.h"
+#include "obj_loader.h"
+#include "meshcollider.h"
+#include "solid.h"
+#include "world.h"
+#include "query.h"
+#include "workers.h"
+
+// Rays per second of SceneQuery over a field of static crates, once for every
+// broadphase. Both see the same crates and rays, so their hits must agree.
+int runQueryBenchmark(int argc, char** argv)
+{
+  int crates = argc > 1 ? atoi(argv[1]) : 100000;
+  int rayCount = argc > 2 ? atoi(argv[2]) : 200000;
+  int threads = argc > 3 ? atoi(argv[3]) : 0;
+  if (threads <= 0) threads = std::max(1u, std::thread::hardware_concurrency());
+
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<float> U(-500, 500);
+  std::vector<SolidBody*> bodies;
+  for(int i=0; i<crates; i++) {
+    SolidBody* crate = new SolidBody(CRATE_SCALE, CRATE_BOUNDARY);
+    crate->inverseMass = 0;
+    crate->transform.setPosition(Vector3(U(rng), U(rng) * 0.1f, U(rng)));
+    crate->transform.setRotation(Quaternion::FromAxisRotations(U(rng), U(rng), 0));
+    crate->updateBoundary();
+    bodies.push_back(crate);
+  }
+  // Mostly horizontal, so most of them cross many cells before hitting anything
+  std::vector<Ray> rays;
+  for(int i=0; i<rayCount; i++) {
+    Vector3 origin = Vector3(U(rng), U(rng) * 0.2f, U(rng));
+    Vector3 dir = Vector3(U(rng), U(rng) * 0.05f, U(rng)).normalize();
+    rays.push_back(Ray(origin, dir, 200));
+  }
+  logInfo("queries: %i static crates, %i rays, %i threads", crates, rayCount, threads);
+
+  WorkerPool pool(threads);
+  const BroadphaseType types[] = { BROADPHASE_TREE, BROADPHASE_GRID };
+  for(BroadphaseType type : types) {
+    PhysicsWorld world;
+    world.setBroadphase(type);
+    auto start = std::chrono::steady_clock::now();
+    for(SolidBody* b : bodies) world.add(b);
+    double build = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    SceneQuery query(&world);
+
+    std::vector<QueryHit> hits(rays.size());
+    start = std::chrono::steady_clock::now();
+    for(size_t i=0; i<rays.size(); i++) query.raycast(rays[i], &hits[i]);
+    double closest = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::vector<QueryHit> batch;
+    start = std::chrono::steady_clock::now();
+    query.raycastBatch(rays, batch, pool);
+    double batched = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    int allRays = std::min<int>(rays.size(), 20000);
+    size_t allHits = 0;
+    std::vector<QueryHit> all;
+    start = std::chrono::steady_clock::now();
+    for(int i=0; i<allRays; i++) {
+      all.clear();
+      allHits += query.raycastAll(rays[i], all);
+    }
+    double every = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // Distances summed in order, equal between broadphases when they find the same hits
+    int found = 0, differ = 0;
+    double checksum = 0;
+    for(size_t i=0; i<hits.size(); i++) {
+      if (hits[i].solid) { found++; checksum += hits[i].t; }
+      differ += hits[i].solid != batch[i].solid;
+    }
+    // Against every crate for a few rays
+    int mismatches = 0, checked = std::min<int>(rays.size(), 200);
+    for(int i=0; i<checked; i++) {
+      float best = rays[i].length;
+      bool hit = false;
+      for(const SolidBody* b : bodies) {
+        float t;
+        Vector3 normal;
+        if (b->getBoundary().raycast(rays[i], best, &t, &normal)) { best = t; hit = true; }
+      }
+      if (hit != (hits[i].solid != nullptr) || (hit && fabs(best - hits[i].t) > 1e-3f)) mismatches++;
+    }
+
+    printf("%s: built in %.1f ms, closest %.0f rays/s, batch %.0f rays/s, all hits %.0f rays/s with %.1f each, "
+           "%i hits, checksum %.3f, %i batch differences, %i of %i wrong against brute force\n",
+           type == BROADPHASE_GRID ? "grid" : "tree", build * 1000, rays.size() / closest, rays.size() / batched,
+           allRays / every, (double)allHits / allRays, found, checksum, differ, mismatches, checked);
+  }
+  for(SolidBody* b : bodies) delete b;
+  return 0;
+}
+
+// Crates of one size spread evenly, about one per 64 cubic units, or gathered around 16
+// points as in a crowd
+static std::vector<Vector3> crowdPositions(int count, bool clustered)
+{
+  std::mt19937 rng(1);
+  std::uniform_real_distribution<float> U(0, 1);
+  std::normal_distribution<float> N(0, 4);
+  std::vector<Vector3> centers;
+  for(int i=0; i<16; i++) centers.push_back(Vector3(U(rng) * 400, U(rng) * 40, U(rng) * 400));
+  float side = cbrtf(count) * 4;
+  std::vector<Vector3> positions;
+  for(int i=0; i<count; i++) {
+    if (!clustered) positions.push_back(Vector3(U(rng) * side * 2, U(rng) * side / 2, U(rng) * side * 2));
+    else {
+      const Vector3 &c = centers[i % 16];
+      positions.push_back(Vector3(c.x + N(rng) * 3, c.y + N(rng), c.z + N(rng) * 3));
+    }
+  }
+  return positions;
+}
+
+// Tree against grid on crates that never sleep and get a new random velocity every step,
+// spread evenly and clustered. Reports the build time, the time for every crate to query
+// its own box and the step time. The boxes that really overlap are counted from the
+// queries and must agree between backends, the pairs each hands to the narrowphase need
+// not, as the tree stores fattened boxes. Usage: --broadphase [crates] [steps]
+int runBroadphaseBenchmark(int argc, char** argv)
+{
+  int crates = argc > 1 ? atoi(argv[1]) : 20000;
+  int steps = argc > 2 ? atoi(argv[2]) : 50;
+  logInfo("broadphase: %i crates, %i steps", crates, steps);
+
+  const BroadphaseType types[] = { BROADPHASE_TREE, BROADPHASE_GRID };
+  for(int clustered=0; clustered<2; clustered++) {
+    std::vector<Vector3> positions = crowdPositions(crates, clustered);
+    for(BroadphaseType type : types) {
+      PhysicsWorld world;
+      world.setBroadphase(type);
+      world.gravity = Vector3(0);
+      std::mt19937 rng(7);
+      std::uniform_real_distribution<float> U(-0.05f, 0.05f);
+      std::vector<SolidBody*> bodies;
+      auto start = std::chrono::steady_clock::now();
+      for(const Vector3 &p : positions) {
+        SolidBody* crate = new SolidBody(CRATE_SCALE, CRATE_BOUNDARY);
+        crate->inverseMass = 1;
+        crate->allowSleep = false;
+        crate->transform.setPosition(p);
+        crate->updateBoundary();
+        world.add(crate);
+        bodies.push_back(crate);
+      }
+      double build = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+      long long candidates = 0, overlapping = 0;
+      start = std::chrono::steady_clock::now();
+      for(SolidBody* b : bodies) {
+        AABB box = b->getBoundary().getAABB();
+        world.query(box, [&](void* data) {
+          ISolid* o = (ISolid*)data;
+          candidates++;
+          overlapping += o != b && o->getBoundary().getAABB().overlaps(box);
+          return true;
+        });
+      }
+      double queries = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+      long long tested = 0;
+      start = std::chrono::steady_clock::now();
+      for(int s=0; s<steps; s++) {
+        for(SolidBody* b : bodies) b->velocity = Vector3(U(rng), U(rng), U(rng));
+        world.step();
+        tested += world.pairStats.tested;
+      }
+      double stepping = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+      printf("%-9s %s: built in %.1f ms, queries %.1f ms with %lld candidates for %lld overlapping pairs, "
+             "step %.1f ms with %lld narrowphase pairs\n", clustered ? "clustered" : "uniform",
+             type == BROADPHASE_GRID ? "grid" : "tree", build * 1000, queries * 1000, candidates, overlapping / 2,
+             stepping * 1000 / steps, tested / std::max(steps, 1));
+      for(SolidBody* b : bodies) delete b;
+    }
+  }
+  return 0;
+}
+
+// Build time of the triangle BVH and rays and boxes per second against it, checked
+// against every triangle for a few of them. Usage: --meshes [model.obj] [queries]
+int runMeshBenchmark(int argc, char** argv)
+{
+  const char* file = argc > 1 ? argv[1] : "models/dennis.obj";
+  int queries = argc > 2 ? atoi(argv[2]) : 100000;
+  std::vector<Vector3> positions;
+  std::vector<unsigned int> indices;
+  cObj(file).collisionBuffers(positions, indices);
+  if (indices.empty()) {
+    logError("No triangles in %s", file);
+    return 1;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  TriangleMeshCollider mesh(positions, indices);
+  double build = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  printf("%s: %zu triangles, %zu nodes of %zu bytes, depth %i, built in %.2f ms\n", file, mesh.triangleCount(),
+         mesh.nodeCount(), sizeof(MeshBVHNode), mesh.getDepth(), build * 1000);
+
+  // Between random points of the bounds, starting outside of them
+  const AABB &bounds = mesh.getBounds();
+  std::mt19937 rng(2);
+  std::uniform_real_distribution<float> U(0, 1);
+  auto inside = [&]() {
+    return bounds.min + Vector3(U(rng), U(rng), U(rng)) * (bounds.max - bounds.min);
+  };
+  std::vector<Ray> rays;
+  for(int i=0; i<queries; i++) {
+    Vector3 origin = inside();
+    Vector3 dir = (inside() - origin).normalize();
+    rays.push_back(Ray(origin - dir * 10, dir));
+  }
+
+  std::vector<float> distances(rays.size(), -1);
+  int hits = 0;
+  start = std::chrono::steady_clock::now();
+  for(size_t i=0; i<rays.size(); i++) {
+    float t;
+    int triangle;
+    if (mesh.raycast(rays[i], std::numeric_limits<float>::infinity(), &t, &triangle)) {
+      distances[i] = t;
+      hits++;
+    }
+  }
+  double rayTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  int wrongRays = 0, checked = std::min<int>(rays.size(), 100);
+  for(int i=0; i<checked; i++) {
+    float best = std::numeric_limits<float>::infinity();
+    for(size_t k=0; k<indices.size(); k+=3) {
+      TriangleMeshCollider single({ positions[indices[k]], positions[indices[k+1]], positions[indices[k+2]] }, { 0, 1, 2 });
+      float t;
+      int triangle;
+      if (single.raycast(rays[i], best, &t, &triangle)) best = t;
+    }
+    bool hit = best < std::numeric_limits<float>::infinity();
+    if (hit != (distances[i] >= 0) || (hit && fabs(best - distances[i]) > 1e-4f)) wrongRays++;
+  }
+  printf("rays: %i of %i hit, %.0f rays/s, %i of %i wrong against brute force\n", hits, queries,
+         queries / rayTime, wrongRays, checked);
+
+  // Boxes of 2% of the diagonal turned about z
+  Vector3 extent = Vector3((bounds.max - bounds.min).length() * 0.02f);
+  std::vector<MeshBoxHit> found;
+  size_t touched = 0;
+  start = std::chrono::steady_clock::now();
+  for(int i=0; i<queries; i++) {
+    Vector3 center = inside();
+    float a = U(rng) * 3;
+    std::array<Vector3, 3> axes = { Vector3(cosf(a), sinf(a), 0), Vector3(-sinf(a), cosf(a), 0), Vector3(0, 0, 1) };
+    found.clear();
+    touched += mesh.overlapBox(center, axes, extent, found);
+  }
+  double boxTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  int wrongBoxes = 0;
+  checked = std::min(queries, 50);
+  for(int i=0; i<checked; i++) {
+    Vector3 center = inside();
+    std::array<Vector3, 3> axes = { Vector3(1, 0, 0), Vector3(0, 1, 0), Vector3(0, 0, 1) };
+    found.clear();
+    int count = mesh.overlapBox(center, axes, extent, found), expected = 0;
+    for(size_t k=0; k<indices.size(); k+=3) {
+      TriangleMeshCollider single({ positions[indices[k]], positions[indices[k+1]], positions[indices[k+2]] }, { 0, 1, 2 });
+      expected += single.overlapBox(center, axes, extent, found);
+    }
+    wrongBoxes += count != expected;
+  }
+  printf("boxes: %.2f us per box, %.1f triangles each, %i of %i wrong against brute force\n",
+         boxTime * 1e6 / queries, (double)touched / queries, wrongBoxes, checked);
+  return 0;
+}
+
+#endif
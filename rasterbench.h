@@ -0,0 +1,332 @@
+#ifndef RASTERBENCH_H
+#define RASTERBENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <chrono>
+
+#include "logger.h"
+#include "solid.h"
+#include "softraster.h"
+#include "occlusion.h"
+
+// The level of Application::init drawn by the SoftwareRenderer, without a window or
+// GL context. Crates are stacked on the floor to give the depth buffer some work.
+class RasterScene {
+  private:
+    struct Object {
+      const SoftwareModel* model;
+      const SoftwareTexture *tex, *normalTex;
+      float texSize;
+      Transform* transform;
+    };
+    SoftwareModel floor, cube, player;
+    SoftwareTexture wall, wallNormals, white;
+    std::vector<Object> objects;
+    std::vector<SoftwareLight> lights;
+    Transform* add(const SoftwareModel &model, float scale, const SoftwareTexture* tex, const SoftwareTexture* normalTex = nullptr, float texSize = 1);
+  public:
+    RasterScene();
+    ~RasterScene() { for(Object &o : objects) delete o.transform; }
+    bool valid() const { return !wall.texels.empty() && !wallNormals.texels.empty() && !white.texels.empty(); }
+    size_t triangleCount() const;
+    // Moves the lights like Application::loop and queues every object
+    void draw(SoftwareRenderer &renderer, int frame);
+};
+
+RasterScene::RasterScene()
+  : floor(cObj("models/floor.obj"), true), cube(cObj("models/cube.obj")), player(cObj("models/player.obj"))
+{
+  wall.load("textures/wall.jpg");
+  wallNormals.load("textures/wall_norm.jpg");
+  white.load("textures/white.png");
+
+  add(floor, FLOOR_SCALE, &wall, &wallNormals, 0.8f);
+  Transform* back = add(floor, FLOOR_SCALE, &wall, &wallNormals, 0.8f);
+  back->setRotation(Quaternion::FromAxisRotations(-PI / 2, 0, 0));
+  back->setPosition(Vector3(0, 15, 15));
+  Transform* left = add(floor, FLOOR_SCALE, &wall, &wallNormals, 0.8f);
+  left->setRotation(Quaternion::FromAxisRotations(PI / 2, 0, PI / 2));
+  left->setPosition(Vector3(15, 15, 0));
+  Transform* right = add(floor, FLOOR_SCALE, &wall, &wallNormals, 0.8f);
+  right->setRotation(Quaternion::FromAxisRotations(PI / 2, 0, -PI / 2));
+  right->setPosition(Vector3(-15, 15, 0));
+  Transform* ramp = add(floor, FLOOR_SCALE, &wall, &wallNormals, 0.8f);
+  ramp->setPosition(Vector3(0, 0, -30));
+  ramp->setAnchor(Vector3(0, 0, -15));
+  ramp->setRotation(Quaternion::FromAxisRotations(PI / 6, 0, 0));
+  Transform* p = add(player, 1, &white);
+  p->setRotation(Quaternion::FromAxisRotations(0, PI, 0));
+  p->setPosition(Vector3(0, 2, 0));
+  for(int y=0; y<3; y++)
+    for(int x=0; x<5; x++)
+      for(int z=0; z<3; z++)
+        add(cube, CRATE_SCALE, &white)->setPosition(Vector3(x * 4 - 8.0f, 1 + y * 2, z * 3 + 4.0f));
+
+  // The lit ones of the level
+  lights.resize(3);
+  lights[0].color = Vector3(1, 1, 0) * 100;
+  lights[0].position.y = 10;
+  lights[1].color = Vector3(0, 1, 1) * 100;
+  lights[1].position.y = 10;
+  lights[2].color = Vector3(1, 1, 1) * 300;
+  lights[2].position = Vector3(0, 30, -30);
+}
+
+Transform* RasterScene::add(const SoftwareModel &model, float scale, const SoftwareTexture* tex, const SoftwareTexture* normalTex, float texSize)
+{
+  Object o = { &model, tex, normalTex, texSize, new Transform(Vector3(scale)) };
+  objects.push_back(o);
+  return o.transform;
+}
+
+size_t RasterScene::triangleCount() const
+{
+  size_t n = 0;
+  for(const Object &o : objects) n += o.model->triangleCount();
+  return n;
+}
+
+void RasterScene::draw(SoftwareRenderer &renderer, int frame)
+{
+  float time = frame * 0.03f;
+  lights[0].position.x = 11 * sin(time);
+  lights[0].position.z = 11 * cos(time);
+  lights[1].position.x = -11 * sin(time);
+  lights[1].position.z = -11 * cos(time);
+  renderer.setLights(lights.data(), lights.size());
+
+  // Where Application places the camera, see Camera::calcMatrix
+  Vector3 eye = Vector3(0, 17.5f, -15.5f);
+  Quaternion orientation = Quaternion::FromAxisRotations(0, 3.1415926f, 0);
+  float ratio = renderer.getWidth() / (float)renderer.getHeight();
+  Matrix4 camera = Matrix4::FromPerspective(1.25f, ratio, 0.1f, 1000.0f) * orientation.toMatrix() * Matrix4::FromTranslation(-eye);
+  for(const Object &o : objects)
+    renderer.draw(*o.model, o.transform->getWorld(), camera, eye, o.tex, o.normalTex, o.texSize);
+}
+
+// Usage: --raster [frames] [max threads]
+// Renders the scene at several resolutions with 1, 2, 4... threads and reports the frame rates
+int runRasterBenchmark(int argc, char** argv)
+{
+  int frames = argc > 1 ? atoi(argv[1]) : 30;
+  int maxThreads = argc > 2 ? atoi(argv[2]) : 0;
+  if (maxThreads <= 0) maxThreads = std::max(1u, std::thread::hardware_concurrency());
+
+  RasterScene scene;
+  if (!scene.valid()) return 1;
+  const int resolutions[][2] = { { 640, 480 }, { 1280, 720 }, { 1920, 1080 } };
+  logInfo("raster: %zu triangles for %i frames, up to %i threads", scene.triangleCount(), frames, maxThreads);
+
+  for(const int* res : resolutions) {
+    for(int threads=1;; threads = std::min(threads * 2, maxThreads)) {
+      SoftwareRenderer renderer(threads);
+      renderer.resize(res[0], res[1]);
+      // The first frame grows the bins and job buffers
+      scene.draw(renderer, 0);
+      renderer.flush();
+
+      auto start = std::chrono::steady_clock::now();
+      for(int f=0; f<frames; f++) {
+        scene.draw(renderer, f);
+        renderer.flush();
+      }
+      double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+      // Equal between thread counts, the output does not depend on scheduling
+      unsigned long long checksum = 0;
+      for(int y=0; y<res[1]; y++)
+        for(int x=0; x<res[0]; x++) checksum = checksum * 31 + renderer.pixels()[y * renderer.getStride() + x];
+      const SoftwareStats &s = renderer.stats;
+      printf("%ix%i, %i threads: %.1f fps, %.2f ms per frame, %llu triangles, %.0f%% of %llu blocks culled by depth, image %016llx\n",
+             res[0], res[1], threads, frames / seconds, seconds * 1000 / frames, s.triangles,
+             s.blocks ? 100.0 * s.blocksCulled / s.blocks : 0.0, s.blocks, checksum);
+      if (threads >= maxThreads) break;
+    }
+  }
+  return 0;
+}
+
+// Stress scene for the OcclusionCuller: a maze of standing floors, each cell
+// holding a few crates, walked through by the camera along a circle.
+class MazeScene {
+  private:
+    struct Object {
+      const SoftwareModel* model;
+      AABB bounds;
+      bool occluder;
+      Transform* transform;
+    };
+    SoftwareModel floor, cube;
+    SoftwareTexture white;
+    AABB floorBounds, cubeBounds;
+    std::vector<Object> objects;
+    std::vector<SoftwareLight> lights;
+    int size;
+    void addWall(float x, float z, bool alongX);
+  public:
+    // Cells per side, every cell is as wide as a floor
+    MazeScene(int size);
+    ~MazeScene() { for(Object &o : objects) delete o.transform; }
+    bool valid() const { return !white.texels.empty(); }
+    size_t objectCount() const { return objects.size(); }
+    Matrix4 camera(int frame, float ratio, Vector3* eye) const;
+    // The frame as seen by the culler, which has to be filled already when visible is set
+    void cull(OcclusionCuller &culler, const Matrix4 &camera, std::vector<bool> &visible) const;
+    // Draws the objects that are set in visible, or all of them
+    void draw(SoftwareRenderer &renderer, const Matrix4 &camera, const Vector3 &eye, const std::vector<bool>* visible = nullptr) const;
+};
+
+MazeScene::MazeScene(int size)
+  : floor(cObj("models/floor.obj")), cube(cObj("models/cube.obj")), size(size)
+{
+  white.load("textures/white.png");
+  for(const Vector3 &p : floor.positions) floorBounds.consume(p);
+  for(const Vector3 &p : cube.positions) cubeBounds.consume(p);
+
+  // Depth first maze over the cells, walls are kept between cells that were not connected
+  float cell = FLOOR_SCALE * 2, origin = -size * cell / 2;
+  std::vector<bool> visited(size * size), openX((size + 1) * size), openZ(size * (size + 1));
+  std::vector<int> stack(1, 0);
+  unsigned int seed = 12345;
+  visited[0] = true;
+  while(!stack.empty()) {
+    int c = stack.back(), cx = c % size, cz = c / size;
+    int options[4], n = 0;
+    if (cx > 0 && !visited[c - 1]) options[n++] = 0;
+    if (cx + 1 < size && !visited[c + 1]) options[n++] = 1;
+    if (cz > 0 && !visited[c - size]) options[n++] = 2;
+    if (cz + 1 < size && !visited[c + size]) options[n++] = 3;
+    if (n == 0) {
+      stack.pop_back();
+      continue;
+    }
+    seed = seed * 1103515245 + 12345;
+    int next;
+    switch(options[(seed >> 16) % n]) {
+      case 0: openX[cz * (size + 1) + cx] = true; next = c - 1; break;
+      case 1: openX[cz * (size + 1) + cx + 1] = true; next = c + 1; break;
+      case 2: openZ[cz * size + cx] = true; next = c - size; break;
+      default: openZ[(cz + 1) * size + cx] = true; next = c + size; break;
+    }
+    visited[next] = true;
+    stack.push_back(next);
+  }
+  for(int z=0; z<size; z++)
+    for(int x=0; x<=size; x++)
+      if (!openX[z * (size + 1) + x]) addWall(origin + x * cell, origin + (z + 0.5f) * cell, false);
+  for(int z=0; z<=size; z++)
+    for(int x=0; x<size; x++)
+      if (!openZ[z * size + x]) addWall(origin + (x + 0.5f) * cell, origin + z * cell, true);
+
+  for(int z=0; z<size; z++) {
+    for(int x=0; x<size; x++) {
+      for(int i=0; i<3; i++) {
+        seed = seed * 1103515245 + 12345;
+        float u = ((seed >> 8) & 0xff) / 255.0f, v = ((seed >> 16) & 0xff) / 255.0f, h = (seed >> 24) / 255.0f;
+        Transform* t = new Transform(Vector3(CRATE_SCALE));
+        t->setPosition(Vector3(origin + (x + 0.15f + 0.7f * u) * cell, 1 + h * 12, origin + (z + 0.15f + 0.7f * v) * cell));
+        objects.push_back(Object{ &cube, cubeBounds, false, t });
+      }
+    }
+  }
+
+  lights.resize(1);
+  lights[0].color = Vector3(1, 1, 1) * 3000;
+  lights[0].position = Vector3(0, 60, 0);
+}
+
+void MazeScene::addWall(float x, float z, bool alongX)
+{
+  Transform* t = new Transform(Vector3(FLOOR_SCALE));
+  t->setRotation(alongX ? Quaternion::FromAxisRotations(-PI / 2, 0, 0) : Quaternion::FromAxisRotations(PI / 2, 0, PI / 2));
+  t->setPosition(Vector3(x, FLOOR_SCALE, z));
+  objects.push_back(Object{ &floor, floorBounds, true, t });
+}
+
+Matrix4 MazeScene::camera(int frame, float ratio, Vector3* eye) const
+{
+  float angle = frame * 0.02f, radius = size * FLOOR_SCALE * 0.6f;
+  *eye = Vector3(radius * sin(angle), 10, radius * cos(angle));
+  // Looking along the circle
+  Quaternion orientation = Quaternion::FromAxisRotations(0, PI / 2 - angle, 0);
+  return Matrix4::FromPerspective(1.25f, ratio, 0.1f, 1000.0f) * orientation.toMatrix() * Matrix4::FromTranslation(-*eye);
+}
+
+void MazeScene::cull(OcclusionCuller &culler, const Matrix4 &camera, std::vector<bool> &visible) const
+{
+  culler.begin(camera);
+  for(const Object &o : objects)
+    if (o.occluder) culler.addOccluder(o.transform->getWorld(), FLOOR_OCCLUDER, 1);
+  culler.rasterize();
+  visible.resize(objects.size());
+  for(size_t i=0; i<objects.size(); i++)
+    visible[i] = culler.isVisible(transformAABB(objects[i].transform->getWorld().toMatrix(), objects[i].bounds));
+}
+
+void MazeScene::draw(SoftwareRenderer &renderer, const Matrix4 &camera, const Vector3 &eye, const std::vector<bool>* visible) const
+{
+  renderer.setLights(lights.data(), lights.size());
+  for(size_t i=0; i<objects.size(); i++)
+    if (!visible || (*visible)[i]) renderer.draw(*objects[i].model, objects[i].transform->getWorld(), camera, eye, &white);
+}
+
+// Usage: --occlusion [frames] [max threads]
+// Culls the maze with 1, 2, 4... threads and reports the culling rate and the time
+// spent on it. Some of the frames are rendered with and without the culled objects,
+// which must give the same image.
+int runOcclusionBenchmark(int argc, char** argv)
+{
+  int frames = argc > 1 ? atoi(argv[1]) : 300;
+  int maxThreads = argc > 2 ? atoi(argv[2]) : 0;
+  if (maxThreads <= 0) maxThreads = std::max(1u, std::thread::hardware_concurrency());
+
+  MazeScene scene(16);
+  if (!scene.valid()) return 1;
+  logInfo("occlusion: %zu objects for %i frames, up to %i threads", scene.objectCount(), frames, maxThreads);
+
+  std::vector<bool> visible;
+  for(int threads=1;; threads = std::min(threads * 2, maxThreads)) {
+    OcclusionCuller culler(threads);
+    OcclusionStats total = {};
+    Vector3 eye;
+    auto start = std::chrono::steady_clock::now();
+    for(int f=0; f<frames; f++) {
+      scene.cull(culler, scene.camera(f, 16 / 9.0f, &eye), visible);
+      total.occluders += culler.stats.occluders;
+      total.tested += culler.stats.tested;
+      total.frustumCulled += culler.stats.frustumCulled;
+      total.occluded += culler.stats.occluded;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("%i threads: %.3f ms per frame, %llu occluders, %llu tested, %.1f%% outside the view, %.1f%% of the rest occluded\n",
+           threads, seconds * 1000 / frames, total.occluders / frames, total.tested / frames,
+           100.0 * total.frustumCulled / total.tested,
+           100.0 * total.occluded / std::max(1ull, total.tested - total.frustumCulled));
+    if (threads >= maxThreads) break;
+  }
+
+  SoftwareRenderer renderer;
+  renderer.resize(640, 360);
+  OcclusionCuller culler;
+  int mismatches = 0, checked = 0;
+  for(int f=0; f<frames; f += 25, checked++) {
+    Vector3 eye;
+    Matrix4 camera = scene.camera(f, 640 / 360.0f, &eye);
+    unsigned long long checksum[2];
+    for(int pass=0; pass<2; pass++) {
+      if (pass) scene.cull(culler, camera, visible);
+      scene.draw(renderer, camera, eye, pass ? &visible : nullptr);
+      renderer.flush();
+      checksum[pass] = 0;
+      for(int y=0; y<renderer.getHeight(); y++)
+        for(int x=0; x<renderer.getWidth(); x++) checksum[pass] = checksum[pass] * 31 + renderer.pixels()[y * renderer.getStride() + x];
+    }
+    if (checksum[0] != checksum[1]) mismatches++;
+  }
+  printf("%i of %i frames rendered differently with culling\n", mismatches, checked);
+  return mismatches ? 1 : 0;
+}
+
+#endif
@@ -20,27 +20,28 @@ class ResourceManager {
   public:
     LightSet lightset;
     ResourceManager();
+    // Frees the textures, meshes and shaders, needs the context they were made in
+    ~ResourceManager();
+    ResourceManager(const ResourceManager&) = delete;
+    ResourceManager& operator=(const ResourceManager&) = delete;
+    // Drops the added lights and puts those of the level back where they start
+    void resetLights();
     GLuint getTexture(const char* handle) const { return textures.at(handle); }
     DefaultShader* getDefaultShader() const { return defaultShader; }
     NormalMappedShader* getNormalMappedShader() const { return normalMappedShader; }
     IMesh* getMesh(const char* handle) const { return meshes.at(handle); }
+    // Program every mesh draws with from now on
+    void setPass(ShaderPass pass) { defaultShader->setPass(pass); normalMappedShader->setPass(pass); }
+    // Lights every mesh is shaded with from now on, null for those of the cluster
+    void setObjectLights(const ObjectLights* lights) { defaultShader->setObjectLights(lights); normalMappedShader->setObjectLights(lights); }
 };
 
 ResourceManager::ResourceManager()
 {
-  lightset[0].color = Vector3(1,1,0);
-  lightset[0].brightness = 100;
-  lightset[0].position.y = 10;
-
-  lightset[1].color = Vector3(0,1,1);
-  lightset[1].brightness = 100;
-  lightset[1].position.y = 10;
-
-  lightset[2].color = Vector3(1, 1, 1);
-  lightset[2].brightness = 300;
-  lightset[2].position = Vector3(0, 30, -30);
-  defaultShader = new DefaultShader(&lightset);
-  normalMappedShader = new NormalMappedShader(&lightset);
+  TRACE_SCOPE("load resources");
+  resetLights();
+  defaultShader = new DefaultShader();
+  normalMappedShader = new NormalMappedShader();
   loadTexture("floor", "textures/texture.jpg");
   loadTexture("white", "textures/white.png");
   loadTexture("wall", "textures/wall.jpg");
@@ -48,14 +49,40 @@ ResourceManager::ResourceManager()
   IMesh* player = new DefaultMesh(defaultShader, getTexture("white"), "models/player.obj");
   IMesh* floor = new NormalMappedMesh(normalMappedShader, getTexture("wall"), getTexture("wall_norm"), "models/floor.obj");
   IMesh* cube = new DefaultMesh(defaultShader, getTexture("white"), "models/cube.obj");
+  IMesh* stack = new DefaultMesh(defaultShader, getTexture("white"), "models/stack.obj");
   loadMesh("floor", floor);
   loadMesh("player", player);
   loadMesh("cube", cube);
+  loadMesh("stack", stack);
+}
+
+ResourceManager::~ResourceManager()
+{
+  for(auto &mesh : meshes) delete mesh.second;
+  for(auto &texture : textures) glDeleteTextures(1, &texture.second);
+  delete defaultShader;
+  delete normalMappedShader;
 }
 
+void ResourceManager::resetLights()
+{
+  lightset = LightSet();
+  lightset[0].color = Vector3(1,1,0);
+  lightset[0].brightness = 100;
+  lightset[0].position.y = 10;
+
+  lightset[1].color = Vector3(0,1,1);
+  lightset[1].brightness = 100;
+  lightset[1].position.y = 10;
+
+  lightset[2].color = Vector3(1, 1, 1);
+  lightset[2].brightness = 300;
+  lightset[2].position = Vector3(0, 30, -30);
+}
 
 void ResourceManager::loadTexture(const char* handle, const char* filename)
 {
+  TRACE_SCOPE("load texture");
   int width, height, nrChannels;
   GLuint texture;
 
@@ -10,8 +10,7 @@
 #include "camera.h"
 #include "exceptions.h"
 #include "light.h"
-
-#define NUM_LIGHTS 10
+#include "trace.h"
 
 inline static GLuint CompileShader(GLint type, std::string &source)
 {
@@ -44,6 +43,7 @@ inline static GLuint CompileShader(GLint type, std::string &source)
 
 inline static GLuint CompileShaderF(GLuint type, const char* filename)
 {
+  TRACE_SCOPE("compile shader");
   logDebug("reading shader source from %s", filename);
   std::ifstream t(filename);
   if (!t)
@@ -74,48 +74,108 @@ inline static GLuint GenerateProgram(GLuint vs, GLuint fs)
     glDeleteProgram(program);
     exit(5);
   }
+  // Only flagged, they go along with the program
+  glDeleteShader(vs);
+  glDeleteShader(fs);
   return program;
 }
 
+// What the meshes are drawn for, every shader has a program per pass
+enum ShaderPass {
+  // Shaded with the lights of LightClusters::bind
+  FORWARD_PASS,
+  // Material and normal only, into the GBuffer
+  GBUFFER_PASS,
+  // Depth only, the shading pass that follows tests for equal depths
+  DEPTH_PASS,
+  // Counts the fragments of every pixel into the OverdrawView
+  OVERDRAW_PASS,
+  SHADER_PASSES
+};
+
+// The passes that only read the positions, drawn with the vertex array of PositionArray
+inline static bool isPositionOnly(ShaderPass pass) { return pass == DEPTH_PASS || pass == OVERDRAW_PASS; }
+
+// Program of one pass, uniforms it lacks are at -1 and ignored by glUniform
+struct ShaderProgram {
+  GLuint id;
+  GLint uMvp, uCamera, uCamPos, uTexSize, uTex, uNormalTex;
+  GLint uObjectLightCount, uObjectLightPos, uObjectLightCol;
+  void link(const char* vs, const char* fs);
+  // Without lights the forward programs take those of the cluster
+  void setObjectLights(const ObjectLights* lights) const;
+};
+
+void ShaderProgram::link(const char* vs, const char* fs)
+{
+  id = GenerateProgram(CompileShaderF(GL_VERTEX_SHADER, vs), CompileShaderF(GL_FRAGMENT_SHADER, fs));
+  uMvp = glGetUniformLocation(id, "uMvp");
+  uCamera = glGetUniformLocation(id, "uCamera");
+  uCamPos = glGetUniformLocation(id, "uCamPos");
+  uTexSize = glGetUniformLocation(id, "uTexSize");
+  uTex = glGetUniformLocation(id, "tex");
+  uNormalTex = glGetUniformLocation(id, "n_tex");
+  uObjectLightCount = glGetUniformLocation(id, "uObjectLightCount");
+  uObjectLightPos = glGetUniformLocation(id, "uObjectLightPos");
+  uObjectLightCol = glGetUniformLocation(id, "uObjectLightCol");
+}
+
+// Vertex array streaming the positions in vbo to location 0 and nothing else
+inline static GLuint PositionArray(GLuint vbo)
+{
+  GLuint vao;
+  glGenVertexArrays(1, &vao);
+  glBindVertexArray(vao);
+  glBindBuffer(GL_ARRAY_BUFFER, vbo);
+  glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+  glEnableVertexAttribArray(0);
+  glBindVertexArray(0);
+  return vao;
+}
+
+void ShaderProgram::setObjectLights(const ObjectLights* lights) const
+{
+  if (uObjectLightCount < 0) return;
+  glUniform1i(uObjectLightCount, lights ? lights->count : -1);
+  if (!lights || lights->count == 0) return;
+  glUniform4fv(uObjectLightPos, lights->count, lights->position);
+  glUniform3fv(uObjectLightCol, lights->count, lights->color);
+}
+
+// The programs of a shader share the vertex shader, so one vertex array serves all
 class DefaultShader
 {
 private:
-  const LightSet* lightset;
-  GLint vPos, vNormal, vUV, uMvp, uCamera, uCamPos, uTexSize;
-  std::array<GLint, 10> uLightsCol;
-  std::array<GLint, 10> uLightsPos;
-  GLuint program;
+  GLint vPos, vNormal, vUV;
+  ShaderProgram programs[SHADER_PASSES];
+  ShaderPass pass;
+  const ObjectLights* objectLights;
 public:
-  DefaultShader(const LightSet* lights);
-
+  DefaultShader();
+  ~DefaultShader() { for(ShaderProgram &p : programs) glDeleteProgram(p.id); }
+  DefaultShader(const DefaultShader&) = delete;
+  DefaultShader& operator=(const DefaultShader&) = delete;
+
+  void setPass(ShaderPass pass) { this->pass = pass; }
+  bool positionOnly() const { return isPositionOnly(pass); }
+  // Lights of the next draws, null for those of the cluster
+  void setObjectLights(const ObjectLights* lights) { objectLights = lights; }
   void prepare(GLuint vbo, GLuint nbo, GLuint uvo) const;
-  void bind(const Camera* camera, Matrix4 mvp, GLuint tex, float texSize = 1) const;
+  void bind(const Camera* camera, const Affine3 &mvp, GLuint tex, float texSize = 1) const;
 };
 
-DefaultShader::DefaultShader(const LightSet* lights) : lightset(lights)
+DefaultShader::DefaultShader() : pass(FORWARD_PASS), objectLights(nullptr)
 {
   logDebug("Initializing shader");
-  GLuint vs = CompileShaderF(GL_VERTEX_SHADER, "shaders/default_shader_vs.c");
-  GLuint fs = CompileShaderF(GL_FRAGMENT_SHADER, "shaders/default_shader_fs.c");
-  program = GenerateProgram(vs, fs);
-
+  programs[FORWARD_PASS].link("shaders/default_shader_vs.c", "shaders/default_shader_fs.c");
+  programs[GBUFFER_PASS].link("shaders/default_shader_vs.c", "shaders/gbuffer_default_fs.c");
+  programs[DEPTH_PASS].link("shaders/depth_vs.c", "shaders/depth_fs.c");
+  programs[OVERDRAW_PASS].link("shaders/depth_vs.c", "shaders/overdraw_count_fs.c");
 
+  GLuint program = programs[FORWARD_PASS].id;
   vPos = glGetAttribLocation(program, "vPos");
   vNormal = glGetAttribLocation(program, "vNormal");
   vUV = glGetAttribLocation(program, "vUV");
-  uMvp = glGetUniformLocation(program, "uMvp");
-  uCamera = glGetUniformLocation(program, "uCamera");
-  uCamPos = glGetUniformLocation(program, "uCamPos");
-  uTexSize = glGetUniformLocation(program, "uTexSize");
-
-  for(int i=0; i<uLightsPos.size(); i++) {
-    char name[12 + i / 10];
-    snprintf(name, sizeof(name), "lights_p[%i]", i);
-    uLightsPos[i] = glGetUniformLocation(program, name);
-
-    snprintf(name, sizeof(name), "lights_c[%i]", i);
-    uLightsCol[i] = glGetUniformLocation(program, name);
-  }
 
   logDebug("Done initializing shader");
 }
@@ -134,69 +194,62 @@ void DefaultShader::prepare(GLuint vbo, GLuint nbo, GLuint uvo) const
    glEnableVertexAttribArray(vUV);
 }
 
-void DefaultShader::bind(const Camera* camera, Matrix4 mvp, GLuint tex, float texSize) const
+void DefaultShader::bind(const Camera* camera, const Affine3 &mvp, GLuint tex, float texSize) const
 {
-   mat4x4 m_camera, u_mvp;
+   TRACE_SCOPE("bind shader");
+   mat4x4 m_camera;
    camera->getMatrix().unpack(m_camera);
-   mvp.unpack(u_mvp);
-
-   glUseProgram(program);
-   lightset->sendToShader(uLightsPos, uLightsCol);
 
+   const ShaderProgram &program = programs[pass];
+   glUseProgram(program.id);
+   program.setObjectLights(objectLights);
 
-   glUniform1f(uTexSize, texSize);
+   glUniform1f(program.uTexSize, texSize);
    glActiveTexture(GL_TEXTURE0);
    glBindTexture(GL_TEXTURE_2D, tex);
 
-   glUniform3f(uCamPos, camera->pos.x, camera->pos.y, camera->pos.z);
-   glUniformMatrix4fv(uCamera, 1, GL_FALSE, (const GLfloat*)m_camera);
-   glUniformMatrix4fv(uMvp, 1, GL_FALSE, (const GLfloat*)u_mvp);
+   glUniform3f(program.uCamPos, camera->pos.x, camera->pos.y, camera->pos.z);
+   glUniformMatrix4fv(program.uCamera, 1, GL_FALSE, (const GLfloat*)m_camera);
+   // The rows of the model matrix are the columns of a mat3x4
+   glUniformMatrix3x4fv(program.uMvp, 1, GL_FALSE, mvp.data());
 }
 
 class NormalMappedShader
 {
 private:
-  GLint vPos, vNormal, vUV, vTangent, vBiTangent, uMvp, uCamera, uCamPos, uTex, uNormalTex, uTexSize;
-  std::array<GLint, 10> uLightsCol;
-  std::array<GLint, 10> uLightsPos;
-  GLuint program;
-  const LightSet* lights;
+  GLint vPos, vNormal, vUV, vTangent, vBiTangent;
+  ShaderProgram programs[SHADER_PASSES];
+  ShaderPass pass;
+  const ObjectLights* objectLights;
 public:
-  NormalMappedShader(const LightSet* lights);
-
+  NormalMappedShader();
+  ~NormalMappedShader() { for(ShaderProgram &p : programs) glDeleteProgram(p.id); }
+  NormalMappedShader(const NormalMappedShader&) = delete;
+  NormalMappedShader& operator=(const NormalMappedShader&) = delete;
+
+  void setPass(ShaderPass pass) { this->pass = pass; }
+  bool positionOnly() const { return isPositionOnly(pass); }
+  // Lights of the next draws, null for those of the cluster
+  void setObjectLights(const ObjectLights* lights) { objectLights = lights; }
   void prepare(GLuint vbo, GLuint nbo, GLuint uvo, GLuint tbo, GLuint btbo) const;
-  void bind(const Camera* camera, Matrix4 mvp, GLuint tex, GLuint n_tex, float texSize=1) const;
+  void bind(const Camera* camera, const Affine3 &mvp, GLuint tex, GLuint n_tex, float texSize=1) const;
 };
 
-NormalMappedShader::NormalMappedShader(const LightSet* lights) : lights(lights)
+NormalMappedShader::NormalMappedShader() : pass(FORWARD_PASS), objectLights(nullptr)
 {
   logDebug("Initializing shader");
 
-  GLuint vs = CompileShaderF(GL_VERTEX_SHADER, "shaders/normalmapped_shader_vs.c");
-  GLuint fs = CompileShaderF(GL_FRAGMENT_SHADER, "shaders/normalmapped_shader_fs.c");
-  program = GenerateProgram(vs, fs);
+  programs[FORWARD_PASS].link("shaders/normalmapped_shader_vs.c", "shaders/normalmapped_shader_fs.c");
+  programs[GBUFFER_PASS].link("shaders/normalmapped_shader_vs.c", "shaders/gbuffer_normalmapped_fs.c");
+  programs[DEPTH_PASS].link("shaders/depth_vs.c", "shaders/depth_fs.c");
+  programs[OVERDRAW_PASS].link("shaders/depth_vs.c", "shaders/overdraw_count_fs.c");
 
+  GLuint program = programs[FORWARD_PASS].id;
   vPos = glGetAttribLocation(program, "vPos");
   vNormal = glGetAttribLocation(program, "vNormal");
   vUV = glGetAttribLocation(program, "vUV");
   vTangent = glGetAttribLocation(program, "vTangent");
   vBiTangent = glGetAttribLocation(program, "vBiTangent");
-  uMvp = glGetUniformLocation(program, "uMvp");
-  uCamera = glGetUniformLocation(program, "uCamera");
-  uCamPos = glGetUniformLocation(program, "uCamPos");
-  uTexSize = glGetUniformLocation(program, "uTexSize");
-
-  uTex = glGetUniformLocation(program, "tex");
-  uNormalTex = glGetUniformLocation(program, "n_tex");
-
-  for(int i=0; i<uLightsPos.size(); i++) {
-    char name[12 + i / 10];
-    snprintf(name, sizeof(name), "lights_p[%i]", i);
-    uLightsPos[i] = glGetUniformLocation(program, name);
-
-    snprintf(name, sizeof(name), "lights_c[%i]", i);
-    uLightsCol[i] = glGetUniformLocation(program, name);
-  }
 
   logDebug("Done initializing shader");
 }
@@ -223,26 +276,28 @@ void NormalMappedShader::prepare(GLuint vbo, GLuint nbo, GLuint uvo, GLuint tbo,
    glEnableVertexAttribArray(vBiTangent);
 }
 
-void NormalMappedShader::bind(const Camera* camera, Matrix4 mvp, GLuint tex, GLuint n_tex, float texSize) const
+void NormalMappedShader::bind(const Camera* camera, const Affine3 &mvp, GLuint tex, GLuint n_tex, float texSize) const
 {
-   mat4x4 m_camera, u_mvp;
+   TRACE_SCOPE("bind shader");
+   mat4x4 m_camera;
    camera->getMatrix().unpack(m_camera);
-   mvp.unpack(u_mvp);
 
-   glUseProgram(program);
-   lights->sendToShader(uLightsPos, uLightsCol);
+   const ShaderProgram &program = programs[pass];
+   glUseProgram(program.id);
+   program.setObjectLights(objectLights);
 
-   glUniform1f(uTexSize, texSize);
-   glUniform1i(uTex, 0);
+   glUniform1f(program.uTexSize, texSize);
+   glUniform1i(program.uTex, 0);
    glActiveTexture(GL_TEXTURE0);
    glBindTexture(GL_TEXTURE_2D, tex);
-   glUniform1i(uNormalTex, 1);
+   glUniform1i(program.uNormalTex, 1);
    glActiveTexture(GL_TEXTURE1);
    glBindTexture(GL_TEXTURE_2D, n_tex);
 
-   glUniform3f(uCamPos, camera->pos.x, camera->pos.y, camera->pos.z);
-   glUniformMatrix4fv(uCamera, 1, GL_FALSE, (const GLfloat*)m_camera);
-   glUniformMatrix4fv(uMvp, 1, GL_FALSE, (const GLfloat*)u_mvp);
+   glUniform3f(program.uCamPos, camera->pos.x, camera->pos.y, camera->pos.z);
+   glUniformMatrix4fv(program.uCamera, 1, GL_FALSE, (const GLfloat*)m_camera);
+   // The rows of the model matrix are the columns of a mat3x4
+   glUniformMatrix3x4fv(program.uMvp, 1, GL_FALSE, mvp.data());
 }
 
 #endif
@@ -3,19 +3,23 @@ layout(location = 0) in vec3 vPos;
 layout(location = 1) in vec3 vNormal;
 layout(location = 2) in vec2 vUV;
 
-uniform mat4 uMvp;
+// Model matrix rows, the bottom row is always (0, 0, 0, 1)
+uniform mat3x4 uMvp;
 uniform mat4 uCamera;
 uniform float uTexSize;
 
+// Same as in depth_vs.c, for the GL_EQUAL test after the depth pre-pass
+invariant gl_Position;
+
 out vec3 pos;
 out vec3 normal;
 out vec2 uv;
 
 void main() {
-   vec4 worldPos = uMvp * vec4(vPos, 1);
+   vec4 worldPos = vec4(vec4(vPos, 1) * uMvp, 1);
    gl_Position = uCamera * worldPos; 
    pos = worldPos.xyz;
-   normal = normalize( uMvp * vec4(vNormal, 0)).xyz;
+   normal = normalize(vec4(vNormal, 0) * uMvp);
    uv = vUV / uTexSize;
 }
 
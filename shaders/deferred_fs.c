@@ -0,0 +1,90 @@
+#version 430 core
+out vec4 color;
+
+// Clip space to world space
+uniform mat4 uInverse;
+uniform vec3 uCamPos;
+
+uniform sampler2D albedoTex;
+uniform sampler2D normalTex;
+uniform sampler2D depthTex;
+
+// Rebuilt from the depth, cluster() reads it like the forward shaders do
+vec3 pos;
+
+// Same as in clusters.h
+#define CLUSTER_X 16
+#define CLUSTER_Y 9
+#define CLUSTER_Z 24
+
+struct Light {
+  // Radius in w
+  vec4 position;
+  vec4 color;
+};
+
+layout(std430, binding = 0) readonly buffer Lights { Light lights[]; };
+layout(std430, binding = 1) readonly buffer Clusters {
+  vec4 clusterScale;
+  vec4 viewDepth;
+  uvec2 clusters[];
+};
+layout(std430, binding = 2) readonly buffer ClusterIndices { uint lightIndices[]; };
+
+// Offset and count of the lights of the cluster holding this fragment
+uvec2 cluster() {
+  float depth = dot(viewDepth.xyz, pos) + viewDepth.w;
+  uvec2 tile = min(uvec2(gl_FragCoord.xy * clusterScale.xy), uvec2(CLUSTER_X - 1, CLUSTER_Y - 1));
+  uint slice = uint(clamp(log(depth) * clusterScale.z + clusterScale.w, 0.0, CLUSTER_Z - 1.0));
+  return clusters[(slice * CLUSTER_Y + tile.y) * CLUSTER_X + tile.x];
+}
+
+// Inverse of the encoding in the G-buffer shaders
+vec3 decode(vec2 e) {
+  vec3 n = vec3(e, 1 - abs(e.x) - abs(e.y));
+  if (n.z < 0) n.xy = (1 - abs(n.yx)) * vec2(n.x >= 0 ? 1 : -1, n.y >= 0 ? 1 : -1);
+  return normalize(n);
+}
+
+void main() {
+  ivec2 pixel = ivec2(gl_FragCoord.xy);
+  float z = texelFetch(depthTex, pixel, 0).r;
+  // Nothing was drawn here
+  if (z == 1) discard;
+  vec4 clip = vec4(gl_FragCoord.xy / textureSize(depthTex, 0) * 2 - 1, z * 2 - 1, 1);
+  vec4 world = uInverse * clip;
+  pos = world.xyz / world.w;
+  vec3 normal = decode(texelFetch(normalTex, pixel, 0).xy);
+
+  vec3 materialCol = texelFetch(albedoTex, pixel, 0).xyz;
+  // ambient component
+  vec3 fColor = 0.15f * materialCol;
+
+  uvec2 list = cluster();
+  for(uint i=list.x; i<list.x+list.y; i++) {
+    Light light = lights[lightIndices[i]];
+    vec3 light_p = light.position.xyz;
+    vec3 light_c = light.color.xyz;
+
+    vec3 lightVec = light_p - pos;
+
+    float dist = length(lightVec);
+    if (dist > light.position.w) continue;
+    vec3 lightDir = lightVec / dist;
+    float attenuation = 1.0f / (dist * dist);
+
+    float vis = max(dot(lightDir, normal), 0);
+    vec3 diffuse = vis * light_c * attenuation;
+
+    vec3 E = normalize(uCamPos - pos);
+    vec3 R = reflect(-lightDir, normal);
+    float cosAlpha = clamp(dot(E, R), 0, 1);
+    vec3 specular = materialCol * light_c * pow(cosAlpha, 100) * attenuation;
+
+    fColor += diffuse + specular;
+  }
+
+  color = vec4(fColor, 1.0f);
+  // Objects drawn after the lighting are still hidden behind the shaded ones
+  gl_FragDepth = z;
+}
@@ -0,0 +1,7 @@
+#version 430 core
+
+// A triangle over the whole screen, without any vertex buffer
+void main() {
+  vec2 corner = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+  gl_Position = vec4(corner * 2 - 1, 0, 1);
+}
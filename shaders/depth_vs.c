@@ -0,0 +1,14 @@
+#version 330 core
+layout(location = 0) in vec3 vPos;
+
+// Model matrix rows, the bottom row is always (0, 0, 0, 1)
+uniform mat3x4 uMvp;
+uniform mat4 uCamera;
+
+// The shading pass tests against these depths with GL_EQUAL
+invariant gl_Position;
+
+void main() {
+   vec4 worldPos = vec4(vec4(vPos, 1) * uMvp, 1);
+   gl_Position = uCamera * worldPos;
+}
@@ -0,0 +1,29 @@
+#version 430 core
+layout(location = 0) out vec4 albedo;
+layout(location = 1) out vec2 encodedNormal;
+
+in vec3 pos;
+in vec3 normal;
+in vec2 uv;
+in vec3 tangent;
+in vec3 bitangent;
+
+uniform sampler2D tex;
+uniform sampler2D n_tex;
+
+// Octahedral encoding, the unit sphere folded onto a square in [-1, 1]
+vec2 encode(vec3 n) {
+  n /= abs(n.x) + abs(n.y) + abs(n.z);
+  vec2 e = n.xy;
+  if (n.z < 0) e = (1 - abs(n.yx)) * vec2(n.x >= 0 ? 1 : -1, n.y >= 0 ? 1 : -1);
+  return e;
+}
+
+void main() {
+  // read normals from map
+  mat3 TBN = inverse(mat3(tangent, bitangent, normal));
+  vec3 tnormal = normalize((texture(n_tex, uv).xyz * 2 - 1) * TBN);
+
+  albedo = vec4(texture(tex, uv).xyz, 1.0f);
+  encodedNormal = encode(tnormal);
+}
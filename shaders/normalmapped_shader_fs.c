@@ -1,4 +1,4 @@
-#version 330 core
+#version 430 core
 out vec4 color;
 
 in vec3 pos;
@@ -13,11 +13,41 @@ uniform vec3 uCamPos;
 uniform sampler2D tex;
 uniform sampler2D n_tex;
 
-#define NUM_LIGHTS 10
+// Same as in clusters.h
+#define CLUSTER_X 16
+#define CLUSTER_Y 9
+#define CLUSTER_Z 24
 
-// Array of structs is not supported
-uniform vec3 lights_p[NUM_LIGHTS]; 
-uniform vec3 lights_c[NUM_LIGHTS];
+struct Light {
+  // Radius in w
+  vec4 position;
+  vec4 color;
+};
+
+layout(std430, binding = 0) readonly buffer Lights { Light lights[]; };
+layout(std430, binding = 1) readonly buffer Clusters {
+  vec4 clusterScale;
+  vec4 viewDepth;
+  uvec2 clusters[];
+};
+layout(std430, binding = 2) readonly buffer ClusterIndices { uint lightIndices[]; };
+
+// Same as OBJECT_LIGHTS in light.h
+#define OBJECT_LIGHTS 8
+
+// Lights picked for the whole object by LightGrid, the cluster is used when negative
+uniform int uObjectLightCount;
+// Radius in w
+uniform vec4 uObjectLightPos[OBJECT_LIGHTS];
+uniform vec3 uObjectLightCol[OBJECT_LIGHTS];
+
+// Offset and count of the lights of the cluster holding this fragment
+uvec2 cluster() {
+  float depth = dot(viewDepth.xyz, pos) + viewDepth.w;
+  uvec2 tile = min(uvec2(gl_FragCoord.xy * clusterScale.xy), uvec2(CLUSTER_X - 1, CLUSTER_Y - 1));
+  uint slice = uint(clamp(log(depth) * clusterScale.z + clusterScale.w, 0.0, CLUSTER_Z - 1.0));
+  return clusters[(slice * CLUSTER_Y + tile.y) * CLUSTER_X + tile.x];
+}
 
 void main() {
   // read normals from map
@@ -29,13 +59,19 @@ void main() {
   vec3 fColor = 0.15f * materialCol;
   vec3 cameraPos = (uCamera * vec4(0, 0, -1, 1)).xyz;
 
-  for(int i=0; i<NUM_LIGHTS; i++) {
-    vec3 light_p = lights_p[i];
-    vec3 light_c = lights_c[i];
+  bool perObject = uObjectLightCount >= 0;
+  uvec2 list = perObject ? uvec2(0, uObjectLightCount) : cluster();
+  for(uint i=list.x; i<list.x+list.y; i++) {
+    Light light = perObject ? Light(uObjectLightPos[i], vec4(uObjectLightCol[i], 0)) : lights[lightIndices[i]];
+    vec3 light_p = light.position.xyz;
+    vec3 light_c = light.color.xyz;
 
     vec3 lightVec = light_p - pos;
 
     float dist = length(lightVec);
+    // Beyond the radius the light is below LIGHT_CUTOFF, leaving it out everywhere
+    // keeps the borders between clusters invisible
+    if (dist > light.position.w) continue;
     vec3 lightDir = lightVec / dist;
     float attenuation = 1.0f / (dist * dist);
 
@@ -5,10 +5,14 @@ layout(location = 2) in vec2 vUV;
 layout(location = 3) in vec3 vTangent;
 layout(location = 4) in vec3 vBiTangent;
 
-uniform mat4 uMvp;
+// Model matrix rows, the bottom row is always (0, 0, 0, 1)
+uniform mat3x4 uMvp;
 uniform mat4 uCamera;
 uniform float uTexSize;
 
+// Same as in depth_vs.c, for the GL_EQUAL test after the depth pre-pass
+invariant gl_Position;
+
 out vec3 pos;
 out vec3 normal;
 out vec2 uv;
@@ -16,12 +20,12 @@ out vec3 tangent;
 out vec3 bitangent;
 
 void main() {
-   vec4 worldPos = uMvp * vec4(vPos, 1);
+   vec4 worldPos = vec4(vec4(vPos, 1) * uMvp, 1);
    gl_Position = uCamera * worldPos; 
    pos = worldPos.xyz;
-   normal = normalize(uMvp * vec4(vNormal, 0)).xyz;
+   normal = normalize(vec4(vNormal, 0) * uMvp);
    uv = vUV / uTexSize;
-   tangent = normalize(uMvp * vec4(vTangent, 0)).xyz;
-   bitangent = normalize(uMvp * vec4(vBiTangent, 0)).xyz;
+   tangent = normalize(vec4(vTangent, 0) * uMvp);
+   bitangent = normalize(vec4(vBiTangent, 0) * uMvp);
 }
 
@@ -0,0 +1,7 @@
+#version 330 core
+// Summed by additive blending, one per fragment
+out float count;
+
+void main() {
+  count = 1;
+}
@@ -0,0 +1,15 @@
+#version 430 core
+out vec4 color;
+
+uniform sampler2D countTex;
+
+// Fragments per pixel from black for none through blue, green, yellow and red for
+// one to four, to white at eight and more
+const vec3 heat[6] = vec3[](vec3(0, 0, 0), vec3(0, 0, 1), vec3(0, 1, 0), vec3(1, 1, 0), vec3(1, 0, 0), vec3(1, 1, 1));
+
+void main() {
+  float count = texelFetch(countTex, ivec2(gl_FragCoord.xy), 0).r;
+  float t = count <= 4 ? count : min(5, 4 + (count - 4) / 4);
+  int i = int(floor(t));
+  color = vec4(mix(heat[i], heat[min(i + 1, 5)], t - i), 1);
+}
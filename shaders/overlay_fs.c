@@ -0,0 +1,8 @@
+#version 330 core
+out vec4 fragColor;
+
+in vec4 color;
+
+void main() {
+   fragColor = color;
+}
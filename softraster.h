@@ -0,0 +1,622 @@
+#ifndef SOFTRASTER_H
+#define SOFTRASTER_H
+
+#include <array>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include "vec.h"
+#include "transform.h"
+#include "workers.h"
+#include "obj_loader.h"
+#include "light.h"
+
+// CPU implementation of the DefaultShader and NormalMappedShader pipeline for machines
+// without a GPU. Draws are queued and rendered on flush: the vertices of every draw
+// are shaded and its triangles binned into tiles in parallel, after which every tile
+// is rasterized by a single thread. Nothing in here depends on a GL context.
+
+#define SOFT_TILE_SIZE 64
+// Unit of the hierarchical depth buffer, which keeps the farthest depth per block
+#define SOFT_BLOCK_SIZE 8
+#define SOFT_CHUNK_TRIANGLES 2048
+// Triangles reaching further out than this multiple of w are clipped to the sides as well
+#define SOFT_GUARD_BAND 4
+// World position, normal, uv, tangent and bitangent
+#define SOFT_MAX_VARYINGS 14
+
+inline float lanesSqrt(float v) { return sqrtf(v); }
+#ifdef VEC_SSE
+inline __m128 lanesSqrt(__m128 v) { return _mm_sqrt_ps(v); }
+#endif
+#if defined(VEC_SSE) && defined(__AVX__)
+inline __m256 lanesSqrt(__m256 v) { return _mm256_sqrt_ps(v); }
+#endif
+// x^100 by squaring, the exponent of the specular highlight in both shaders
+template <typename T> inline T lanesPow100(T x) {
+  T x2 = x * x, x4 = x2 * x2, x8 = x4 * x4, x16 = x8 * x8, x32 = x16 * x16;
+  return x32 * x32 * x32 * x4;
+}
+
+struct SoftwareTexture {
+  int width, height;
+  // RGB in [0, 1], the first row at v = 0 like glTexImage2D
+  std::vector<float> texels;
+  SoftwareTexture() : width(0), height(0) {}
+  bool load(const char* filename);
+  // Bilinear and repeating, as GL_LINEAR with GL_REPEAT
+  Vector3 sample(float u, float v) const;
+};
+
+bool SoftwareTexture::load(const char* filename)
+{
+  int channels;
+  unsigned char* data = stbi_load(filename, &width, &height, &channels, 3);
+  if (!data) {
+    logError("Could not load texture: %s", filename);
+    return false;
+  }
+  texels.resize(width * height * 3);
+  for(size_t i=0; i<texels.size(); i++) texels[i] = data[i] / 255.0f;
+  stbi_image_free(data);
+  return true;
+}
+
+Vector3 SoftwareTexture::sample(float u, float v) const
+{
+  float x = u * width - 0.5f, y = v * height - 0.5f;
+  float fx = floorf(x), fy = floorf(y);
+  float tx = x - fx, ty = y - fy;
+  int x0 = (int)fx % width, y0 = (int)fy % height;
+  if (x0 < 0) x0 += width;
+  if (y0 < 0) y0 += height;
+  int x1 = x0 + 1 == width ? 0 : x0 + 1;
+  int y1 = y0 + 1 == height ? 0 : y0 + 1;
+  const float* a = &texels[(y0 * width + x0) * 3];
+  const float* b = &texels[(y0 * width + x1) * 3];
+  const float* c = &texels[(y1 * width + x0) * 3];
+  const float* d = &texels[(y1 * width + x1) * 3];
+  float r[3];
+  for(int i=0; i<3; i++) {
+    float top = a[i] + (b[i] - a[i]) * tx;
+    float bottom = c[i] + (d[i] - c[i]) * tx;
+    r[i] = top + (bottom - top) * ty;
+  }
+  return Vector3(r[0], r[1], r[2]);
+}
+
+// Samples every lane of u and v, one texel lookup at a time
+template <typename T>
+inline void sampleLanes(const SoftwareTexture &tex, T u, T v, T* rgb)
+{
+  const int n = sizeof(T) / sizeof(float);
+  alignas(32) float us[n], vs[n], out[3][n];
+  lanesStore(us, u);
+  lanesStore(vs, v);
+  for(int i=0; i<n; i++) {
+    Vector3 c = tex.sample(us[i], vs[i]);
+    out[0][i] = c.x;
+    out[1][i] = c.y;
+    out[2][i] = c.z;
+  }
+  for(int i=0; i<3; i++) rgb[i] = lanesLoad<T>(out[i]);
+}
+
+// Triangle soup with the attributes of cObj::renderBuffers
+struct SoftwareModel {
+  std::vector<Vector3> positions, normals, tangents, bitangents;
+  std::vector<Vector2> uvs;
+  AABB bounds;
+  SoftwareModel(const cObj &obj, bool withTangents = false);
+  size_t triangleCount() const { return positions.size() / 3; }
+};
+
+SoftwareModel::SoftwareModel(const cObj &obj, bool withTangents)
+{
+  std::vector<float> v, n, uv, t, bt;
+  if (withTangents) obj.renderBuffersTangents(v, n, uv, t, bt);
+  else obj.renderBuffers(v, n, uv);
+  size_t count = v.size() / 3;
+  positions.resize(count);
+  normals.resize(count);
+  // Models without texture coordinates sample the corner of the texture
+  uvs.resize(count);
+  for(size_t i=0; i<count; i++) {
+    positions[i] = Vector3(v[i*3], v[i*3+1], v[i*3+2]);
+    bounds.consume(positions[i]);
+    normals[i] = Vector3(n[i*3], n[i*3+1], n[i*3+2]);
+    if (uv.size() >= (i + 1) * 2) uvs[i] = Vector2(uv[i*2], uv[i*2+1]);
+  }
+  if (!withTangents) return;
+  tangents.resize(count);
+  bitangents.resize(count);
+  for(size_t i=0; i<count; i++) {
+    tangents[i] = Vector3(t[i*3], t[i*3+1], t[i*3+2]);
+    bitangents[i] = Vector3(bt[i*3], bt[i*3+1], bt[i*3+2]);
+  }
+}
+
+struct SoftwareLight {
+  // Color is premultiplied by the brightness, as sent to the shaders
+  Vector3 position, color;
+  // Set by SoftwareRenderer::setLights, see Light::radius
+  float radius;
+};
+
+// Per frame counters, summed over all threads
+struct SoftwareStats {
+  unsigned long long triangles, blocks, blocksCulled;
+};
+
+class SoftwareRenderer {
+  private:
+    struct DrawCall {
+      const SoftwareModel* model;
+      Affine3 m;
+      Matrix4 camera;
+      Vector3 camPos;
+      const SoftwareTexture *tex, *normalTex;
+      float texSize;
+      int varyings, lightCount;
+      // Lights reaching the draw, in drawLights
+      size_t firstLight;
+    };
+    struct Vertex {
+      // Clip space, after setup the pixel position, depth and 1/w
+      float x, y, z, w;
+      // Multiplied by 1/w after setup, for perspective correct interpolation
+      float varyings[SOFT_MAX_VARYINGS];
+    };
+    struct Triangle {
+      // Edge functions a * x + b * y + c at pixel centers, positive inside. Pixels
+      // exactly on an edge belong to the triangle that owns it.
+      float a[3], b[3], c[3];
+      bool owned[3];
+      float invArea, zmin;
+      int minX, minY, maxX, maxY;
+      unsigned int v[3];
+    };
+    // Consecutive triangles of one draw, shaded and binned by one thread
+    struct Job {
+      int draw;
+      size_t first, count;
+      std::vector<Vertex> vertices;
+      std::vector<Triangle> triangles;
+      std::vector<std::vector<unsigned int>> bins;
+    };
+
+    WorkerPool pool;
+    int width, height, tilesX, tilesY, stride;
+    std::vector<unsigned int> color;
+    std::vector<float> depth, hiz;
+    std::vector<DrawCall> draws;
+    std::vector<Job> jobs;
+    size_t jobCount;
+    std::vector<SoftwareLight> lights;
+    // The lights of every queued draw one after the other
+    std::vector<SoftwareLight> drawLights;
+    std::atomic<unsigned long long> triangles, blocks, blocksCulled;
+
+    void shadeVertex(const DrawCall &d, size_t i, Vertex &out) const;
+    void processJob(Job &job);
+    void setup(Job &job, Vertex* poly, int count);
+    void rasterizeTile(int tile);
+    template <typename T> void rasterize(const Job &job, const Triangle &tri, int tileX, int tileY, unsigned long long* stats);
+    template <typename T> void shade(const DrawCall &d, const T* v, T* rgb) const;
+  public:
+    SoftwareStats stats;
+    // Zero threads uses every core
+    SoftwareRenderer(int threads = 0);
+    int threadCount() const { return pool.size(); }
+    void resize(int width, int height);
+    int getWidth() const { return width; }
+    int getHeight() const { return height; }
+    // Rows of RGBA8 pixels from the top, getStride() pixels apart
+    const unsigned int* pixels() const { return color.data(); }
+    int getStride() const { return stride; }
+    // Any number of lights, every draw is shaded by those whose radius reaches its bounds
+    void setLights(const SoftwareLight* lights, int count);
+    // Queues the model placed by m, camera is the view projection as in Camera::getMatrix
+    void draw(const SoftwareModel &model, const Affine3 &m, const Matrix4 &camera, const Vector3 &camPos,
+              const SoftwareTexture* tex, const SoftwareTexture* normalTex = nullptr, float texSize = 1);
+    // Renders every draw queued since the last flush into the cleared framebuffer
+    void flush();
+};
+
+SoftwareRenderer::SoftwareRenderer(int threads)
+  : pool(threads > 0 ? threads : std::max(1u, std::thread::hardware_concurrency())),
+    width(0), height(0), tilesX(0), tilesY(0), stride(0), jobCount(0), stats{0, 0, 0}
+{
+}
+
+void SoftwareRenderer::resize(int w, int h)
+{
+  if (w == width && h == height) return;
+  width = w;
+  height = h;
+  tilesX = (w + SOFT_TILE_SIZE - 1) / SOFT_TILE_SIZE;
+  tilesY = (h + SOFT_TILE_SIZE - 1) / SOFT_TILE_SIZE;
+  // Padded to whole tiles, so blocks never cross the edge of the buffers
+  stride = tilesX * SOFT_TILE_SIZE;
+  color.assign(stride * tilesY * SOFT_TILE_SIZE, 0);
+  depth.assign(color.size(), 1);
+  hiz.assign(color.size() / (SOFT_BLOCK_SIZE * SOFT_BLOCK_SIZE), 1);
+}
+
+void SoftwareRenderer::setLights(const SoftwareLight* l, int count)
+{
+  lights.clear();
+  for(int i=0; i<count; i++) {
+    // Same cutoff as the GL shaders, black lights reach nothing and are left out
+    float peak = std::max(l[i].color.x, std::max(l[i].color.y, l[i].color.z));
+    if (peak <= 0) continue;
+    SoftwareLight light = l[i];
+    light.radius = sqrtf(peak / LIGHT_CUTOFF);
+    lights.push_back(light);
+  }
+}
+
+void SoftwareRenderer::draw(const SoftwareModel &model, const Affine3 &m, const Matrix4 &camera, const Vector3 &camPos,
+                            const SoftwareTexture* tex, const SoftwareTexture* normalTex, float texSize)
+{
+  DrawCall d;
+  d.model = &model;
+  d.m = m;
+  d.camera = camera;
+  d.camPos = camPos;
+  d.tex = tex;
+  d.normalTex = normalTex && !model.tangents.empty() ? normalTex : nullptr;
+  d.texSize = texSize;
+  d.varyings = d.normalTex ? 14 : 8;
+  // Lights whose sphere touches the world bounds of the model
+  AABB box = transformAABB(m.toMatrix(), model.bounds);
+  d.firstLight = drawLights.size();
+  for(const SoftwareLight &light : lights) {
+    Vector3 p = light.position;
+    Vector3 closest = Vector3(clamp(p.x, box.min.x, box.max.x), clamp(p.y, box.min.y, box.max.y), clamp(p.z, box.min.z, box.max.z));
+    if ((closest - p).sq_length() <= light.radius * light.radius) drawLights.push_back(light);
+  }
+  d.lightCount = drawLights.size() - d.firstLight;
+  draws.push_back(d);
+}
+
+void SoftwareRenderer::flush()
+{
+  size_t count = 0;
+  for(const DrawCall &d : draws)
+    count += (d.model->triangleCount() + SOFT_CHUNK_TRIANGLES - 1) / SOFT_CHUNK_TRIANGLES;
+  if (jobs.size() < count) jobs.resize(count);
+  size_t j = 0;
+  for(size_t i=0; i<draws.size(); i++) {
+    size_t n = draws[i].model->triangleCount();
+    for(size_t first=0; first<n; first+=SOFT_CHUNK_TRIANGLES, j++) {
+      jobs[j].draw = i;
+      jobs[j].first = first;
+      jobs[j].count = std::min(n - first, (size_t)SOFT_CHUNK_TRIANGLES);
+    }
+  }
+
+  triangles = 0;
+  blocks = 0;
+  blocksCulled = 0;
+  // Jobs past the used ones keep their buffers for later frames
+  jobCount = count;
+  pool.run(count, [&](int i) { processJob(jobs[i]); });
+  pool.run(tilesX * tilesY, [&](int t) { rasterizeTile(t); });
+  stats = SoftwareStats{ triangles, blocks, blocksCulled };
+  draws.clear();
+  drawLights.clear();
+}
+
+void SoftwareRenderer::shadeVertex(const DrawCall &d, size_t i, Vertex &out) const
+{
+  const SoftwareModel &model = *d.model;
+  Vector3 p = d.m.transformPoint(model.positions[i]);
+  Vector4 clip = d.camera * Vector4(p, 1);
+  out.x = clip.x;
+  out.y = clip.y;
+  out.z = clip.z;
+  out.w = clip.w;
+  Vector3 n = d.m.transformDirection(model.normals[i]).normalized();
+  float* v = out.varyings;
+  v[0] = p.x; v[1] = p.y; v[2] = p.z;
+  v[3] = n.x; v[4] = n.y; v[5] = n.z;
+  v[6] = model.uvs[i].x / d.texSize;
+  v[7] = model.uvs[i].y / d.texSize;
+  if (!d.normalTex) return;
+  Vector3 t = d.m.transformDirection(model.tangents[i]).normalized();
+  Vector3 b = d.m.transformDirection(model.bitangents[i]).normalized();
+  v[8] = t.x; v[9] = t.y; v[10] = t.z;
+  v[11] = b.x; v[12] = b.y; v[13] = b.z;
+}
+
+// Signed distance to one of the clipping planes, the near plane first and the guard band after
+inline float clipDistance(const float* v, int plane)
+{
+  switch(plane) {
+    case 0: return v[2] + v[3];
+    case 1: return SOFT_GUARD_BAND * v[3] + v[0];
+    case 2: return SOFT_GUARD_BAND * v[3] - v[0];
+    case 3: return SOFT_GUARD_BAND * v[3] + v[1];
+    default: return SOFT_GUARD_BAND * v[3] - v[1];
+  }
+}
+
+void SoftwareRenderer::processJob(Job &job)
+{
+  const DrawCall &d = draws[job.draw];
+  job.vertices.clear();
+  job.triangles.clear();
+  job.bins.resize(tilesX * tilesY);
+  for(std::vector<unsigned int> &bin : job.bins) bin.clear();
+
+  // Sutherland-Hodgman needs room for one extra vertex per plane
+  Vertex poly[8], clipped[8];
+  for(size_t t=0; t<job.count; t++) {
+    int outside = ~0, clip = 0;
+    for(int k=0; k<3; k++) {
+      Vertex &v = poly[k];
+      shadeVertex(d, (job.first + t) * 3 + k, v);
+      int codes = (v.x < -v.w) | (v.x > v.w) << 1 | (v.y < -v.w) << 2 | (v.y > v.w) << 3 | (v.z > v.w) << 4;
+      outside &= codes;
+      clip |= (v.z < -v.w) | (fabsf(v.x) > SOFT_GUARD_BAND * v.w) << 1 | (fabsf(v.y) > SOFT_GUARD_BAND * v.w) << 1;
+    }
+    if (outside) continue;
+    int count = 3;
+    for(int plane=0; clip && plane<5 && count>0; plane++) {
+      if (plane == 1 && !(clip & 2)) break;
+      int n = 0;
+      for(int k=0; k<count; k++) {
+        const Vertex &a = poly[k], &b = poly[(k + 1) % count];
+        float da = clipDistance(&a.x, plane), db = clipDistance(&b.x, plane);
+        if (da >= 0) clipped[n++] = a;
+        if ((da >= 0) != (db >= 0)) {
+          float s = da / (da - db);
+          Vertex &v = clipped[n++];
+          v.x = a.x + (b.x - a.x) * s;
+          v.y = a.y + (b.y - a.y) * s;
+          v.z = a.z + (b.z - a.z) * s;
+          v.w = a.w + (b.w - a.w) * s;
+          for(int i=0; i<d.varyings; i++) v.varyings[i] = a.varyings[i] + (b.varyings[i] - a.varyings[i]) * s;
+        }
+      }
+      std::copy(clipped, clipped + n, poly);
+      count = n;
+    }
+    if (count >= 3) setup(job, poly, count);
+  }
+  triangles += job.triangles.size();
+}
+
+// Projects a convex polygon to the screen and bins the triangles of its fan
+void SoftwareRenderer::setup(Job &job, Vertex* poly, int count)
+{
+  const DrawCall &d = draws[job.draw];
+  unsigned int base = job.vertices.size();
+  for(int k=0; k<count; k++) {
+    Vertex v = poly[k];
+    float iw = 1.0f / v.w;
+    v.x = (v.x * iw * 0.5f + 0.5f) * width;
+    v.y = (0.5f - v.y * iw * 0.5f) * height;
+    v.z *= iw;
+    v.w = iw;
+    for(int i=0; i<d.varyings; i++) v.varyings[i] *= iw;
+    job.vertices.push_back(v);
+  }
+
+  for(int k=1; k+1<count; k++) {
+    Triangle t;
+    t.v[0] = base;
+    t.v[1] = base + k;
+    t.v[2] = base + k + 1;
+    const Vertex* p[3] = { &job.vertices[t.v[0]], &job.vertices[t.v[1]], &job.vertices[t.v[2]] };
+    float area = (p[1]->x - p[0]->x) * (p[2]->y - p[0]->y) - (p[1]->y - p[0]->y) * (p[2]->x - p[0]->x);
+    // Nothing is culled by winding, like the GL pipeline which does not enable culling
+    if (!(area != 0)) continue;
+    if (area < 0) {
+      std::swap(t.v[1], t.v[2]);
+      std::swap(p[1], p[2]);
+      area = -area;
+    }
+    float minX = std::min(p[0]->x, std::min(p[1]->x, p[2]->x)), maxX = std::max(p[0]->x, std::max(p[1]->x, p[2]->x));
+    float minY = std::min(p[0]->y, std::min(p[1]->y, p[2]->y)), maxY = std::max(p[0]->y, std::max(p[1]->y, p[2]->y));
+    // Pixels whose center lies within the bounds
+    t.minX = std::max(0, (int)ceilf(minX - 0.5f));
+    t.minY = std::max(0, (int)ceilf(minY - 0.5f));
+    t.maxX = std::min(width - 1, (int)floorf(maxX - 0.5f));
+    t.maxY = std::min(height - 1, (int)floorf(maxY - 0.5f));
+    if (t.minX > t.maxX || t.minY > t.maxY) continue;
+    for(int e=0; e<3; e++) {
+      const Vertex *a = p[(e + 1) % 3], *b = p[(e + 2) % 3];
+      t.a[e] = a->y - b->y;
+      t.b[e] = b->x - a->x;
+      t.c[e] = -(t.a[e] * a->x + t.b[e] * a->y);
+      // Shared edges have opposite coefficients, so exactly one side owns them
+      t.owned[e] = t.a[e] > 0 || (t.a[e] == 0 && t.b[e] > 0);
+    }
+    t.invArea = 1.0f / area;
+    t.zmin = std::min(p[0]->z, std::min(p[1]->z, p[2]->z));
+
+    unsigned int index = job.triangles.size();
+    job.triangles.push_back(t);
+    for(int ty = t.minY / SOFT_TILE_SIZE; ty <= t.maxY / SOFT_TILE_SIZE; ty++)
+      for(int tx = t.minX / SOFT_TILE_SIZE; tx <= t.maxX / SOFT_TILE_SIZE; tx++)
+        job.bins[ty * tilesX + tx].push_back(index);
+  }
+}
+
+void SoftwareRenderer::rasterizeTile(int tile)
+{
+  int tileX = (tile % tilesX) * SOFT_TILE_SIZE, tileY = (tile / tilesX) * SOFT_TILE_SIZE;
+  for(int y=tileY; y<tileY+SOFT_TILE_SIZE; y++) {
+    std::fill_n(&color[y * stride + tileX], SOFT_TILE_SIZE, 0xff000000u);
+    std::fill_n(&depth[y * stride + tileX], SOFT_TILE_SIZE, 1.0f);
+  }
+  int blocksPerRow = stride / SOFT_BLOCK_SIZE;
+  for(int by=tileY/SOFT_BLOCK_SIZE; by<(tileY+SOFT_TILE_SIZE)/SOFT_BLOCK_SIZE; by++)
+    std::fill_n(&hiz[by * blocksPerRow + tileX / SOFT_BLOCK_SIZE], SOFT_TILE_SIZE / SOFT_BLOCK_SIZE, 1.0f);
+
+  // In order of submission, so that equal depths resolve like they would on the GPU
+  unsigned long long local[2] = { 0, 0 };
+  for(size_t j=0; j<jobCount; j++)
+    for(unsigned int i : jobs[j].bins[tile]) rasterize<batch>(jobs[j], jobs[j].triangles[i], tileX, tileY, local);
+  blocks += local[0];
+  blocksCulled += local[1];
+}
+
+// Covers the triangle within the tile in blocks of SOFT_BLOCK_SIZE squared pixels, a
+// row of lanes at a time. Blocks entirely outside an edge or behind the farthest depth
+// already in the block are skipped.
+template <typename T>
+void SoftwareRenderer::rasterize(const Job &job, const Triangle &tri, int tileX, int tileY, unsigned long long* stats)
+{
+  const int n = sizeof(T) / sizeof(float);
+  const DrawCall &d = draws[job.draw];
+  int x0 = std::max(tri.minX, tileX), x1 = std::min(tri.maxX, tileX + SOFT_TILE_SIZE - 1);
+  int y0 = std::max(tri.minY, tileY), y1 = std::min(tri.maxY, tileY + SOFT_TILE_SIZE - 1);
+  if (x0 > x1 || y0 > y1) return;
+  x0 &= ~(SOFT_BLOCK_SIZE - 1);
+  y0 &= ~(SOFT_BLOCK_SIZE - 1);
+
+  // Everything is interpolated from the barycentrics of vertices 1 and 2
+  const Vertex &v0 = job.vertices[tri.v[0]], &v1 = job.vertices[tri.v[1]], &v2 = job.vertices[tri.v[2]];
+  float base[SOFT_MAX_VARYINGS], d1[SOFT_MAX_VARYINGS], d2[SOFT_MAX_VARYINGS];
+  for(int i=0; i<d.varyings; i++) {
+    base[i] = v0.varyings[i];
+    d1[i] = v1.varyings[i] - v0.varyings[i];
+    d2[i] = v2.varyings[i] - v0.varyings[i];
+  }
+  T zero = lanes<T>(0), one = lanes<T>(1);
+  T offsets = lanesIndex<T>() + lanes<T>(0.5f);
+  T ea[3], eb[3], ec[3];
+  decltype(zero == zero) owned[3];
+  for(int e=0; e<3; e++) {
+    ea[e] = lanes<T>(tri.a[e]);
+    eb[e] = lanes<T>(tri.b[e]);
+    ec[e] = lanes<T>(tri.c[e]);
+    owned[e] = tri.owned[e] ? zero == zero : zero != zero;
+  }
+  T invArea = lanes<T>(tri.invArea);
+
+  int blocksPerRow = stride / SOFT_BLOCK_SIZE;
+  for(int by=y0; by<=y1; by+=SOFT_BLOCK_SIZE) {
+    for(int bx=x0; bx<=x1; bx+=SOFT_BLOCK_SIZE) {
+      stats[0]++;
+      // The corner furthest inside every edge
+      bool outside = false;
+      for(int e=0; e<3 && !outside; e++) {
+        float cx = bx + (tri.a[e] > 0 ? SOFT_BLOCK_SIZE - 0.5f : 0.5f);
+        float cy = by + (tri.b[e] > 0 ? SOFT_BLOCK_SIZE - 0.5f : 0.5f);
+        outside = tri.a[e] * cx + tri.b[e] * cy + tri.c[e] < 0;
+      }
+      if (outside) continue;
+      float &farthest = hiz[(by / SOFT_BLOCK_SIZE) * blocksPerRow + bx / SOFT_BLOCK_SIZE];
+      if (tri.zmin >= farthest) {
+        stats[1]++;
+        continue;
+      }
+
+      bool written = false;
+      for(int y=by; y<by+SOFT_BLOCK_SIZE; y++) {
+        T py = lanes<T>(y + 0.5f);
+        for(int x=bx; x<bx+SOFT_BLOCK_SIZE; x+=n) {
+          T px = lanes<T>(x) + offsets;
+          T e[3];
+          for(int i=0; i<3; i++) e[i] = ea[i] * px + eb[i] * py + ec[i];
+          auto inside = ((e[0] > zero) | ((e[0] == zero) & owned[0])) &
+                        ((e[1] > zero) | ((e[1] == zero) & owned[1])) &
+                        ((e[2] > zero) | ((e[2] == zero) & owned[2]));
+          if (!lanesBits(inside)) continue;
+          T b1 = e[1] * invArea, b2 = e[2] * invArea;
+          T z = lanes<T>(v0.z) + b1 * lanes<T>(v1.z - v0.z) + b2 * lanes<T>(v2.z - v0.z);
+          float* dp = &depth[y * stride + x];
+          T old = lanesLoad<T>(dp);
+          auto pass = inside & (z < old);
+          int bits = lanesBits(pass);
+          if (!bits) continue;
+          lanesStore(dp, pass ? z : old);
+          written = true;
+
+          T w = one / (lanes<T>(v0.w) + b1 * lanes<T>(v1.w - v0.w) + b2 * lanes<T>(v2.w - v0.w));
+          T v[SOFT_MAX_VARYINGS];
+          for(int i=0; i<d.varyings; i++) v[i] = (lanes<T>(base[i]) + b1 * lanes<T>(d1[i]) + b2 * lanes<T>(d2[i])) * w;
+          T rgb[3];
+          shade(d, v, rgb);
+          alignas(32) float c[3][n];
+          for(int i=0; i<3; i++) lanesStore(c[i], lanesMin(lanesMax(rgb[i], zero), one) * lanes<T>(255) + lanes<T>(0.5f));
+          unsigned int* cp = &color[y * stride + x];
+          for(int i=0; i<n; i++)
+            if (bits >> i & 1) cp[i] = 0xff000000u | (unsigned int)c[2][i] << 16 | (unsigned int)c[1][i] << 8 | (unsigned int)c[0][i];
+        }
+      }
+      if (written) {
+        float m = 0;
+        for(int y=by; y<by+SOFT_BLOCK_SIZE; y++)
+          for(int x=bx; x<bx+SOFT_BLOCK_SIZE; x++) m = std::max(m, depth[y * stride + x]);
+        farthest = m;
+      }
+    }
+  }
+}
+
+// default_shader_fs.c, or normalmapped_shader_fs.c when the draw has a normal map
+template <typename T>
+void SoftwareRenderer::shade(const DrawCall &d, const T* v, T* rgb) const
+{
+  T zero = lanes<T>(0), one = lanes<T>(1), two = lanes<T>(2);
+  T px = v[0], py = v[1], pz = v[2];
+  T nx = v[3], ny = v[4], nz = v[5];
+  if (d.normalTex) {
+    T m[3];
+    sampleLanes(*d.normalTex, v[6], v[7], m);
+    for(int i=0; i<3; i++) m[i] = m[i] * two - one;
+    T tx = v[8], ty = v[9], tz = v[10];
+    T bx = v[11], by = v[12], bz = v[13];
+    // Columns of the transposed inverse of mat3(tangent, bitangent, normal), times its
+    // determinant. Normalizing divides it out again while keeping its sign.
+    T c0x = by * nz - bz * ny, c0y = bz * nx - bx * nz, c0z = bx * ny - by * nx;
+    T c1x = ny * tz - nz * ty, c1y = nz * tx - nx * tz, c1z = nx * ty - ny * tx;
+    T c2x = ty * bz - tz * by, c2y = tz * bx - tx * bz, c2z = tx * by - ty * bx;
+    T det = tx * c0x + ty * c0y + tz * c0z;
+    T x = (m[0] * c0x + m[1] * c1x + m[2] * c2x) * det;
+    T y = (m[0] * c0y + m[1] * c1y + m[2] * c2y) * det;
+    T z = (m[0] * c0z + m[1] * c1z + m[2] * c2z) * det;
+    T inv = one / lanesSqrt(x * x + y * y + z * z);
+    nx = x * inv;
+    ny = y * inv;
+    nz = z * inv;
+  }
+
+  T material[3] = { one, one, one };
+  if (d.tex) sampleLanes(*d.tex, v[6], v[7], material);
+  for(int i=0; i<3; i++) rgb[i] = lanes<T>(0.15f) * material[i];
+
+  T ex = lanes<T>(d.camPos.x) - px, ey = lanes<T>(d.camPos.y) - py, ez = lanes<T>(d.camPos.z) - pz;
+  T einv = one / lanesSqrt(ex * ex + ey * ey + ez * ez);
+  ex = ex * einv;
+  ey = ey * einv;
+  ez = ez * einv;
+  const SoftwareLight* lights = drawLights.data() + d.firstLight;
+  for(int l=0; l<d.lightCount; l++) {
+    const SoftwareLight &light = lights[l];
+    T lx = lanes<T>(light.position.x) - px, ly = lanes<T>(light.position.y) - py, lz = lanes<T>(light.position.z) - pz;
+    T sq = lx * lx + ly * ly + lz * lz;
+    T inv = one / lanesSqrt(sq);
+    lx = lx * inv;
+    ly = ly * inv;
+    lz = lz * inv;
+    // Nothing beyond the radius, as in the shaders
+    T attenuation = sq <= lanes<T>(light.radius * light.radius) ? one / sq : zero;
+    T ndotl = lx * nx + ly * ny + lz * nz;
+    T diffuse = lanesMax(ndotl, zero) * attenuation;
+    // reflect(-lightDir, normal)
+    T rx = two * ndotl * nx - lx, ry = two * ndotl * ny - ly, rz = two * ndotl * nz - lz;
+    T cosAlpha = lanesMax(ex * rx + ey * ry + ez * rz, zero);
+    if (!d.normalTex) cosAlpha = lanesMin(cosAlpha, one);
+    T specular = lanesPow100(cosAlpha) * attenuation;
+    T col[3] = { lanes<T>(light.color.x), lanes<T>(light.color.y), lanes<T>(light.color.z) };
+    for(int i=0; i<3; i++) rgb[i] = rgb[i] + col[i] * (diffuse + material[i] * specular);
+  }
+}
+
+#endif
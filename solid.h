@@ -0,0 +1,92 @@
+#ifndef SOLID_H
+#define SOLID_H
+
+#include <atomic>
+#include "vec.h"
+#include "physics.h"
+#include "meshcollider.h"
+
+// Simulation state only, nothing in here may depend on a GL context so that
+// scenes can be stepped headless.
+
+// Collision layers, a solid belongs to the categories set in its category bits and
+// only collides with solids whose category is in its mask, and vice versa.
+// The highest bit is reserved by the PhysicsWorld.
+#define LAYER_DEFAULT (1u << 0)
+#define LAYER_LEVEL   (1u << 1)
+#define LAYER_PLAYER  (1u << 2)
+#define LAYER_CAMERA  (1u << 3)
+#define LAYER_ALL     0x7fffffffu
+
+class ISolid {
+  private:
+    OBB boundary;
+    static std::atomic<unsigned int> nextId;
+  protected:
+    void updateBoundary(Matrix4 m) { boundary.update(m); }
+  public:
+    unsigned int id;
+    Vector3 velocity;
+    // Zero for static geometry, which is never moved by the solver
+    float inverseMass, friction, gravityScale;
+    // Collision layers, changes only take effect while the body is awake
+    unsigned int category, mask;
+    // Sleep state, maintained by the PhysicsWorld
+    bool awake, allowSleep;
+    int sleepTime, awakeIndex;
+    // Node in the broadphase tree, -1 when not part of a world
+    int proxy;
+    // Optional exact shape in model space, the boundary then only serves as its bounds
+    const TriangleMeshCollider* collider;
+    virtual void onCollision(const ISolid* other, Vector3 normal, float dis) {}
+    virtual void updateBoundary() = 0;
+    virtual void translate(const Vector3 &d) {}
+    ISolid() : ISolid(OBB(Vector3(0), Vector3(0))) {}
+    ISolid(OBB boundary) : boundary(boundary), id(nextId++), inverseMass(0), friction(0.5f), gravityScale(1),
+                           category(LAYER_DEFAULT), mask(LAYER_ALL), awake(true), allowSleep(true), sleepTime(0), awakeIndex(-1), proxy(-1), collider(nullptr) {}
+    virtual ~ISolid() {}
+    bool intersects(const ISolid* o, Vector3* normal, float* min_dis) {
+      return boundary.intersects(o->boundary, normal, min_dis);
+    }
+    bool isStatic() const { return inverseMass == 0; }
+    bool collidesWith(const ISolid* o) const { return (category & o->mask) && (o->category & mask); }
+    const OBB& getBoundary() const { return boundary; }
+};
+std::atomic<unsigned int> ISolid::nextId(0);
+
+class IMeshObject {
+public:
+  Transform transform;
+protected:
+  IMeshObject() {}
+  IMeshObject(float scale) : transform(Vector3(scale)) {}
+  virtual const Affine3& getMvp() const { return transform.getWorld(); }
+};
+
+// A solid placed by a model transform, the simulated part of a SolidMesh
+class SolidBody : public IMeshObject, public ISolid {
+  public:
+    SolidBody(float scale, OBB boundary) : IMeshObject(scale), ISolid(boundary) {}
+    void updateBoundary() override { ISolid::updateBoundary(getMvp().toMatrix()); }
+    void translate(const Vector3 &d) override { transform.translate(d); }
+};
+
+// Shapes shared by the rendered game objects and the headless scenes
+#define FLOOR_SCALE 15
+#define FLOOR_BOUNDARY OBB(Vector3(0), Vector3(1, 0.1, 1))
+#define PLAYER_BOUNDARY OBB(Vector3(0, 9, 0), Vector3(2, 9, 2))
+#define CRATE_SCALE 2
+#define CRATE_BOUNDARY OBB(Vector3(0), Vector3(0.5))
+// Three boxes of models/stack.obj on top of each other, collided with by their triangles
+#define STACK_SCALE 4
+#define STACK_BOUNDARY OBB(Vector3(0, 0.7725f, 0), Vector3(1, 1.7725f, 1))
+// Loaded on first use and shared by every stack
+const TriangleMeshCollider* stackCollider()
+{
+  static TriangleMeshCollider collider(cObj("models/stack.obj"));
+  return &collider;
+}
+// Quad of the floor model, the part of a Floor that hides what is behind it
+const Vector3 FLOOR_OCCLUDER[4] = { Vector3(-1, 0, -1), Vector3(1, 0, -1), Vector3(1, 0, 1), Vector3(-1, 0, 1) };
+
+#endif
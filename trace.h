@@ -0,0 +1,176 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdio.h>
+#include <vector>
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+#include "logger.h"
+
+// Events kept per thread, older ones are overwritten
+#define TRACE_BUFFER_EVENTS 16384
+// A frame this many times the running average is a spike
+#define TRACE_SPIKE_FACTOR 2.5
+// Frames before a spike that are written with it
+#define TRACE_SPIKE_FRAMES 30
+// Frames after a spike in which no other spike is written
+#define TRACE_SPIKE_COOLDOWN 300
+
+// Complete event, times in nanoseconds since the start of the program
+struct TraceEvent {
+  const char* name;
+  long long start, duration;
+};
+
+// Ring of events that only its own thread writes to, so recording takes no lock.
+// The count is published last, a reader sees whole events below it.
+struct TraceBuffer {
+  int tid;
+  const char* threadName;
+  std::vector<TraceEvent> events;
+  std::atomic<unsigned long long> written;
+  TraceBuffer(int tid) : tid(tid), threadName(nullptr), events(TRACE_BUFFER_EVENTS), written(0) {}
+  void push(const TraceEvent &e)
+  {
+    unsigned long long n = written.load(std::memory_order_relaxed);
+    events[n % TRACE_BUFFER_EVENTS] = e;
+    written.store(n + 1, std::memory_order_release);
+  }
+};
+
+// Timeline of scopes on every thread, written as Chrome trace event JSON that both
+// chrome://tracing and the Perfetto UI open. Names must be string literals.
+// Recording is off until enabled and then costs a clock read per scope end.
+class Tracer {
+  private:
+    typedef std::chrono::steady_clock Clock;
+    static std::atomic<bool> enabled;
+    static Clock::time_point epoch;
+    // Buffers outlive their threads, so the events of finished threads are kept
+    static std::mutex mutex;
+    static std::vector<TraceBuffer*> buffers;
+    static thread_local TraceBuffer* local;
+    static int dumps;
+    static TraceBuffer* buffer();
+  public:
+    static void enable(bool on) { enabled.store(on, std::memory_order_relaxed); }
+    static bool isEnabled() { return enabled.load(std::memory_order_relaxed); }
+    static long long now() { return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - epoch).count(); }
+    static void record(const char* name, long long start, long long end) { buffer()->push(TraceEvent{ name, start, end - start }); }
+    // Shown instead of the thread id
+    static void nameThread(const char* name) { buffer()->threadName = name; }
+    // Events that ended after since. Threads still recording may overwrite the oldest
+    // events meanwhile, so call it between frames while the workers are idle.
+    static bool write(const char* filename, long long since = 0);
+    // Writes to the next free trace_000.json
+    static bool dump(const char* reason, long long since = 0);
+};
+
+std::atomic<bool> Tracer::enabled(false);
+Tracer::Clock::time_point Tracer::epoch = Tracer::Clock::now();
+std::mutex Tracer::mutex;
+std::vector<TraceBuffer*> Tracer::buffers;
+thread_local TraceBuffer* Tracer::local = nullptr;
+int Tracer::dumps = 0;
+
+TraceBuffer* Tracer::buffer()
+{
+  if (!local) {
+    std::lock_guard<std::mutex> lock(mutex);
+    local = new TraceBuffer(buffers.size() + 1);
+    buffers.push_back(local);
+  }
+  return local;
+}
+
+bool Tracer::write(const char* filename, long long since)
+{
+  FILE* f = fopen(filename, "w");
+  if (!f) return false;
+  std::lock_guard<std::mutex> lock(mutex);
+  fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  bool first = true;
+  for(TraceBuffer* b : buffers) {
+    char name[64];
+    snprintf(name, sizeof(name), "%s %i", b->threadName ? b->threadName : "thread", b->tid);
+    fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%i,\"args\":{\"name\":\"%s\"}}", first ? "" : ",\n", b->tid, name);
+    first = false;
+    unsigned long long n = b->written.load(std::memory_order_acquire);
+    unsigned long long oldest = n > TRACE_BUFFER_EVENTS ? n - TRACE_BUFFER_EVENTS : 0;
+    for(unsigned long long i=oldest; i<n; i++) {
+      const TraceEvent &e = b->events[i % TRACE_BUFFER_EVENTS];
+      if (e.start + e.duration < since) continue;
+      fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%i,\"ts\":%.3f,\"dur\":%.3f}", e.name, b->tid, e.start / 1e3, e.duration / 1e3);
+    }
+  }
+  fprintf(f, "\n]}\n");
+  bool ok = !ferror(f);
+  fclose(f);
+  return ok;
+}
+
+bool Tracer::dump(const char* reason, long long since)
+{
+  char filename[32];
+  snprintf(filename, sizeof(filename), "trace_%03i.json", dumps++);
+  if (!write(filename, since)) {
+    logError("Could not write %s", filename);
+    return false;
+  }
+  logInfo("%s, trace written to %s", reason, filename);
+  return true;
+}
+
+// Records the enclosing block while tracing is enabled
+class TraceScope {
+  private:
+    const char* name;
+    long long start;
+  public:
+    TraceScope(const char* name) : name(name), start(Tracer::isEnabled() ? Tracer::now() : -1) {}
+    ~TraceScope() { if (start >= 0) Tracer::record(name, start, Tracer::now()); }
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+};
+
+// Writes the last frames when one takes much longer than the average before it
+class SpikeTrigger {
+  private:
+    long long starts[TRACE_SPIKE_FRAMES];
+    int frames, cooldown;
+    double average;
+  public:
+    SpikeTrigger() : frames(0), cooldown(0), average(0) {}
+    // Called once per frame with its start and end from Tracer::now
+    void frame(long long start, long long end);
+};
+
+void SpikeTrigger::frame(long long start, long long end)
+{
+  starts[frames++ % TRACE_SPIKE_FRAMES] = start;
+  double ms = (end - start) / 1e6;
+  if (cooldown > 0) cooldown--;
+  else if (frames > TRACE_SPIKE_FRAMES && ms > average * TRACE_SPIKE_FACTOR) {
+    char reason[64];
+    snprintf(reason, sizeof(reason), "Frame of %.1f ms, average %.1f ms", ms, average);
+    // The oldest start still in the ring
+    Tracer::dump(reason, starts[frames % TRACE_SPIKE_FRAMES]);
+    cooldown = TRACE_SPIKE_COOLDOWN;
+  }
+  // A spike hardly moves the average, so the next frames are not compared to it
+  average = frames == 1 ? ms : average * 0.95 + ms * 0.05;
+}
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+// Defining TRACE_DISABLED compiles every trace scope away
+#ifdef TRACE_DISABLED
+#define TRACE_SCOPE(name)
+#else
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(traceScope, __LINE__)(name)
+#endif
+
+#endif
@@ -0,0 +1,248 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include <vector>
+#include <algorithm>
+#include "vec.h"
+
+// Batched transforms over structure of arrays inputs, 8 elements at a time with AVX,
+// 4 with SSE and one at a time otherwise. The same kernel body is instantiated for
+// every width, relying on the vector extensions of GCC and Clang for the arithmetic.
+
+struct Vector3Array {
+  std::vector<float> x, y, z;
+  size_t size() const { return x.size(); }
+  void resize(size_t n) { x.resize(n); y.resize(n); z.resize(n); }
+  void clear() { x.clear(); y.clear(); z.clear(); }
+  void push_back(const Vector3 &v) { x.push_back(v.x); y.push_back(v.y); z.push_back(v.z); }
+  void set(size_t i, const Vector3 &v) { x[i] = v.x; y[i] = v.y; z[i] = v.z; }
+  Vector3 operator[] (size_t i) const { return Vector3(x[i], y[i], z[i]); }
+};
+
+struct AABBArray {
+  Vector3Array min, max;
+  size_t size() const { return min.size(); }
+  void resize(size_t n) { min.resize(n); max.resize(n); }
+  void push_back(const AABB &box) { min.push_back(box.min); max.push_back(box.max); }
+  AABB operator[] (size_t i) const { return AABB(min[i], max[i]); }
+};
+
+template <typename T> inline T lanes(float s);
+template <typename T> inline T lanesLoad(const float* p);
+template <> inline float lanes<float>(float s) { return s; }
+template <> inline float lanesLoad<float>(const float* p) { return *p; }
+inline void lanesStore(float* p, float v) { *p = v; }
+inline float lanesAbs(float v) { return fabsf(v); }
+// One bit per lane of a comparison
+inline int lanesBits(int m) { return m != 0; }
+
+#ifdef VEC_SSE
+template <> inline __m128 lanes<__m128>(float s) { return _mm_set1_ps(s); }
+template <> inline __m128 lanesLoad<__m128>(const float* p) { return _mm_loadu_ps(p); }
+inline void lanesStore(float* p, __m128 v) { _mm_storeu_ps(p, v); }
+inline __m128 lanesAbs(__m128 v) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), v); }
+typedef int lanesMask4 __attribute__((vector_size(16)));
+inline int lanesBits(lanesMask4 m) { return _mm_movemask_ps((__m128)m); }
+#endif
+#if defined(VEC_SSE) && defined(__AVX__)
+template <> inline __m256 lanes<__m256>(float s) { return _mm256_set1_ps(s); }
+template <> inline __m256 lanesLoad<__m256>(const float* p) { return _mm256_loadu_ps(p); }
+inline void lanesStore(float* p, __m256 v) { _mm256_storeu_ps(p, v); }
+inline __m256 lanesAbs(__m256 v) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), v); }
+typedef int lanesMask8 __attribute__((vector_size(32)));
+inline int lanesBits(lanesMask8 m) { return _mm256_movemask_ps((__m256)m); }
+typedef __m256 batch;
+#define BATCH_WIDTH 8
+#elif defined(VEC_SSE)
+typedef __m128 batch;
+#define BATCH_WIDTH 4
+#else
+typedef float batch;
+#define BATCH_WIDTH 1
+#endif
+template <typename T> inline T lanesMax(T a, T b) { return a > b ? a : b; }
+template <typename T> inline T lanesMin(T a, T b) { return a < b ? a : b; }
+// 0, 1, 2... across the lanes
+template <typename T> inline T lanesIndex() {
+  alignas(32) static const float index[8] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+  return lanesLoad<T>(index);
+}
+
+// Element i and the BATCH_WIDTH elements after it, w is 1 for points and 0 for directions
+template <typename T>
+inline void transformLanes(const Matrix4 &m, float w, const float* x, const float* y, const float* z,
+                           float* ox, float* oy, float* oz, size_t i)
+{
+  T px = lanesLoad<T>(x + i), py = lanesLoad<T>(y + i), pz = lanesLoad<T>(z + i);
+  T rx = lanes<T>(m[0][0]) * px + lanes<T>(m[1][0]) * py + lanes<T>(m[2][0]) * pz + lanes<T>(m[3][0] * w);
+  T ry = lanes<T>(m[0][1]) * px + lanes<T>(m[1][1]) * py + lanes<T>(m[2][1]) * pz + lanes<T>(m[3][1] * w);
+  T rz = lanes<T>(m[0][2]) * px + lanes<T>(m[1][2]) * py + lanes<T>(m[2][2]) * pz + lanes<T>(m[3][2] * w);
+  lanesStore(ox + i, rx);
+  lanesStore(oy + i, ry);
+  lanesStore(oz + i, rz);
+}
+
+// Transforms the center and projects the half extents onto every world axis (Arvo)
+template <typename T>
+inline void transformAABBLanes(const Matrix4 &m, const AABBArray &in, AABBArray &out, size_t i)
+{
+  T half = lanes<T>(0.5f);
+  T minX = lanesLoad<T>(&in.min.x[i]), minY = lanesLoad<T>(&in.min.y[i]), minZ = lanesLoad<T>(&in.min.z[i]);
+  T maxX = lanesLoad<T>(&in.max.x[i]), maxY = lanesLoad<T>(&in.max.y[i]), maxZ = lanesLoad<T>(&in.max.z[i]);
+  T cx = (minX + maxX) * half, cy = (minY + maxY) * half, cz = (minZ + maxZ) * half;
+  T ex = (maxX - minX) * half, ey = (maxY - minY) * half, ez = (maxZ - minZ) * half;
+  float* omin[3] = { &out.min.x[i], &out.min.y[i], &out.min.z[i] };
+  float* omax[3] = { &out.max.x[i], &out.max.y[i], &out.max.z[i] };
+  for(int r=0; r<3; r++) {
+    T c = lanes<T>(m[0][r]) * cx + lanes<T>(m[1][r]) * cy + lanes<T>(m[2][r]) * cz + lanes<T>(m[3][r]);
+    T e = lanesAbs(lanes<T>(m[0][r])) * ex + lanesAbs(lanes<T>(m[1][r])) * ey + lanesAbs(lanes<T>(m[2][r])) * ez;
+    lanesStore(omin[r], c - e);
+    lanesStore(omax[r], c + e);
+  }
+}
+
+// Output arrays may alias the inputs
+void transformPoints(const Matrix4 &m, const float* x, const float* y, const float* z,
+                     float* ox, float* oy, float* oz, size_t n)
+{
+  size_t i = 0;
+  for(; i + BATCH_WIDTH <= n; i += BATCH_WIDTH) transformLanes<batch>(m, 1, x, y, z, ox, oy, oz, i);
+  for(; i < n; i++) transformLanes<float>(m, 1, x, y, z, ox, oy, oz, i);
+}
+
+void transformDirections(const Matrix4 &m, const float* x, const float* y, const float* z,
+                         float* ox, float* oy, float* oz, size_t n)
+{
+  size_t i = 0;
+  for(; i + BATCH_WIDTH <= n; i += BATCH_WIDTH) transformLanes<batch>(m, 0, x, y, z, ox, oy, oz, i);
+  for(; i < n; i++) transformLanes<float>(m, 0, x, y, z, ox, oy, oz, i);
+}
+
+void transformPoints(const Matrix4 &m, const Vector3Array &in, Vector3Array &out)
+{
+  out.resize(in.size());
+  transformPoints(m, in.x.data(), in.y.data(), in.z.data(), out.x.data(), out.y.data(), out.z.data(), in.size());
+}
+
+void transformDirections(const Matrix4 &m, const Vector3Array &in, Vector3Array &out)
+{
+  out.resize(in.size());
+  transformDirections(m, in.x.data(), in.y.data(), in.z.data(), out.x.data(), out.y.data(), out.z.data(), in.size());
+}
+
+// World bounds of boxes placed by an affine m
+void transformAABBs(const Matrix4 &m, const AABBArray &in, AABBArray &out)
+{
+  size_t n = in.size();
+  out.resize(n);
+  size_t i = 0;
+  for(; i + BATCH_WIDTH <= n; i += BATCH_WIDTH) transformAABBLanes<batch>(m, in, out, i);
+  for(; i < n; i++) transformAABBLanes<float>(m, in, out, i);
+}
+
+AABB transformAABB(const Matrix4 &m, const AABB &box)
+{
+  Vector3 c = box.center(), e = box.extent() * 0.5f;
+  Vector3 wc = Vector3(m[0][0] * c.x + m[1][0] * c.y + m[2][0] * c.z + m[3][0],
+                       m[0][1] * c.x + m[1][1] * c.y + m[2][1] * c.z + m[3][1],
+                       m[0][2] * c.x + m[1][2] * c.y + m[2][2] * c.z + m[3][2]);
+  Vector3 we = Vector3(fabsf(m[0][0]) * e.x + fabsf(m[1][0]) * e.y + fabsf(m[2][0]) * e.z,
+                       fabsf(m[0][1]) * e.x + fabsf(m[1][1]) * e.y + fabsf(m[2][1]) * e.z,
+                       fabsf(m[0][2]) * e.x + fabsf(m[1][2]) * e.y + fabsf(m[2][2]) * e.z);
+  return AABB(wc - we, wc + we);
+}
+
+// out[i] = m * in[i], out may alias in
+void transformMatrices(const Matrix4 &m, const Matrix4* in, Matrix4* out, size_t n)
+{
+  for(size_t i=0; i<n; i++) out[i] = m * in[i];
+}
+
+// Placement of an object relative to its parent, the world matrix is cached and only
+// rebuilt after the object or one of its ancestors changed.
+class Transform {
+  private:
+    Vector3 position, anchor, scale;
+    Quaternion rotation;
+    Transform* parent;
+    std::vector<Transform*> children;
+    mutable Affine3 world;
+    // Set on every descendant of a dirty transform as well
+    mutable bool dirty;
+    void invalidate();
+  public:
+    // World matrices rebuilt by the calling thread
+    static thread_local unsigned long long recomputations;
+
+    Transform(Vector3 scale = Vector3(1)) : scale(scale), parent(nullptr), dirty(true) {}
+    ~Transform();
+    // Hierarchies hold pointers to their members
+    Transform(const Transform&) = delete;
+    Transform& operator=(const Transform&) = delete;
+
+    const Vector3& getPosition() const { return position; }
+    const Quaternion& getRotation() const { return rotation; }
+    const Vector3& getAnchor() const { return anchor; }
+    const Vector3& getScale() const { return scale; }
+    void setPosition(const Vector3 &v) { position = v; invalidate(); }
+    // Applied around the anchor
+    void setRotation(const Quaternion &q) { rotation = q; invalidate(); }
+    void setAnchor(const Vector3 &v) { anchor = v; invalidate(); }
+    void setScale(const Vector3 &v) { scale = v; invalidate(); }
+    void translate(const Vector3 &d) { setPosition(position + d); }
+    // Rotates by q after the current rotation
+    void rotate(const Quaternion &q) { setRotation((q * rotation).normalized()); }
+
+    Transform* getParent() const { return parent; }
+    void setParent(Transform* p);
+    Affine3 getLocal() const;
+    const Affine3& getWorld() const;
+};
+thread_local unsigned long long Transform::recomputations = 0;
+
+Transform::~Transform()
+{
+  setParent(nullptr);
+  for(Transform* child : children) {
+    child->parent = nullptr;
+    child->invalidate();
+  }
+}
+
+void Transform::invalidate()
+{
+  if (dirty) return;
+  dirty = true;
+  for(Transform* child : children) child->invalidate();
+}
+
+void Transform::setParent(Transform* p)
+{
+  if (parent) parent->children.erase(std::find(parent->children.begin(), parent->children.end(), this));
+  parent = p;
+  if (parent) parent->children.push_back(this);
+  invalidate();
+}
+
+// Translation * Anchor^-1 * Rotation * Anchor * Scale, written out instead of multiplied
+Affine3 Transform::getLocal() const
+{
+  Affine3 m = Affine3(rotation.toMatrix());
+  const float s[3] = { scale.x, scale.y, scale.z };
+  for(int r=0; r<3; r++)
+    for(int c=0; c<3; c++) m.at(r, c) *= s[c];
+  m.setTranslation(position - anchor + rotation.rotate(anchor));
+  return m;
+}
+
+const Affine3& Transform::getWorld() const
+{
+  if (dirty) {
+    world = parent ? parent->getWorld() * getLocal() : getLocal();
+    dirty = false;
+    recomputations++;
+  }
+  return world;
+}
+
+#endif
@@ -1,6 +1,10 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <string.h>
+#include <algorithm>
+#include <type_traits>
+
 #define PI 3.141592536
 
 template <typename T>
@@ -23,4 +27,17 @@ int signum(T x) {
     return signum(x, std::is_signed<T>());
 }
 
+// Removes name and the values after it from argv, returns whether it was there
+bool takeOption(int &argc, char** argv, const char* name, int values, const char** value = nullptr)
+{
+  for(int i=1; i<argc - values; i++) {
+    if (strcmp(argv[i], name) != 0) continue;
+    if (value) *value = argv[i + 1];
+    for(int k=i; k<=argc - values - 1; k++) argv[k] = argv[k + values + 1];
+    argc -= values + 1;
+    return true;
+  }
+  return false;
+}
+
 #endif
@@ -1,71 +1,86 @@
 #ifndef VEC_H
 #define VEC_H
 
+#include <stdio.h>
 #include <cmath>
 #include <exception>
 #include <limits>
 #include <array>
+#include <algorithm>
 #include "utils.h"
 #include "linmath.h"
 
+// Matrix4 and Vector4 use SSE on x86, along with AVX and FMA when the target has
+// them. Define VEC_SCALAR to use the plain linmath code instead.
+#if !defined(VEC_SCALAR) && (defined(__SSE2__) || defined(_M_X64))
+#define VEC_SSE
+#include <immintrin.h>
+#endif
+
+// The small operators are inlined even in unoptimized builds, where calling them
+// costs more than the arithmetic. They are constexpr so constant vectors and
+// transforms fold at compile time. The default constructors are not, GCC clears
+// constexpr zeroed arrays as a block that later stores no longer eliminate.
+#ifdef __GNUC__
+#define VEC_INLINE __attribute__((always_inline)) inline
+#else
+#define VEC_INLINE inline
+#endif
+
 class Vector2 {
 public:
   float x, y;
-  Vector2() : x(0), y(0) {}
-  Vector2(float a) : x(a), y(a) {}
-  Vector2(float x, float y) : x(x), y(y) {}
+  VEC_INLINE Vector2() : x(0), y(0) {}
+  VEC_INLINE constexpr Vector2(float a) : x(a), y(a) {}
+  VEC_INLINE constexpr Vector2(float x, float y) : x(x), y(y) {}
 
   Vector2& normalize() { float l = length(); x/=l; y/=l; return *this; }
   float length() const { return sqrt(x*x + y*y); }
-  Vector2 operator * (const Vector2 &o) const { return Vector2(x*o.x, y*o.y); } 
-  Vector2 operator * (float s) const    { return Vector2(x*s, y*s);     }
-  Vector2 operator / (const Vector2 &o) const { return Vector2(x/o.x, y/o.y); } 
-  Vector2 operator + (const Vector2 &o) const { return Vector2(x+o.x, y+o.y); } 
-  Vector2& operator += (const Vector2 &o) { x += o.x; y += o.y; return *this; } 
-  Vector2 operator - (const Vector2 &o) const { return Vector2(x-o.x, y-o.y); } 
-  Vector2& operator -= (const Vector2 &o) { x -= o.x; y -= o.y; return *this; }
-  Vector2 operator - () const { return Vector2(-x, -y); }
+  VEC_INLINE constexpr Vector2 operator * (const Vector2 &o) const { return Vector2(x*o.x, y*o.y); } 
+  VEC_INLINE constexpr Vector2 operator * (float s) const    { return Vector2(x*s, y*s);     }
+  VEC_INLINE constexpr Vector2 operator / (const Vector2 &o) const { return Vector2(x/o.x, y/o.y); } 
+  VEC_INLINE constexpr Vector2 operator + (const Vector2 &o) const { return Vector2(x+o.x, y+o.y); } 
+  VEC_INLINE constexpr Vector2& operator += (const Vector2 &o) { x += o.x; y += o.y; return *this; } 
+  VEC_INLINE constexpr Vector2 operator - (const Vector2 &o) const { return Vector2(x-o.x, y-o.y); } 
+  VEC_INLINE constexpr Vector2& operator -= (const Vector2 &o) { x -= o.x; y -= o.y; return *this; }
+  VEC_INLINE constexpr Vector2 operator - () const { return Vector2(-x, -y); }
   void print() { printf("(%f, %f)\n", x, y); }
 };
 
-
 class Vector3 {
 public:
   float x, y, z;
-  Vector3() : x(0), y(0), z(0) {}
-  Vector3(float a) : x(a), y(a), z(a) {}
-  Vector3(float x, float y, float z) : x(x), y(y), z(z) {}
+  VEC_INLINE Vector3() : x(0), y(0), z(0) {}
+  VEC_INLINE constexpr Vector3(float a) : x(a), y(a), z(a) {}
+  VEC_INLINE constexpr Vector3(float x, float y, float z) : x(x), y(y), z(z) {}
 
   Vector3& normalize() { float l = length(); x/=l; y/=l; z/=l; return *this; }
   Vector3 normalized() const { float l = length(); return Vector3(x/l, y/l, z/l); }
   float length() const { return sqrt(x*x + y*y + z*z); }
-  static Vector3 cross(const Vector3 &a, const Vector3 &b) {
-    vec3 v;
-    vec3 va = { a.x, a.y, a.z };
-    vec3 vb = { b.x, b.y, b.z };
-    vec3_mul_cross(v, va, vb);
-    return Vector3(v[0], v[1], v[2]);
-  }
-  static float dot(const Vector3 &a, const Vector3 &b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
-  float sq_length() const { return dot(*this, *this); }
+  // Same as vec3_mul_cross, without copying into linmath arrays
+  VEC_INLINE static constexpr Vector3 cross(const Vector3 &a, const Vector3 &b) {
+    return Vector3(a.y*b.z - a.z*b.y, a.z*b.x - a.x*b.z, a.x*b.y - a.y*b.x);
+  }
+  VEC_INLINE static constexpr float dot(const Vector3 &a, const Vector3 &b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+  VEC_INLINE constexpr float sq_length() const { return dot(*this, *this); }
   float largestComponent() const { 
     if (x >= y && x >= z) return x;
     if (y >= x && y >= z) return y;
     if (z >= x && z >= y) return z; 
   }
-  Vector3 operator * (const Vector3 &o) const { return Vector3(x*o.x, y*o.y, z*o.z); } 
-  Vector3 operator * (float s) const    { return Vector3(x*s, y*s, z*s);       }
-  Vector3& operator *= (float s) { x*=s; y*=s; z*=s; return *this; }
-  Vector3 operator / (const Vector3 &o) const { 
+  VEC_INLINE constexpr Vector3 operator * (const Vector3 &o) const { return Vector3(x*o.x, y*o.y, z*o.z); } 
+  VEC_INLINE constexpr Vector3 operator * (float s) const    { return Vector3(x*s, y*s, z*s);       }
+  VEC_INLINE constexpr Vector3& operator *= (float s) { x*=s; y*=s; z*=s; return *this; }
+  VEC_INLINE constexpr Vector3 operator / (const Vector3 &o) const { 
     float nx = o.x == 0 ? 0 : x/o.x;
     float ny = o.y == 0 ? 0 : y/o.y;
     float nz = o.z == 0 ? 0 : z/o.z;
     return Vector3(nx, ny, nz); }
-  Vector3 operator + (const Vector3 &o) const { return Vector3(x+o.x, y+o.y, z+o.z); } 
-  Vector3& operator += (const Vector3 &o) { x += o.x; y += o.y; z += o.z; return *this; }
-  Vector3 operator - (const Vector3 &o) const { return Vector3(x-o.x, y-o.y, z-o.z); }
-  Vector3& operator -= (const Vector3 &o) { x -= o.x; y -= o.y; z -= o.z; return *this; }
-  Vector3 operator - () const { return Vector3(-x, -y, -z); }
+  VEC_INLINE constexpr Vector3 operator + (const Vector3 &o) const { return Vector3(x+o.x, y+o.y, z+o.z); } 
+  VEC_INLINE constexpr Vector3& operator += (const Vector3 &o) { x += o.x; y += o.y; z += o.z; return *this; }
+  VEC_INLINE constexpr Vector3 operator - (const Vector3 &o) const { return Vector3(x-o.x, y-o.y, z-o.z); }
+  VEC_INLINE constexpr Vector3& operator -= (const Vector3 &o) { x -= o.x; y -= o.y; z -= o.z; return *this; }
+  VEC_INLINE constexpr Vector3 operator - () const { return Vector3(-x, -y, -z); }
   void print() const { printf("(%f, %f, %f)\n", x, y, z); }
 
   static Vector3 reflect(const Vector3 &a, const Vector3 &n) {
@@ -78,64 +93,138 @@ public:
 };
 
 //Commutative mapping
-Vector3 operator * (float s, const Vector3 &o) { return o * s; }
+VEC_INLINE constexpr Vector3 operator * (float s, const Vector3 &o) { return o * s; }
 
-class Vector4 {
+class alignas(16) Vector4 {
 public:
   float x, y, z, w;
-  Vector4() : x(0), y(0), z(0), w(0) {};
-  Vector4(float a) : x(a), y(a), z(a), w(a) {}
-  Vector4(float x, float y, float z, float w) : x(x), y(y), z(z), w(w) {}
-  Vector4(Vector3 a, float w) : Vector4(a.x, a.y, a.z, w) {}
+  VEC_INLINE Vector4() : x(0), y(0), z(0), w(0) {};
+  VEC_INLINE constexpr Vector4(float a) : x(a), y(a), z(a), w(a) {}
+  VEC_INLINE constexpr Vector4(float x, float y, float z, float w) : x(x), y(y), z(z), w(w) {}
+  VEC_INLINE constexpr Vector4(Vector3 a, float w) : Vector4(a.x, a.y, a.z, w) {}
+#ifdef VEC_SSE
+  VEC_INLINE Vector4(__m128 v) { _mm_store_ps(&x, v); }
+  // Built from the components rather than loaded, a load right after the components
+  // were written one by one would stall on store forwarding
+  VEC_INLINE __m128 simd() const { return _mm_setr_ps(x, y, z, w); }
+#endif
 
-  Vector3 xyz() const { return Vector3(x, y, z); }
+  VEC_INLINE constexpr Vector3 xyz() const { return Vector3(x, y, z); }
 };
 
+#ifdef VEC_SSE
+// a * b + c, fused into a single instruction where the target has FMA
+inline __m128 vec_madd(__m128 a, __m128 b, __m128 c) {
+#ifdef __FMA__
+  return _mm_fmadd_ps(a, b, c);
+#else
+  return _mm_add_ps(_mm_mul_ps(a, b), c);
+#endif
+}
+#ifdef __AVX__
+inline __m256 vec_madd(__m256 a, __m256 b, __m256 c) {
+#ifdef __FMA__
+  return _mm256_fmadd_ps(a, b, c);
+#else
+  return _mm256_add_ps(_mm256_mul_ps(a, b), c);
+#endif
+}
+#endif
+#define VEC_SHUFFLE(a, b, x, y, z, w) _mm_shuffle_ps(a, b, _MM_SHUFFLE(w, z, y, x))
+#define VEC_SWIZZLE(a, x, y, z, w) VEC_SHUFFLE(a, a, x, y, z, w)
+
+// 2x2 matrices packed in a single register as (m00, m01, m10, m11)
+// A * B
+inline __m128 vec_mat2Mul(__m128 a, __m128 b) {
+  return _mm_add_ps(_mm_mul_ps(a, VEC_SWIZZLE(b, 0, 3, 0, 3)), _mm_mul_ps(VEC_SWIZZLE(a, 1, 0, 3, 2), VEC_SWIZZLE(b, 2, 1, 2, 1)));
+}
+// adj(A) * B
+inline __m128 vec_mat2AdjMul(__m128 a, __m128 b) {
+  return _mm_sub_ps(_mm_mul_ps(VEC_SWIZZLE(a, 3, 3, 0, 0), b), _mm_mul_ps(VEC_SWIZZLE(a, 1, 1, 2, 2), VEC_SWIZZLE(b, 2, 3, 0, 1)));
+}
+// A * adj(B)
+inline __m128 vec_mat2MulAdj(__m128 a, __m128 b) {
+  return _mm_sub_ps(_mm_mul_ps(a, VEC_SWIZZLE(b, 3, 0, 3, 0)), _mm_mul_ps(VEC_SWIZZLE(a, 1, 0, 3, 2), VEC_SWIZZLE(b, 2, 1, 2, 1)));
+}
+#endif
+
+// True while the compiler folds a constant expression, where the SIMD paths cannot run
+#ifdef __GNUC__
+#define VEC_CONSTANT_EVALUATED() __builtin_is_constant_evaluated()
+#else
+#define VEC_CONSTANT_EVALUATED() false
+#endif
+
+// Column major like linmath, which remains the backend when VEC_SCALAR is defined
+// or the target has no SSE.
 class Matrix4 {
 private:
-  mat4x4 data;
-public:
-  Matrix4() {}
-  Matrix4(const mat4x4 data) { mat4x4_dup(this->data, data); }
-  Matrix4(const Matrix4 &m) : Matrix4(m.data) {}
-  void unpack(mat4x4 f) const { mat4x4_dup(f, data); }
-  float* operator[] (int column) { return data[column]; }
-  Matrix4 inverted() const { mat4x4 r; mat4x4_invert(r, data); return Matrix4(r); }
-  Vector4 operator* (const Vector4 &o) const {
+  alignas(16) mat4x4 data;
+#ifdef VEC_SSE
+  __m128 column(int i) const { return _mm_load_ps(data[i]); }
+  void setColumn(int i, __m128 v) { _mm_store_ps(data[i], v); }
+  // Linear combination of the columns weighted by the components of v
+  __m128 transform(__m128 v) const {
+    __m128 r = _mm_mul_ps(column(0), VEC_SWIZZLE(v, 0, 0, 0, 0));
+    r = vec_madd(column(1), VEC_SWIZZLE(v, 1, 1, 1, 1), r);
+    r = vec_madd(column(2), VEC_SWIZZLE(v, 2, 2, 2, 2), r);
+    return vec_madd(column(3), VEC_SWIZZLE(v, 3, 3, 3, 3), r);
+  }
+#endif
+  Vector4 mul(const Vector4 &o) const {
+#ifdef VEC_SSE
+    return Vector4(transform(o.simd()));
+#else
     vec4 r;
     vec4 i = { o.x, o.y, o.z, o.w };
     mat4x4_mul_vec4(r, data, i);
     return Vector4(r[0], r[1], r[2], r[3]);
+#endif
   }
-  Matrix4 operator * (const Matrix4 &o) const {
-    mat4x4 r;
-    mat4x4_mul(r, data, o.data);
-    return Matrix4(r);
+  Matrix4 mul(const Matrix4 &o) const;
+  VEC_INLINE constexpr Vector4 col(int i) const { return Vector4(data[i][0], data[i][1], data[i][2], data[i][3]); }
+public:
+  Matrix4() {}
+  Matrix4(const mat4x4 data) { mat4x4_dup(this->data, data); }
+  VEC_INLINE constexpr Matrix4(const Vector4 &c0, const Vector4 &c1, const Vector4 &c2, const Vector4 &c3)
+    : data{ { c0.x, c0.y, c0.z, c0.w }, { c1.x, c1.y, c1.z, c1.w }, { c2.x, c2.y, c2.z, c2.w }, { c3.x, c3.y, c3.z, c3.w } } {}
+  Matrix4(const Matrix4 &m) = default;
+  Matrix4& operator = (const Matrix4 &m) = default;
+  void unpack(mat4x4 f) const { mat4x4_dup(f, data); }
+  VEC_INLINE constexpr float* operator[] (int column) { return data[column]; }
+  VEC_INLINE constexpr const float* operator[] (int column) const { return data[column]; }
+  Matrix4 inverted() const;
+  VEC_INLINE constexpr Vector4 operator* (const Vector4 &o) const {
+    if (VEC_CONSTANT_EVALUATED())
+      return Vector4(data[0][0] * o.x + data[1][0] * o.y + data[2][0] * o.z + data[3][0] * o.w,
+                     data[0][1] * o.x + data[1][1] * o.y + data[2][1] * o.z + data[3][1] * o.w,
+                     data[0][2] * o.x + data[1][2] * o.y + data[2][2] * o.z + data[3][2] * o.w,
+                     data[0][3] * o.x + data[1][3] * o.y + data[2][3] * o.z + data[3][3] * o.w);
+    return mul(o);
   }
-  static Matrix4 Identity() { mat4x4 r; mat4x4_identity(r); return Matrix4(r); } 
-  static Matrix4 FromTranslation(float x, float y, float z) {
-    mat4x4 r;
-    mat4x4_translate(r, x, y, z);
-    return Matrix4(r);
+  constexpr Matrix4 operator * (const Matrix4 &o) const {
+    if (VEC_CONSTANT_EVALUATED())
+      return Matrix4(*this * o.col(0), *this * o.col(1), *this * o.col(2), *this * o.col(3));
+    return mul(o);
   }
-  static Matrix4 FromTranslation(Vector3 v) { return FromTranslation(v.x, v.y, v.z); }
-  static Matrix4 FromScale(float x, float y, float z) {
-    mat4x4 r;
-    mat4x4_identity(r);
-    mat4x4_scale_aniso(r, r, x, y, z);
-    return Matrix4(r);
+  static constexpr Matrix4 Identity() { return FromScale(1, 1, 1); }
+  static constexpr Matrix4 FromTranslation(float x, float y, float z) {
+    return Matrix4(Vector4(1, 0, 0, 0), Vector4(0, 1, 0, 0), Vector4(0, 0, 1, 0), Vector4(x, y, z, 1));
+  }
+  static constexpr Matrix4 FromTranslation(Vector3 v) { return FromTranslation(v.x, v.y, v.z); }
+  static constexpr Matrix4 FromScale(float x, float y, float z) {
+    return Matrix4(Vector4(x, 0, 0, 0), Vector4(0, y, 0, 0), Vector4(0, 0, z, 0), Vector4(0, 0, 0, 1));
   }
-  static Matrix4 FromScale(Vector3 v) { return FromScale(v.x, v.y, v.z); }
+  static constexpr Matrix4 FromScale(Vector3 v) { return FromScale(v.x, v.y, v.z); }
   static Matrix4 FromAxisRotations(float xr, float yr, float zr) {
-    mat4x4 rx, ry, rz, i;
-    mat4x4_identity(i);
-    mat4x4_rotate_X(rx, i, xr);
-    mat4x4_rotate_Y(ry, i, yr);
-    mat4x4_rotate_Z(rz, i, zr);
-    Matrix4 Rx = Matrix4(rx);
-    Matrix4 Ry = Matrix4(ry);
-    Matrix4 Rz = Matrix4(rz);
-    return Rx * Ry * Rz;
+    // Same matrices as mat4x4_rotate_X/Y/Z applied to the identity, without multiplying by it
+    float sx = sinf(xr), cx = cosf(xr);
+    float sy = sinf(yr), cy = cosf(yr);
+    float sz = sinf(zr), cz = cosf(zr);
+    mat4x4 rx = { { 1, 0, 0, 0 }, { 0, cx, sx, 0 }, { 0, -sx, cx, 0 }, { 0, 0, 0, 1 } };
+    mat4x4 ry = { { cy, 0, sy, 0 }, { 0, 1, 0, 0 }, { -sy, 0, cy, 0 }, { 0, 0, 0, 1 } };
+    mat4x4 rz = { { cz, sz, 0, 0 }, { -sz, cz, 0, 0 }, { 0, 0, 1, 0 }, { 0, 0, 0, 1 } };
+    return Matrix4(rx) * Matrix4(ry) * Matrix4(rz);
   }
   static Matrix4 FromAxisRotations(Vector3 v) { return FromAxisRotations(v.x, v.y, v.z); }
   static Matrix4 FromPerspective(float fov, float ratio, float znear, float zfar) {
@@ -151,13 +240,356 @@ public:
   }
 };
 
+Matrix4 Matrix4::mul(const Matrix4 &o) const
+{
+  Matrix4 r;
+#if defined(VEC_SSE) && defined(__AVX__)
+  // Two columns of the result at once, each lane broadcasts its own column of o
+  __m256 a0 = _mm256_broadcast_ps((const __m128*)data[0]);
+  __m256 a1 = _mm256_broadcast_ps((const __m128*)data[1]);
+  __m256 a2 = _mm256_broadcast_ps((const __m128*)data[2]);
+  __m256 a3 = _mm256_broadcast_ps((const __m128*)data[3]);
+  for(int c=0; c<4; c+=2) {
+    __m256 b = _mm256_loadu_ps(o.data[c]);
+#ifdef __FMA__
+    __m256 v = _mm256_mul_ps(a0, _mm256_permute_ps(b, 0x00));
+    v = _mm256_fmadd_ps(a1, _mm256_permute_ps(b, 0x55), v);
+    v = _mm256_fmadd_ps(a2, _mm256_permute_ps(b, 0xaa), v);
+    v = _mm256_fmadd_ps(a3, _mm256_permute_ps(b, 0xff), v);
+#else
+    __m256 v = _mm256_add_ps(_mm256_mul_ps(a0, _mm256_permute_ps(b, 0x00)), _mm256_mul_ps(a1, _mm256_permute_ps(b, 0x55)));
+    v = _mm256_add_ps(v, _mm256_add_ps(_mm256_mul_ps(a2, _mm256_permute_ps(b, 0xaa)), _mm256_mul_ps(a3, _mm256_permute_ps(b, 0xff))));
+#endif
+    _mm256_storeu_ps(r.data[c], v);
+  }
+#elif defined(VEC_SSE)
+  for(int c=0; c<4; c++) r.setColumn(c, transform(o.column(c)));
+#else
+  mat4x4_mul(r.data, data, o.data);
+#endif
+  return r;
+}
+
+// Block wise inverse over the 2x2 sub matrices. The block formulas hold for rows as
+// well as columns, since the inverse of the transpose is the transpose of the inverse.
+Matrix4 Matrix4::inverted() const
+{
+#ifdef VEC_SSE
+  __m128 c0 = column(0), c1 = column(1), c2 = column(2), c3 = column(3);
+  __m128 A = _mm_movelh_ps(c0, c1);
+  __m128 B = _mm_movehl_ps(c1, c0);
+  __m128 C = _mm_movelh_ps(c2, c3);
+  __m128 D = _mm_movehl_ps(c3, c2);
+
+  // (|A|, |B|, |C|, |D|)
+  __m128 detSub = _mm_sub_ps(_mm_mul_ps(VEC_SHUFFLE(c0, c2, 0, 2, 0, 2), VEC_SHUFFLE(c1, c3, 1, 3, 1, 3)),
+                             _mm_mul_ps(VEC_SHUFFLE(c0, c2, 1, 3, 1, 3), VEC_SHUFFLE(c1, c3, 0, 2, 0, 2)));
+  __m128 detA = VEC_SWIZZLE(detSub, 0, 0, 0, 0);
+  __m128 detB = VEC_SWIZZLE(detSub, 1, 1, 1, 1);
+  __m128 detC = VEC_SWIZZLE(detSub, 2, 2, 2, 2);
+  __m128 detD = VEC_SWIZZLE(detSub, 3, 3, 3, 3);
+
+  __m128 DC = vec_mat2AdjMul(D, C);
+  __m128 AB = vec_mat2AdjMul(A, B);
+  __m128 X = _mm_sub_ps(_mm_mul_ps(detD, A), vec_mat2Mul(B, DC));
+  __m128 W = _mm_sub_ps(_mm_mul_ps(detA, D), vec_mat2Mul(C, AB));
+  __m128 Y = _mm_sub_ps(_mm_mul_ps(detB, C), vec_mat2MulAdj(D, AB));
+  __m128 Z = _mm_sub_ps(_mm_mul_ps(detC, B), vec_mat2MulAdj(A, DC));
+
+  // |M| = |A||D| + |B||C| - tr(adj(A)B adj(D)C)
+  __m128 tr = _mm_mul_ps(AB, VEC_SWIZZLE(DC, 0, 2, 1, 3));
+  tr = _mm_add_ps(tr, VEC_SWIZZLE(tr, 2, 3, 0, 1));
+  tr = _mm_add_ps(tr, VEC_SWIZZLE(tr, 1, 0, 3, 2));
+  __m128 det = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(detA, detD), _mm_mul_ps(detB, detC)), tr);
+  __m128 rdet = _mm_div_ps(_mm_setr_ps(1, -1, -1, 1), det);
+  X = _mm_mul_ps(X, rdet);
+  Y = _mm_mul_ps(Y, rdet);
+  Z = _mm_mul_ps(Z, rdet);
+  W = _mm_mul_ps(W, rdet);
+
+  // Adjugate of every block, stored back as columns
+  Matrix4 r;
+  r.setColumn(0, VEC_SHUFFLE(X, Y, 3, 1, 3, 1));
+  r.setColumn(1, VEC_SHUFFLE(X, Y, 2, 0, 2, 0));
+  r.setColumn(2, VEC_SHUFFLE(Z, W, 3, 1, 3, 1));
+  r.setColumn(3, VEC_SHUFFLE(Z, W, 2, 0, 2, 0));
+  return r;
+#else
+  mat4x4 r;
+  mat4x4_invert(r, data);
+  return Matrix4(r);
+#endif
+}
+
+// Unit quaternion (x, y, z, w) holding a rotation, laid out like linmath's quat
+class alignas(16) Quaternion {
+public:
+  float x, y, z, w;
+  Quaternion() : x(0), y(0), z(0), w(1) {}
+  Quaternion(float x, float y, float z, float w) : x(x), y(y), z(z), w(w) {}
+#ifdef VEC_SSE
+  Quaternion(__m128 v) { _mm_store_ps(&x, v); }
+  __m128 simd() const { return _mm_setr_ps(x, y, z, w); }
+#endif
+
+  static Quaternion FromAxisAngle(Vector3 axis, float angle) {
+    quat r;
+    vec3 a = { axis.x, axis.y, axis.z };
+    quat_rotate(r, angle, a);
+    return Quaternion(r[0], r[1], r[2], r[3]);
+  }
+  // The same rotation as Matrix4::FromAxisRotations
+  static Quaternion FromAxisRotations(float xr, float yr, float zr) {
+    return FromAxisAngle(Vector3(1, 0, 0), xr) * FromAxisAngle(Vector3(0, 1, 0), -yr) * FromAxisAngle(Vector3(0, 0, 1), zr);
+  }
+  static Quaternion FromAxisRotations(Vector3 v) { return FromAxisRotations(v.x, v.y, v.z); }
+
+  // Rotates by o first, then by this
+  Quaternion operator * (const Quaternion &o) const;
+  Quaternion conjugate() const { return Quaternion(-x, -y, -z, w); }
+  static float dot(const Quaternion &a, const Quaternion &b) { return a.x*b.x + a.y*b.y + a.z*b.z + a.w*b.w; }
+  Quaternion normalized() const {
+    float l = 1.0f / sqrtf(dot(*this, *this));
+    return Quaternion(x*l, y*l, z*l, w*l);
+  }
+  Vector3 rotate(const Vector3 &v) const {
+    quat q = { x, y, z, w };
+    vec3 i = { v.x, v.y, v.z }, r;
+    quat_mul_vec3(r, q, i);
+    return Vector3(r[0], r[1], r[2]);
+  }
+  Matrix4 toMatrix() const {
+    mat4x4 r;
+    quat q = { x, y, z, w };
+    mat4x4_from_quat(r, q);
+    return Matrix4(r);
+  }
+
+  // Interpolation along the shorter arc. nlerp is a lot cheaper and close enough for
+  // the small steps between two physics states, slerp keeps a constant angular speed.
+  static Quaternion nlerp(const Quaternion &a, const Quaternion &b, float t);
+  static Quaternion slerp(const Quaternion &a, const Quaternion &b, float t);
+};
+
+Quaternion Quaternion::operator * (const Quaternion &o) const
+{
+#ifdef VEC_SSE
+  __m128 a = simd(), b = o.simd();
+  // Negates w, the only component where all three product terms are subtracted
+  __m128 flip = _mm_setr_ps(0, 0, 0, -0.0f);
+  __m128 r = _mm_mul_ps(VEC_SWIZZLE(a, 3, 3, 3, 3), b);
+  r = _mm_add_ps(r, _mm_xor_ps(_mm_mul_ps(VEC_SWIZZLE(a, 0, 1, 2, 0), VEC_SWIZZLE(b, 3, 3, 3, 0)), flip));
+  r = _mm_add_ps(r, _mm_xor_ps(_mm_mul_ps(VEC_SWIZZLE(a, 1, 2, 0, 1), VEC_SWIZZLE(b, 2, 0, 1, 1)), flip));
+  r = _mm_sub_ps(r, _mm_mul_ps(VEC_SWIZZLE(a, 2, 0, 1, 2), VEC_SWIZZLE(b, 1, 2, 0, 2)));
+  return Quaternion(r);
+#else
+  quat r, p = { x, y, z, w }, q = { o.x, o.y, o.z, o.w };
+  quat_mul(r, p, q);
+  return Quaternion(r[0], r[1], r[2], r[3]);
+#endif
+}
+
+Quaternion Quaternion::nlerp(const Quaternion &a, const Quaternion &b, float t)
+{
+  float s = dot(a, b) < 0 ? -t : t;
+#ifdef VEC_SSE
+  __m128 va = a.simd();
+  __m128 r = vec_madd(_mm_set1_ps(s), b.simd(), _mm_mul_ps(_mm_set1_ps(1 - t), va));
+  __m128 sq = _mm_mul_ps(r, r);
+  sq = _mm_add_ps(sq, VEC_SWIZZLE(sq, 1, 0, 3, 2));
+  sq = _mm_add_ps(sq, VEC_SWIZZLE(sq, 2, 3, 0, 1));
+  return Quaternion(_mm_div_ps(r, _mm_sqrt_ps(sq)));
+#else
+  return Quaternion(a.x*(1-t) + b.x*s, a.y*(1-t) + b.y*s, a.z*(1-t) + b.z*s, a.w*(1-t) + b.w*s).normalized();
+#endif
+}
+
+Quaternion Quaternion::slerp(const Quaternion &a, const Quaternion &b, float t)
+{
+  float d = dot(a, b);
+  float sign = d < 0 ? -1 : 1;
+  d = fabsf(d);
+  // Nearly the same rotation, where sin(angle) vanishes
+  if (d > 0.9995f) return nlerp(a, b, t);
+  float angle = acosf(d);
+  float inv = 1.0f / sinf(angle);
+  float wa = sinf((1 - t) * angle) * inv;
+  float wb = sinf(t * angle) * inv * sign;
+  return Quaternion(a.x*wa + b.x*wb, a.y*wa + b.y*wb, a.z*wa + b.z*wb, a.w*wa + b.w*wb);
+}
+
+// Affine transform stored as the top three rows of a matrix, the bottom row is
+// implicitly (0, 0, 0, 1). Composes in 36 multiplications instead of 64.
+class alignas(16) Affine3 {
+private:
+  float rows[3][4];
+#ifdef VEC_SSE
+  __m128 row(int i) const { return _mm_load_ps(rows[i]); }
+#endif
+  // Leaves the rows for the caller to fill in
+  struct Uninitialized {};
+  Affine3(Uninitialized) {}
+public:
+  Affine3() : rows{ { 1, 0, 0, 0 }, { 0, 1, 0, 0 }, { 0, 0, 1, 0 } } {}
+  explicit Affine3(const Matrix4 &m) {
+    for(int r=0; r<3; r++)
+      for(int c=0; c<4; c++) rows[r][c] = m[c][r];
+  }
+  Matrix4 toMatrix() const {
+    Matrix4 m = Matrix4::Identity();
+    for(int r=0; r<3; r++)
+      for(int c=0; c<4; c++) m[c][r] = rows[r][c];
+    return m;
+  }
+  // Row major, three rows of four floats as uploaded to a mat3x4 uniform
+  const float* data() const { return rows[0]; }
+  float& at(int r, int c) { return rows[r][c]; }
+  float at(int r, int c) const { return rows[r][c]; }
+  Vector3 getTranslation() const { return Vector3(rows[0][3], rows[1][3], rows[2][3]); }
+  void setTranslation(const Vector3 &t) { rows[0][3] = t.x; rows[1][3] = t.y; rows[2][3] = t.z; }
+
+  Vector3 transformPoint(const Vector3 &p) const {
+    return Vector3(rows[0][0] * p.x + rows[0][1] * p.y + rows[0][2] * p.z + rows[0][3],
+                   rows[1][0] * p.x + rows[1][1] * p.y + rows[1][2] * p.z + rows[1][3],
+                   rows[2][0] * p.x + rows[2][1] * p.y + rows[2][2] * p.z + rows[2][3]);
+  }
+  Vector3 transformDirection(const Vector3 &d) const {
+    return Vector3(rows[0][0] * d.x + rows[0][1] * d.y + rows[0][2] * d.z,
+                   rows[1][0] * d.x + rows[1][1] * d.y + rows[1][2] * d.z,
+                   rows[2][0] * d.x + rows[2][1] * d.y + rows[2][2] * d.z);
+  }
+  // Direction times the transposed linear part. On the inverse of a transform this
+  // carries surface normals through the transform, not normalized.
+  Vector3 transposeDirection(const Vector3 &d) const {
+    return Vector3(rows[0][0] * d.x + rows[1][0] * d.y + rows[2][0] * d.z,
+                   rows[0][1] * d.x + rows[1][1] * d.y + rows[2][1] * d.z,
+                   rows[0][2] * d.x + rows[1][2] * d.y + rows[2][2] * d.z);
+  }
+  Affine3 operator * (const Affine3 &o) const;
+  Affine3 inverted() const;
+  // Only valid when the linear part is a pure rotation, it is then simply transposed
+  Affine3 rigidInverted() const;
+};
+
+Affine3 Affine3::operator * (const Affine3 &o) const
+{
+  Affine3 r = Affine3(Uninitialized());
+  // Every row of the result combines the rows of o, the implicit bottom row of o
+  // contributes only the translation
+#if defined(VEC_SSE) && defined(__AVX__)
+  // The first two rows at once, each lane broadcasts its own row of this
+  __m256 o0 = _mm256_broadcast_ps((const __m128*)o.rows[0]);
+  __m256 o1 = _mm256_broadcast_ps((const __m128*)o.rows[1]);
+  __m256 o2 = _mm256_broadcast_ps((const __m128*)o.rows[2]);
+  __m256 a = _mm256_loadu_ps(rows[0]);
+  __m256 v = _mm256_blend_ps(_mm256_setzero_ps(), a, 0x88);
+  v = vec_madd(_mm256_permute_ps(a, 0x00), o0, v);
+  v = vec_madd(_mm256_permute_ps(a, 0x55), o1, v);
+  v = vec_madd(_mm256_permute_ps(a, 0xaa), o2, v);
+  _mm256_storeu_ps(r.rows[0], v);
+  __m128 a2 = row(2);
+  __m128 v2 = _mm_blend_ps(_mm_setzero_ps(), a2, 0x8);
+  v2 = vec_madd(VEC_SWIZZLE(a2, 0, 0, 0, 0), _mm256_castps256_ps128(o0), v2);
+  v2 = vec_madd(VEC_SWIZZLE(a2, 1, 1, 1, 1), _mm256_castps256_ps128(o1), v2);
+  v2 = vec_madd(VEC_SWIZZLE(a2, 2, 2, 2, 2), _mm256_castps256_ps128(o2), v2);
+  _mm_store_ps(r.rows[2], v2);
+#elif defined(VEC_SSE)
+  __m128 o0 = o.row(0), o1 = o.row(1), o2 = o.row(2);
+  __m128 w = _mm_castsi128_ps(_mm_setr_epi32(0, 0, 0, -1));
+  for(int i=0; i<3; i++) {
+    __m128 a = row(i);
+    __m128 v = _mm_and_ps(a, w);
+    v = vec_madd(VEC_SWIZZLE(a, 0, 0, 0, 0), o0, v);
+    v = vec_madd(VEC_SWIZZLE(a, 1, 1, 1, 1), o1, v);
+    v = vec_madd(VEC_SWIZZLE(a, 2, 2, 2, 2), o2, v);
+    _mm_store_ps(r.rows[i], v);
+  }
+#else
+  for(int i=0; i<3; i++) {
+    for(int j=0; j<4; j++)
+      r.rows[i][j] = rows[i][0] * o.rows[0][j] + rows[i][1] * o.rows[1][j] + rows[i][2] * o.rows[2][j];
+    r.rows[i][3] += rows[i][3];
+  }
+#endif
+  return r;
+}
+
+// The columns of the inverse of the linear part are the cross products of its rows,
+// and its rows the cross products of its columns
+Affine3 Affine3::inverted() const
+{
+#ifdef VEC_SSE
+  auto cross = [](__m128 a, __m128 b) {
+    return _mm_sub_ps(_mm_mul_ps(VEC_SWIZZLE(a, 1, 2, 0, 3), VEC_SWIZZLE(b, 2, 0, 1, 3)),
+                      _mm_mul_ps(VEC_SWIZZLE(a, 2, 0, 1, 3), VEC_SWIZZLE(b, 1, 2, 0, 3)));
+  };
+  __m128 r0 = row(0), r1 = row(1), r2 = row(2);
+  // The last lane of a cross product is zero, so the translations drop out of the dot product
+  __m128 x0 = cross(r1, r2), x1 = cross(r2, r0), x2 = cross(r0, r1);
+  __m128 det = _mm_mul_ps(r0, x0);
+  det = _mm_add_ps(det, VEC_SWIZZLE(det, 1, 0, 3, 2));
+  det = _mm_add_ps(det, VEC_SWIZZLE(det, 2, 3, 0, 1));
+  __m128 inv = _mm_div_ps(_mm_set1_ps(1), det);
+  x0 = _mm_mul_ps(x0, inv);
+  x1 = _mm_mul_ps(x1, inv);
+  x2 = _mm_mul_ps(x2, inv);
+  __m128 t = _mm_mul_ps(x0, VEC_SWIZZLE(r0, 3, 3, 3, 3));
+  t = vec_madd(x1, VEC_SWIZZLE(r1, 3, 3, 3, 3), t);
+  t = vec_madd(x2, VEC_SWIZZLE(r2, 3, 3, 3, 3), t);
+  t = _mm_sub_ps(_mm_setzero_ps(), t);
+  _MM_TRANSPOSE4_PS(x0, x1, x2, t);
+  Affine3 r = Affine3(Uninitialized());
+  _mm_store_ps(r.rows[0], x0);
+  _mm_store_ps(r.rows[1], x1);
+  _mm_store_ps(r.rows[2], x2);
+  return r;
+#else
+  Vector3 c0 = Vector3(rows[0][0], rows[1][0], rows[2][0]);
+  Vector3 c1 = Vector3(rows[0][1], rows[1][1], rows[2][1]);
+  Vector3 c2 = Vector3(rows[0][2], rows[1][2], rows[2][2]);
+  Vector3 r0 = Vector3::cross(c1, c2);
+  Vector3 r1 = Vector3::cross(c2, c0);
+  Vector3 r2 = Vector3::cross(c0, c1);
+  float inv = 1.0f / Vector3::dot(c0, r0);
+  const Vector3 inverse[3] = { r0 * inv, r1 * inv, r2 * inv };
+  Vector3 t = getTranslation();
+  Affine3 r = Affine3(Uninitialized());
+  for(int i=0; i<3; i++) {
+    r.rows[i][0] = inverse[i].x;
+    r.rows[i][1] = inverse[i].y;
+    r.rows[i][2] = inverse[i].z;
+    r.rows[i][3] = -Vector3::dot(inverse[i], t);
+  }
+  return r;
+#endif
+}
+
+Affine3 Affine3::rigidInverted() const
+{
+  Affine3 r = Affine3(Uninitialized());
+  for(int i=0; i<3; i++)
+    for(int j=0; j<3; j++) r.rows[i][j] = rows[j][i];
+  for(int i=0; i<3; i++)
+    r.rows[i][3] = -(rows[0][i] * rows[0][3] + rows[1][i] * rows[1][3] + rows[2][i] * rows[2][3]);
+  return r;
+}
+
 class Ray {
 public:
   Vector3 origin, dir;
   float length;
 
-  Ray() {}
-  Ray(Vector3 origin, Vector3 dir) : origin(origin), dir(dir) {}
+  Ray() : length(std::numeric_limits<float>::infinity()) {}
+  Ray(Vector3 origin, Vector3 dir) : origin(origin), dir(dir), length(std::numeric_limits<float>::infinity()) {}
+  Ray(Vector3 origin, Vector3 dir, float length) : origin(origin), dir(dir), length(length) {}
+  Vector3 at(float t) const { return origin + dir * t; }
+  // Reciprocal of dir for AABB::intersects. A zero component gives the largest float of its
+  // sign rather than infinity, whose product with an origin on a slab plane is NaN. Such a
+  // ray then counts as leaning by the sign of the zero, off the box at its far plane.
+  Vector3 inverseDir() const {
+    auto inverse = [](float d) { return d != 0 ? 1.0f / d : copysignf(std::numeric_limits<float>::max(), d); };
+    return Vector3(inverse(dir.x), inverse(dir.y), inverse(dir.z));
+  }
 };
 
 class Plane {
@@ -188,6 +620,48 @@ public:
   }
 }; 
 
+struct AABB {
+  Vector3 min, max;
+  AABB() : min(std::numeric_limits<float>::infinity()), max(-std::numeric_limits<float>::infinity()) {}
+  AABB(Vector3 min, Vector3 max) : min(min), max(max) {}
+
+  void consume(const Vector3 &p) {
+    min = Vector3(std::min(min.x, p.x), std::min(min.y, p.y), std::min(min.z, p.z));
+    max = Vector3(std::max(max.x, p.x), std::max(max.y, p.y), std::max(max.z, p.z));
+  }
+  static AABB merge(const AABB &a, const AABB &b) {
+    return AABB(Vector3(std::min(a.min.x, b.min.x), std::min(a.min.y, b.min.y), std::min(a.min.z, b.min.z)),
+                Vector3(std::max(a.max.x, b.max.x), std::max(a.max.y, b.max.y), std::max(a.max.z, b.max.z)));
+  }
+  AABB fattened(float margin) const { return AABB(min - Vector3(margin), max + Vector3(margin)); }
+  bool overlaps(const AABB &o) const {
+    return min.x <= o.max.x && max.x >= o.min.x &&
+           min.y <= o.max.y && max.y >= o.min.y &&
+           min.z <= o.max.z && max.z >= o.min.z;
+  }
+  bool contains(const AABB &o) const {
+    return min.x <= o.min.x && min.y <= o.min.y && min.z <= o.min.z &&
+           max.x >= o.max.x && max.y >= o.max.y && max.z >= o.max.z;
+  }
+  // Slab test, invDir holds the reciprocal of the ray direction
+  bool intersects(const Vector3 &origin, const Vector3 &invDir, float maxT, float* tmin = nullptr) const {
+    float t1 = (min.x - origin.x) * invDir.x, t2 = (max.x - origin.x) * invDir.x;
+    float lo = std::min(t1, t2), hi = std::max(t1, t2);
+    t1 = (min.y - origin.y) * invDir.y; t2 = (max.y - origin.y) * invDir.y;
+    lo = std::max(lo, std::min(t1, t2)); hi = std::min(hi, std::max(t1, t2));
+    t1 = (min.z - origin.z) * invDir.z; t2 = (max.z - origin.z) * invDir.z;
+    lo = std::max(lo, std::min(t1, t2)); hi = std::min(hi, std::max(t1, t2));
+    if (tmin) *tmin = lo;
+    return hi >= std::max(lo, 0.0f) && lo <= maxT;
+  }
+  Vector3 center() const { return (min + max) * 0.5f; }
+  Vector3 extent() const { return max - min; }
+  float surfaceArea() const {
+    Vector3 e = extent();
+    return 2 * (e.x * e.y + e.y * e.z + e.z * e.x);
+  }
+};
+
 struct Line {
   Vector3 dir;
   float a, b;
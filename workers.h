@@ -0,0 +1,85 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+
+#include "trace.h"
+
+// Threads kept alive across frames, run hands out job indices until all are done
+class WorkerPool {
+  private:
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wake, finished;
+    std::function<void(int)> task;
+    std::atomic<int> next;
+    int jobs, busy;
+    unsigned int generation;
+    bool quit;
+    void work();
+    void drain() { TRACE_SCOPE("jobs"); for(int i = next++; i < jobs; i = next++) task(i); }
+  public:
+    // The calling thread counts as one of them
+    WorkerPool(int count);
+    ~WorkerPool();
+    int size() const { return threads.size() + 1; }
+    void run(int count, const std::function<void(int)> &fn);
+};
+
+WorkerPool::WorkerPool(int count) : next(0), jobs(0), busy(0), generation(0), quit(false)
+{
+  for(int i=1; i<count; i++) threads.push_back(std::thread(&WorkerPool::work, this));
+}
+
+WorkerPool::~WorkerPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    quit = true;
+  }
+  wake.notify_all();
+  for(std::thread &t : threads) t.join();
+}
+
+void WorkerPool::work()
+{
+  Tracer::nameThread("worker");
+  unsigned int seen = 0;
+  std::unique_lock<std::mutex> lock(mutex);
+  for(;;) {
+    wake.wait(lock, [&]() { return quit || generation != seen; });
+    if (quit) return;
+    seen = generation;
+    lock.unlock();
+    drain();
+    lock.lock();
+    if (--busy == 0) finished.notify_one();
+  }
+}
+
+void WorkerPool::run(int count, const std::function<void(int)> &fn)
+{
+  if (threads.empty()) {
+    for(int i=0; i<count; i++) fn(i);
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    task = fn;
+    jobs = count;
+    next = 0;
+    busy = threads.size();
+    generation++;
+  }
+  wake.notify_all();
+  drain();
+  std::unique_lock<std::mutex> lock(mutex);
+  finished.wait(lock, [&]() { return busy == 0; });
+}
+
+#endif
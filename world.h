@@ -0,0 +1,477 @@
+#ifndef WORLD_H
+#define WORLD_H
+
+#include <vector>
+#include <functional>
+#include "vec.h"
+#include "logger.h"
+#include "solid.h"
+#include "contact.h"
+#include "broadphase.h"
+#include "hashgrid.h"
+
+// Velocity bias used to push penetrating bodies apart, per unit of depth
+#define BAUMGARTE 0.2f
+// Penetration that is tolerated to keep resting contacts alive between frames
+#define PENETRATION_SLOP 0.01f
+// Bodies slower than this (units per step) for SLEEP_STEPS steps are put to sleep
+#define SLEEP_VELOCITY 0.001f
+#define SLEEP_STEPS 60
+// Bodies moving further than this fraction of their smallest extent in a single
+// step are swept against the world to prevent tunneling
+#define CCD_MOTION_FRACTION 0.25f
+// Distance kept to the surface hit by a swept body
+#define CCD_SKIN 0.01f
+// Broadphase bit of bodies that can move, static bodies only look for those
+#define DYNAMIC_PROXY (1u << 31)
+
+// Pairs handled by the broadphase and the narrowphase in the last step
+struct PairStats {
+  // Broadphase subtrees skipped since they held no movable body, only counted for
+  // static bodies that were moved. Every subtree counts once, however many it holds.
+  int staticPruned;
+  // Pairs and subtrees outside of each other's layers
+  int layerRejected;
+  // Pairs refused by the pair filter
+  int filterRejected;
+  // Pairs that made it to the narrowphase
+  int tested;
+  // Tested box pairs that the separating axis of the previous test still separated,
+  // and those that needed the full test
+  int axisHits, axisMisses;
+  PairStats() : staticPruned(0), layerRejected(0), filterRejected(0), tested(0), axisHits(0), axisMisses(0) {}
+  int rejected() const { return staticPruned + layerRejected + filterRejected; }
+};
+
+enum BroadphaseType {
+  // Adapts to any distribution of sizes and positions
+  BROADPHASE_TREE,
+  // Faster for many bodies of similar size
+  BROADPHASE_GRID
+};
+
+class PhysicsWorld {
+  private:
+    std::vector<ISolid*> solids;
+    // Bodies that move, query the broadphase and are integrated this step
+    std::vector<ISolid*> awake;
+    std::vector<ContactManifold*> active;
+    DynamicTree tree;
+    HashGrid grid;
+    BroadphaseType broadphase;
+    ContactCache cache;
+    SeparatingAxisCache separatingAxes;
+    unsigned int frame;
+
+    void updateProxies();
+    void collideAll();
+    bool collidePair(const ISolid* a, const ISolid* b, unsigned long long key, ContactManifold* manifold);
+    void warmStart();
+    float solveIteration();
+    void integrate();
+    float timeOfImpact(ISolid* s, const Vector3 &reach, Vector3* normal);
+    void updateSleep();
+    static unsigned int proxyBits(const ISolid* s) { return s->isStatic() ? s->category : s->category | DYNAMIC_PROXY; }
+    int insertProxy(ISolid* s) {
+      AABB box = s->getBoundary().getAABB();
+      return broadphase == BROADPHASE_GRID ? grid.insert(box, s, proxyBits(s)) : tree.insert(box, s, proxyBits(s));
+    }
+    const AABB& proxyAABB(const ISolid* s) const {
+      return broadphase == BROADPHASE_GRID ? grid.getFatAABB(s->proxy) : tree.getFatAABB(s->proxy);
+    }
+  public:
+    // Acceleration per step, scaled per body by its gravityScale
+    Vector3 gravity;
+    bool warmStarting, continuousCollision;
+    // Tests the last separating axis of a pair of boxes before running the full test
+    bool separatingAxisCaching;
+    int maxIterations;
+    // Solving stops once no accumulated impulse changes more than this
+    float tolerance;
+    // Iterations used by the last step
+    int iterations;
+    // Largest impulse change of the last iteration of the last step, at or above the
+    // tolerance when the solver ran out of iterations
+    float residual;
+
+    PhysicsWorld() : broadphase(BROADPHASE_TREE), frame(0), gravity(0, -0.004f, 0), warmStarting(true), continuousCollision(true), separatingAxisCaching(true), maxIterations(30), tolerance(1e-5f), iterations(0), residual(0), ccdHits(0) {}
+    void add(ISolid* solid);
+    // Must be called for bodies that are moved explicitly, such as static platforms
+    void wake(ISolid* solid);
+    const std::vector<ISolid*>& getSolids() const { return solids; }
+    BroadphaseType getBroadphase() const { return broadphase; }
+    // Moves every solid over to the other broadphase
+    void setBroadphase(BroadphaseType type);
+    // Broadphase queries, see DynamicTree::query and DynamicTree::raycast
+    template <typename F> int query(const AABB &box, F callback, unsigned int mask = ~0u) const {
+      return broadphase == BROADPHASE_GRID ? grid.query(box, callback, mask) : tree.query(box, callback, mask);
+    }
+    template <typename F> void raycast(const Ray &ray, float maxT, F callback) const {
+      if (broadphase == BROADPHASE_GRID) grid.raycast(ray, maxT, callback);
+      else tree.raycast(ray, maxT, callback);
+    }
+    size_t contactCount() const { return active.size(); }
+    size_t awakeCount() const { return awake.size(); }
+    // Number of bodies that were stopped at their time of impact in the last step
+    int ccdHits;
+    // Called for pairs whose layers match, returning false ignores the pair.
+    // Also consulted by continuous collision.
+    std::function<bool(const ISolid*, const ISolid*)> pairFilter;
+    PairStats pairStats;
+    bool shouldCollide(const ISolid* a, const ISolid* b) const {
+      return a->collidesWith(b) && (!pairFilter || pairFilter(a, b));
+    }
+    void step();
+};
+
+static void tangentBasis(const Vector3 &n, Vector3* t1, Vector3* t2)
+{
+  // Deterministic in n, so the tangent impulses remain valid for warm starting
+  if (fabs(n.x) >= 0.57735f) *t1 = Vector3(n.y, -n.x, 0).normalize();
+  else                       *t1 = Vector3(0, n.z, -n.y).normalize();
+  *t2 = Vector3::cross(n, *t1);
+}
+
+static bool collideSolids(const ISolid* a, const ISolid* b, ContactManifold* manifold)
+{
+  // Mesh against mesh is not supported, those fall back to their boundaries
+  if (a->collider && !b->collider)
+    return collideMesh(*a->collider, a->getBoundary(), b->getBoundary(), manifold);
+  if (b->collider && !a->collider) {
+    if (!collideMesh(*b->collider, b->getBoundary(), a->getBoundary(), manifold)) return false;
+    manifold->normal = -manifold->normal;
+    return true;
+  }
+  return collide(a->getBoundary(), b->getBoundary(), manifold);
+}
+
+bool PhysicsWorld::collidePair(const ISolid* a, const ISolid* b, unsigned long long key, ContactManifold* manifold)
+{
+  if (!separatingAxisCaching || a->collider || b->collider) return collideSolids(a, b, manifold);
+
+  // Axes are stored from the point of view of the lower id, intersects numbers the
+  // normals of its argument first
+  bool swapped = a->id > b->id;
+  const OBB &first = swapped ? b->getBoundary() : a->getBoundary();
+  const OBB &second = swapped ? a->getBoundary() : b->getBoundary();
+  int axis = separatingAxes.lookup(key);
+  if (axis >= 0 && first.separatedBy(second, axis)) {
+    pairStats.axisHits++;
+    separatingAxes.store(key, axis, frame);
+    return false;
+  }
+  pairStats.axisMisses++;
+
+  int separating;
+  if (collide(a->getBoundary(), b->getBoundary(), manifold, &separating)) {
+    if (axis >= 0) separatingAxes.store(key, -1, frame);
+    return true;
+  }
+  // Seen from b the normals of both boxes trade places
+  separatingAxes.store(key, swapped ? (separating + 3) % 6 : separating, frame);
+  return false;
+}
+
+void PhysicsWorld::add(ISolid* solid)
+{
+  solids.push_back(solid);
+  solid->proxy = insertProxy(solid);
+  solid->awake = false;
+  wake(solid);
+}
+
+void PhysicsWorld::setBroadphase(BroadphaseType type)
+{
+  if (type == broadphase) return;
+  for(ISolid* s : solids) {
+    if (broadphase == BROADPHASE_GRID) grid.remove(s->proxy);
+    else tree.remove(s->proxy);
+  }
+  broadphase = type;
+  for(ISolid* s : solids) s->proxy = insertProxy(s);
+}
+
+void PhysicsWorld::wake(ISolid* solid)
+{
+  solid->sleepTime = 0;
+  if (solid->awake) return;
+  solid->awake = true;
+  solid->awakeIndex = awake.size();
+  awake.push_back(solid);
+}
+
+void PhysicsWorld::updateProxies()
+{
+  for(ISolid* s : awake) {
+    AABB box = s->getBoundary().getAABB();
+    unsigned int bits = proxyBits(s);
+    if (broadphase == BROADPHASE_GRID) {
+      grid.move(s->proxy, box);
+      grid.setBits(s->proxy, bits);
+      continue;
+    }
+    tree.move(s->proxy, box);
+    if (tree.getBits(s->proxy) != bits) tree.setBits(s->proxy, bits);
+  }
+}
+
+void PhysicsWorld::collideAll()
+{
+  active.clear();
+  pairStats = PairStats();
+  // Only awake bodies query the tree, resting bodies are merely found by them.
+  // Bodies woken meanwhile are appended and do not query.
+  int count = awake.size();
+  for(int i=0; i<count; i++) {
+    ISolid* a = awake[i];
+    // Nothing to resolve between two immovable bodies, so static bodies skip
+    // every part of the tree that holds static geometry only
+    unsigned int mask = a->isStatic() ? DYNAMIC_PROXY : a->mask | DYNAMIC_PROXY;
+    int skipped = query(proxyAABB(a), [&](void* data) {
+      ISolid* b = (ISolid*)data;
+      if (b == a) return true;
+      // Pairs of bodies that both query are visited from both sides
+      if (b->awake && b->awakeIndex < count && b->id < a->id) return true;
+      if (!a->collidesWith(b)) {
+        pairStats.layerRejected++;
+        return true;
+      }
+      if (pairFilter && !pairFilter(a, b)) {
+        pairStats.filterRejected++;
+        return true;
+      }
+      pairStats.tested++;
+
+      unsigned long long key = ContactCache::key(a->id, b->id);
+      ContactManifold fresh;
+      if (!collidePair(a, b, key, &fresh)) return true;
+      // Touching a resting body wakes it
+      if (!b->awake && !b->isStatic()) wake(b);
+      fresh.a = a;
+      fresh.b = b;
+      fresh.frame = frame;
+      active.push_back(cache.update(key, fresh, warmStarting));
+      return true;
+    }, mask);
+    if (a->isStatic()) pairStats.staticPruned += skipped;
+    else pairStats.layerRejected += skipped;
+  }
+  // The broadphase reports pairs in an order of its own. Solving them by body ids
+  // makes the results the same for every broadphase.
+  std::sort(active.begin(), active.end(), [](const ContactManifold* l, const ContactManifold* r) {
+    return ContactCache::key(l->a->id, l->b->id) < ContactCache::key(r->a->id, r->b->id);
+  });
+  cache.prune(frame);
+}
+
+void PhysicsWorld::warmStart()
+{
+  for(ContactManifold* m : active) {
+    Vector3 t1, t2;
+    tangentBasis(m->normal, &t1, &t2);
+    for(int i=0; i<m->count; i++) {
+      const Contact &c = m->contacts[i];
+      Vector3 P = m->normal * c.normalImpulse + t1 * c.tangentImpulse[0] + t2 * c.tangentImpulse[1];
+      m->a->velocity -= P * m->a->inverseMass;
+      m->b->velocity += P * m->b->inverseMass;
+    }
+  }
+}
+
+// A single Gauss-Seidel sweep over all contacts, returns the largest impulse change.
+float PhysicsWorld::solveIteration()
+{
+  float maxDelta = 0;
+  for(ContactManifold* m : active) {
+    ISolid* a = m->a;
+    ISolid* b = m->b;
+    float mass = 1.0f / (a->inverseMass + b->inverseMass);
+    float friction = sqrt(a->friction * b->friction);
+    Vector3 t1, t2;
+    tangentBasis(m->normal, &t1, &t2);
+    const Vector3 tangents[2] = { t1, t2 };
+
+    for(int i=0; i<m->count; i++) {
+      Contact &c = m->contacts[i];
+
+      // Normal constraint, b must move away from a at least as fast as the bias
+      float vn = Vector3::dot(b->velocity - a->velocity, m->normal);
+      float bias = BAUMGARTE * std::max(c.depth - PENETRATION_SLOP, 0.0f);
+      float acc = std::max(c.normalImpulse + (bias - vn) * mass, 0.0f);
+      float delta = acc - c.normalImpulse;
+      c.normalImpulse = acc;
+      a->velocity -= m->normal * (delta * a->inverseMass);
+      b->velocity += m->normal * (delta * b->inverseMass);
+      maxDelta = std::max(maxDelta, fabs(delta));
+
+      // Coulomb friction, bounded by the normal impulse of this contact
+      float bound = friction * c.normalImpulse;
+      for(int t=0; t<2; t++) {
+        float vt = Vector3::dot(b->velocity - a->velocity, tangents[t]);
+        float tacc = clamp(c.tangentImpulse[t] - vt * mass, -bound, bound);
+        float tdelta = tacc - c.tangentImpulse[t];
+        c.tangentImpulse[t] = tacc;
+        a->velocity -= tangents[t] * (tdelta * a->inverseMass);
+        b->velocity += tangents[t] * (tdelta * b->inverseMass);
+        maxDelta = std::max(maxDelta, fabs(tdelta));
+      }
+    }
+  }
+  return maxDelta;
+}
+
+// Earliest time of impact of a fast body over its motion this step, 1 when nothing is hit.
+// Every body must still be where the step started, reach bounds the motion of any other
+// so that those moving into the path are found as well.
+float PhysicsWorld::timeOfImpact(ISolid* s, const Vector3 &reach, Vector3* normal)
+{
+  float toi = 1;
+  const OBB &box = s->getBoundary();
+  AABB from = box.getAABB();
+  AABB swept = AABB::merge(from, AABB(from.min + s->velocity, from.max + s->velocity));
+  swept = AABB(swept.min - reach, swept.max + reach);
+  query(swept, [&](void* data) {
+    ISolid* o = (ISolid*)data;
+    if (o == s || !shouldCollide(s, o)) return true;
+    float t;
+    Vector3 n;
+    // Mesh solids are swept against their triangles, the boundary only bounds them
+    bool hit = o->collider ? o->collider->sweepBox(box, s->velocity - o->velocity, o->getBoundary().m, &t, &n)
+                           : box.sweep(o->getBoundary(), s->velocity - o->velocity, &t, &n);
+    if (hit && t < toi) {
+      toi = t;
+      *normal = n;
+    }
+    return true;
+  }, s->mask | DYNAMIC_PROXY);
+  return toi;
+}
+
+void PhysicsWorld::integrate()
+{
+  ccdHits = 0;
+  // All sweeps run before anything moves, as the relative motion they sweep by starts
+  // from where both bodies were at the start of the step
+  struct Impact {
+    size_t index;
+    float toi;
+    Vector3 normal;
+  };
+  std::vector<Impact> impacts;
+  if (continuousCollision) {
+    Vector3 reach(0);
+    bool measured = false;
+    for(size_t i=0; i<awake.size(); i++) {
+      ISolid* s = awake[i];
+      if (s->isStatic() || s->velocity.length() <= CCD_MOTION_FRACTION * s->getBoundary().smallestExtent()) continue;
+      if (!measured) {
+        for(const ISolid* o : awake)
+          reach = Vector3(std::max(reach.x, fabs(o->velocity.x)), std::max(reach.y, fabs(o->velocity.y)), std::max(reach.z, fabs(o->velocity.z)));
+        measured = true;
+      }
+      Vector3 normal;
+      float toi = timeOfImpact(s, reach, &normal);
+      if (toi < 1) impacts.push_back({ i, toi, normal });
+    }
+  }
+
+  size_t next = 0;
+  for(size_t i=0; i<awake.size(); i++) {
+    ISolid* s = awake[i];
+    if (next < impacts.size() && impacts[next].index == i) {
+      const Impact &impact = impacts[next++];
+      // Stop just short of the surface and drop the approaching velocity,
+      // the discrete solver picks up the contact next step.
+      float t = std::max(impact.toi - CCD_SKIN / s->velocity.length(), 0.0f);
+      s->translate(s->velocity * t);
+      s->velocity -= impact.normal * std::min(Vector3::dot(s->velocity, impact.normal), 0.0f);
+      s->updateBoundary();
+      ccdHits++;
+      continue;
+    }
+    if (s->isStatic()) continue;
+    s->translate(s->velocity);
+    s->updateBoundary();
+  }
+}
+
+static int findIsland(std::vector<int> &parents, int i)
+{
+  while(parents[i] != i) {
+    parents[i] = parents[parents[i]];
+    i = parents[i];
+  }
+  return i;
+}
+
+// Bodies connected by contacts form an island, which only goes to sleep as a whole.
+void PhysicsWorld::updateSleep()
+{
+  const float threshold = SLEEP_VELOCITY * SLEEP_VELOCITY;
+  std::vector<int> parents(awake.size());
+  std::vector<int> islandTime(awake.size(), std::numeric_limits<int>::max());
+  for(size_t i=0; i<awake.size(); i++) {
+    ISolid* s = awake[i];
+    parents[i] = i;
+    if (s->isStatic()) continue;
+    if (!s->allowSleep || s->velocity.sq_length() > threshold) s->sleepTime = 0;
+    else s->sleepTime++;
+  }
+
+  // Static bodies don't connect islands since they never move
+  for(ContactManifold* m : active) {
+    if (m->a->isStatic() || m->b->isStatic()) continue;
+    int ia = findIsland(parents, m->a->awakeIndex);
+    int ib = findIsland(parents, m->b->awakeIndex);
+    parents[ia] = ib;
+  }
+
+  for(size_t i=0; i<awake.size(); i++) {
+    ISolid* s = awake[i];
+    int island = findIsland(parents, i);
+    int time = s->isStatic() ? std::numeric_limits<int>::max() : s->sleepTime;
+    islandTime[island] = std::min(islandTime[island], time);
+  }
+
+  size_t kept = 0;
+  for(size_t i=0; i<awake.size(); i++) {
+    ISolid* s = awake[i];
+    // Static bodies only stay awake for the step in which they were moved
+    if (s->isStatic() || islandTime[findIsland(parents, i)] >= SLEEP_STEPS) {
+      s->awake = false;
+      s->velocity = Vector3(0);
+      continue;
+    }
+    s->awakeIndex = kept;
+    awake[kept++] = s;
+  }
+  awake.resize(kept);
+}
+
+void PhysicsWorld::step()
+{
+  frame++;
+  for(ISolid* s : awake)
+    if (!s->isStatic()) s->velocity += gravity * s->gravityScale;
+  updateProxies();
+  collideAll();
+  if (warmStarting) warmStart();
+
+  iterations = 0;
+  residual = 0;
+  while(iterations < maxIterations) {
+    iterations++;
+    residual = solveIteration();
+    if (residual < tolerance) break;
+  }
+
+  for(ContactManifold* m : active) {
+    m->a->onCollision(m->b, -m->normal, m->depth);
+    m->b->onCollision(m->a, m->normal, m->depth);
+  }
+
+  integrate();
+  updateSleep();
+}
+
+#endif